@@ -43,7 +43,8 @@ void getCPUFeatures(CPUFeatures *cpuFeatures) {
     cpuFeatures->fma3 = !!(ecx & (1 << 12));
     if ((ecx & (1 << 27)) && (ecx & (1 << 28))) {
         nnedi3_cpu_xgetbv(0, &eax, &edx);
-        cpuFeatures->avx = ((eax & 0x6) == 0x6);
+        uint32_t xcr0 = eax;
+        cpuFeatures->avx = ((xcr0 & 0x6) == 0x6);
         if (cpuFeatures->avx) {
             eax = 0;
             ebx = 0;
@@ -51,6 +52,13 @@ void getCPUFeatures(CPUFeatures *cpuFeatures) {
             edx = 0;
             nnedi3_cpu_cpuid(7, &eax, &ebx, &ecx, &edx);
             cpuFeatures->avx2 = !!(ebx & (1 << 5));
+
+            // The OS must also save the opmask and zmm registers.
+            if ((xcr0 & 0xe0) == 0xe0) {
+                cpuFeatures->avx512f = !!(ebx & (1 << 16));
+                cpuFeatures->avx512bw = !!(ebx & (1 << 30));
+                cpuFeatures->avx512vnni = !!(ecx & (1 << 11));
+            }
         }
     }
 
@@ -74,7 +82,11 @@ void getCPUFeatures(CPUFeatures *cpuFeatures) {
 
     cpuFeatures->can_run_vs = 1;
 
-#if defined(NNEDI3_ARM)
+#if defined(NNEDI3_ARM) && defined(__aarch64__)
+    // Advanced SIMD (NEON) is part of the base AArch64 architecture.
+    cpuFeatures->neon = !!(hwcap & HWCAP_ASIMD);
+    cpuFeatures->idiv_a = 1;
+#elif defined(NNEDI3_ARM)
     cpuFeatures->half_fp = !!(hwcap & HWCAP_ARM_HALF);
     cpuFeatures->edsp = !!(hwcap & HWCAP_ARM_EDSP);
     cpuFeatures->iwmmxt = !!(hwcap & HWCAP_ARM_IWMMXT);
@@ -0,0 +1,36 @@
+// Puts a copy of nnedi3_weights.bin in the read-only data of the plugin.
+// NNEDI3_WEIGHTS_FILE is the absolute path to the file, as a string.
+
+#ifndef NNEDI3_WEIGHTS_FILE
+#error "NNEDI3_WEIGHTS_FILE must be defined"
+#endif
+
+#define STRINGIFY2(x) #x
+#define STRINGIFY(x) STRINGIFY2(x)
+
+#define SYMBOL(name) STRINGIFY(__USER_LABEL_PREFIX__) name
+
+#if defined(__APPLE__)
+#define SECTION ".const_data"
+#define HIDDEN(name) ".private_extern " SYMBOL(name)
+#elif defined(_WIN32)
+#define SECTION ".section .rdata,\"dr\""
+#define HIDDEN(name) ""
+#else
+#define SECTION ".section .rodata"
+#define HIDDEN(name) ".hidden " SYMBOL(name)
+#endif
+
+// nnedi3_embedded_weights_end is right after the copy, so that its size is known.
+__asm__(
+    SECTION "\n"
+    ".balign 64\n"
+    ".globl " SYMBOL("nnedi3_embedded_weights") "\n"
+    HIDDEN("nnedi3_embedded_weights") "\n"
+    ".globl " SYMBOL("nnedi3_embedded_weights_end") "\n"
+    HIDDEN("nnedi3_embedded_weights_end") "\n"
+    SYMBOL("nnedi3_embedded_weights") ":\n"
+    ".incbin \"" NNEDI3_WEIGHTS_FILE "\"\n"
+    SYMBOL("nnedi3_embedded_weights_end") ":\n"
+    ".previous\n"
+);
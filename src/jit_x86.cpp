@@ -0,0 +1,559 @@
+/*
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "jit_x86.h"
+#include "simd_dotprod.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// The generated functions do the same operations in the same order as
+// the AVX2 functions in simd_avx2.c, so their results are the same.
+// What they gain is that the loops are unrolled for the exact sizes, the
+// prescreener weights sit in the code, already broadcast, and the
+// predictor keeps its inputs in registers when they fit.
+
+
+struct JitCode {
+    void *code;
+    size_t size;
+};
+
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9, R10 = 10, R11 = 11
+};
+
+
+// A memory operand: base + disp, or an entry in the constant pool.
+typedef struct {
+    int base; // -1 for the constant pool
+    int32_t disp;
+} Mem;
+
+
+static Mem mem(int base, int32_t disp) {
+    Mem m = { base, disp };
+    return m;
+}
+
+
+// VEX prefixes.
+enum {
+    PP_NONE = 0, PP_66 = 1, PP_F3 = 2, PP_F2 = 3
+};
+
+enum {
+    MAP_0F = 1, MAP_0F38 = 2, MAP_0F3A = 3
+};
+
+
+class Assembler {
+public:
+    std::vector<uint8_t> code;
+
+    // Returns a memory operand for a 32 byte constant, which is added to
+    // the pool after the code.
+    Mem constant(const void *data, size_t size) {
+        Mem m = { -1, (int32_t)pool.size() };
+        pool.insert(pool.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+        while (pool.size() & 31)
+            pool.push_back(0);
+        return m;
+    }
+
+    // vop dst, src1, src2 with registers only. src1 is -1 when the
+    // instruction has no vvvv operand, imm is -1 when it has no immediate.
+    void vexRegs(int pp, int map, int w, int l, int opcode, int dst, int src1, int src2, int imm = -1) {
+        vexPrefix(pp, map, w, l, dst, src1, src2 >= 8);
+        emit(opcode);
+        emit(0xc0 | ((dst & 7) << 3) | (src2 & 7));
+        if (imm >= 0)
+            emit(imm);
+    }
+
+    // vop reg, src1, [mem]. reg is the source for stores.
+    void vexMem(int pp, int map, int w, int l, int opcode, int reg, int src1, Mem m, int imm = -1) {
+        vexPrefix(pp, map, w, l, reg, src1, m.base >= 8);
+        emit(opcode);
+        modrmMem(reg, m);
+        if (imm >= 0)
+            emit(imm);
+
+        // The displacement of a pool operand counts from the end of the instruction.
+        if (m.base < 0)
+            fixups.back().end = code.size();
+    }
+
+    void emit(int byte) {
+        code.push_back((uint8_t)byte);
+    }
+
+    void emit32(int32_t value) {
+        for (int i = 0; i < 4; i++)
+            emit((value >> (i * 8)) & 0xff);
+    }
+
+    // Appends the constant pool, aligned to 32 bytes, and resolves the
+    // operands that refer to it.
+    void finish() {
+        while (code.size() & 31)
+            emit(0xcc);
+
+        const size_t pool_start = code.size();
+        code.insert(code.end(), pool.begin(), pool.end());
+
+        for (size_t i = 0; i < fixups.size(); i++) {
+            const int32_t disp = (int32_t)(pool_start + fixups[i].pool_offset - fixups[i].end);
+            memcpy(&code[fixups[i].pos], &disp, sizeof(disp));
+        }
+    }
+
+private:
+    typedef struct {
+        size_t pos; // of the displacement
+        size_t end; // of the instruction
+        int32_t pool_offset;
+    } Fixup;
+
+    std::vector<uint8_t> pool;
+    std::vector<Fixup> fixups;
+
+    void vexPrefix(int pp, int map, int w, int l, int reg, int src1, int b) {
+        const int r = !(reg & 8);
+        const int vvvv = src1 < 0 ? 15 : (~src1 & 15);
+
+        if (!b && !w && map == MAP_0F) {
+            emit(0xc5);
+            emit((r << 7) | (vvvv << 3) | (l << 2) | pp);
+        } else {
+            emit(0xc4);
+            emit((r << 7) | (1 << 6) | (!b << 5) | map);
+            emit((w << 7) | (vvvv << 3) | (l << 2) | pp);
+        }
+    }
+
+    void modrmMem(int reg, Mem m) {
+        if (m.base < 0) {
+            emit(((reg & 7) << 3) | 5);
+            Fixup f = { code.size(), 0, m.disp };
+            fixups.push_back(f);
+            emit32(0);
+        } else if (m.disp == 0 && (m.base & 7) != 5) {
+            emit(((reg & 7) << 3) | (m.base & 7));
+        } else if (m.disp >= -128 && m.disp < 128) {
+            emit(0x40 | ((reg & 7) << 3) | (m.base & 7));
+            emit(m.disp);
+        } else {
+            emit(0x80 | ((reg & 7) << 3) | (m.base & 7));
+            emit32(m.disp);
+        }
+    }
+};
+
+
+// The AVX2 instructions used. rsp and r12 can't be used as the base of
+// a memory operand, because they need a SIB byte.
+#define YMM_OP(name, pp, map, w, opcode) \
+    static inline void name(Assembler &a, int dst, int src1, int src2) { a.vexRegs(pp, map, w, 1, opcode, dst, src1, src2); } \
+    static inline void name(Assembler &a, int dst, int src1, Mem src2) { a.vexMem(pp, map, w, 1, opcode, dst, src1, src2); }
+
+YMM_OP(vaddps, PP_NONE, MAP_0F, 0, 0x58)
+YMM_OP(vmulps, PP_NONE, MAP_0F, 0, 0x59)
+YMM_OP(vandps, PP_NONE, MAP_0F, 0, 0x54)
+YMM_OP(vxorps, PP_NONE, MAP_0F, 0, 0x57)
+YMM_OP(vhaddps, PP_F2, MAP_0F, 0, 0x7c)
+YMM_OP(vpaddd, PP_66, MAP_0F, 0, 0xfe)
+YMM_OP(vpmaddwd, PP_66, MAP_0F, 0, 0xf5)
+YMM_OP(vpunpcklqdq, PP_66, MAP_0F, 0, 0x6c)
+YMM_OP(vpunpckhqdq, PP_66, MAP_0F, 0, 0x6d)
+YMM_OP(vpackssdw, PP_66, MAP_0F, 0, 0x6b)
+YMM_OP(vpacksswb, PP_66, MAP_0F, 0, 0x63)
+YMM_OP(vphaddd, PP_66, MAP_0F38, 0, 0x02)
+YMM_OP(vfmadd213ps, PP_66, MAP_0F38, 0, 0xa8)
+YMM_OP(vfmadd231ps, PP_66, MAP_0F38, 0, 0xb8)
+
+#undef YMM_OP
+
+#define YMM_OP_IMM(name, pp, map, opcode) \
+    static inline void name(Assembler &a, int dst, int src1, int src2, int imm) { a.vexRegs(pp, map, 0, 1, opcode, dst, src1, src2, imm); }
+
+YMM_OP_IMM(vshufps, PP_NONE, MAP_0F, 0xc6)
+YMM_OP_IMM(vcmpps, PP_NONE, MAP_0F, 0xc2)
+YMM_OP_IMM(vperm2f128, PP_66, MAP_0F3A, 0x06)
+YMM_OP_IMM(vperm2i128, PP_66, MAP_0F3A, 0x46)
+
+#undef YMM_OP_IMM
+
+static void vcvtdq2ps(Assembler &a, int dst, int src) {
+    a.vexRegs(PP_NONE, MAP_0F, 0, 1, 0x5b, dst, -1, src);
+}
+
+static void vrcpps(Assembler &a, int dst, int src) {
+    a.vexRegs(PP_NONE, MAP_0F, 0, 1, 0x53, dst, -1, src);
+}
+
+static void vpermilps(Assembler &a, int dst, int src, int imm) {
+    a.vexRegs(PP_66, MAP_0F3A, 0, 1, 0x04, dst, -1, src, imm);
+}
+
+static void vmovups(Assembler &a, int dst, Mem src) {
+    a.vexMem(PP_NONE, MAP_0F, 0, 1, 0x10, dst, -1, src);
+}
+
+static void vmovups(Assembler &a, Mem dst, int src) {
+    a.vexMem(PP_NONE, MAP_0F, 0, 1, 0x11, src, -1, dst);
+}
+
+static void vbroadcastss(Assembler &a, int dst, Mem src) {
+    a.vexMem(PP_66, MAP_0F38, 0, 1, 0x18, dst, -1, src);
+}
+
+// The 128 bit instructions.
+static void vmovdqu_xmm(Assembler &a, int dst, Mem src) {
+    a.vexMem(PP_F3, MAP_0F, 0, 0, 0x6f, dst, -1, src);
+}
+
+static void vmovq_store(Assembler &a, Mem dst, int src) {
+    a.vexMem(PP_66, MAP_0F, 0, 0, 0xd6, src, -1, dst);
+}
+
+static void vpunpckldq_xmm(Assembler &a, int dst, int src1, int src2) {
+    a.vexRegs(PP_66, MAP_0F, 0, 0, 0x62, dst, src1, src2);
+}
+
+static void vpandn_xmm(Assembler &a, int dst, int src1, Mem src2) {
+    a.vexMem(PP_66, MAP_0F, 0, 0, 0xdf, dst, src1, src2);
+}
+
+static void vinserti128(Assembler &a, int dst, int src1, Mem src2, int imm) {
+    a.vexMem(PP_66, MAP_0F3A, 0, 1, 0x38, dst, src1, src2, imm);
+}
+
+static void vextracti128(Assembler &a, int dst, int src, int imm) {
+    a.vexRegs(PP_66, MAP_0F3A, 0, 1, 0x39, src, -1, dst, imm);
+}
+
+static void vzeroupper(Assembler &a) {
+    a.emit(0xc5);
+    a.emit(0xf8);
+    a.emit(0x77);
+}
+
+// The general purpose instructions, with 64 bit operands.
+static void lea(Assembler &a, int dst, int base, int32_t disp) {
+    a.emit(0x48 | ((dst >> 3) << 2) | (base >> 3));
+    a.emit(0x8d);
+    a.emit(0x80 | ((dst & 7) << 3) | (base & 7));
+    a.emit32(disp);
+}
+
+static void addImm(Assembler &a, int dst, int32_t imm) {
+    a.emit(0x48 | (dst >> 3));
+    a.emit(0x81);
+    a.emit(0xc0 | (dst & 7));
+    a.emit32(imm);
+}
+
+static void movImm32(Assembler &a, int dst, int32_t imm) {
+    if (dst >= 8)
+        a.emit(0x41);
+    a.emit(0xb8 | (dst & 7));
+    a.emit32(imm);
+}
+
+// dec reg32; jnz target
+static void decJnz(Assembler &a, int reg, size_t target) {
+    if (reg >= 8)
+        a.emit(0x41);
+    a.emit(0xff);
+    a.emit(0xc8 | (reg & 7));
+    a.emit(0x0f);
+    a.emit(0x85);
+    a.emit32((int32_t)(target - (a.code.size() + 4)));
+}
+
+static void ret(Assembler &a) {
+    a.emit(0xc3);
+}
+
+
+// Copies the code to memory that can be executed, but not written.
+static JitCode *install(Assembler &a) {
+    a.finish();
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t size = (a.code.size() + page_size - 1) / page_size * page_size;
+
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return NULL;
+
+    memcpy(code, a.code.data(), a.code.size());
+
+    JitCode *jit = (JitCode *)malloc(sizeof(JitCode));
+    if (!jit || mprotect(code, size, PROT_READ | PROT_EXEC)) {
+        free(jit);
+        munmap(code, size);
+        return NULL;
+    }
+
+    jit->code = code;
+    jit->size = size;
+
+    return jit;
+}
+
+
+// Adds 16 bytes of weights to the pool, twice, like _mm256_broadcastsi128_si256.
+static Mem broadcastConstant(Assembler &a, const uint8_t *weights) {
+    uint8_t w[32];
+    memcpy(w, weights, 16);
+    memcpy(w + 16, weights, 16);
+    return a.constant(w, sizeof(w));
+}
+
+
+// Arguments: rdi = data, rsi = weights (ignored), rdx = d.
+//
+// Register use: ymm0..3 accumulate the sums of the four neurons, ymm4
+// holds the pixels of both groups, one group in each half. The constants
+// are stored in the order they are used.
+JitCode *jitComputeNetwork0new_AVX2(const float *weightsf) {
+    const uint8_t *weights = (const uint8_t *)weightsf;
+
+    try {
+        Assembler a;
+
+        for (int i = 0; i < 128; i += 16) {
+            vmovdqu_xmm(a, 4, mem(RDI, i));
+            vinserti128(a, 4, 4, mem(RDI, 128 + i), 1);
+
+            for (int k = 0; k < 4; k++) {
+                const Mem w = broadcastConstant(a, weights + i * 4 + k * 16);
+
+                if (i == 0) {
+                    vpmaddwd(a, k, 4, w);
+                } else {
+                    vpmaddwd(a, 5, 4, w);
+                    vpaddd(a, k, k, 5);
+                }
+            }
+        }
+
+        vpunpcklqdq(a, 5, 0, 1);
+        vpunpckhqdq(a, 6, 0, 1);
+        vpaddd(a, 0, 5, 6);
+        vpunpcklqdq(a, 5, 2, 3);
+        vpunpckhqdq(a, 6, 2, 3);
+        vpaddd(a, 2, 5, 6);
+
+        vshufps(a, 5, 0, 2, 136);
+        vshufps(a, 6, 0, 2, 221);
+        vpaddd(a, 0, 5, 6);
+
+        const uint32_t abs_mask[8] = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+        const float ones[8] = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
+        uint8_t byte_ones[32];
+        memset(byte_ones, 1, sizeof(byte_ones));
+
+        // Separate multiplications and additions, like in the SSE2 version.
+        vcvtdq2ps(a, 7, 0);
+        vmulps(a, 7, 7, broadcastConstant(a, weights + 512));
+        vaddps(a, 7, 7, broadcastConstant(a, weights + 528));
+
+        vandps(a, 8, 7, a.constant(abs_mask, sizeof(abs_mask)));
+        vaddps(a, 8, 8, a.constant(ones, sizeof(ones)));
+        vrcpps(a, 8, 8);
+        vmulps(a, 7, 8, 7);
+
+        for (int k = 0; k < 4; k++) {
+            vpermilps(a, 9 + k, 7, k * 85);
+            vmulps(a, 9 + k, 9 + k, broadcastConstant(a, weights + 544 + k * 16));
+        }
+
+        vaddps(a, 9, 9, 10);
+        vaddps(a, 11, 11, 12);
+        vaddps(a, 9, 9, 11);
+        vaddps(a, 9, 9, broadcastConstant(a, weights + 608));
+
+        vxorps(a, 13, 13, 13);
+        vcmpps(a, 13, 9, 13, 0x11); // _CMP_LT_OQ
+
+        vpackssdw(a, 13, 13, 13);
+        vpacksswb(a, 13, 13, 13);
+
+        // The four bytes of each group are at the start of its half.
+        vextracti128(a, 14, 13, 1);
+        vpunpckldq_xmm(a, 13, 13, 14);
+        vpandn_xmm(a, 13, 13, a.constant(byte_ones, sizeof(byte_ones)));
+        vmovq_store(a, mem(RDX, 0), 13);
+
+        vzeroupper(a);
+        ret(a);
+
+        return install(a);
+    } catch (const std::bad_alloc &) {
+        return NULL;
+    }
+}
+
+
+// Arguments: rdi = data, rsi = weights, rdx = vals, rcx = mstd,
+// r8 = count. The outer loop runs over the pixels, advancing rdi, rdx,
+// and rcx, the inner loop over groups of eight neurons, with the
+// weights in r10, the scales and biases in rax, and the outputs in r11.
+// r9 counts the groups.
+//
+// Register use: ymm0..7 accumulate the sums of eight neurons, two groups
+// of four, like in dotProd_AVX2. ymm15 holds the scale. The inputs are
+// loaded into ymm8..14 once per pixel when they fit, and one by one
+// for every eight neurons otherwise. The int16 version needs one of
+// these for the products.
+JitCode *jitDotProd_AVX2(int int16, int n, int len, int vals_stride) {
+    if (n <= 0 || n % 8 || len <= 0 || len % 16 || vals_stride < n)
+        return NULL;
+
+    try {
+        Assembler a;
+
+        const int weight_size = int16 ? 2 : 4;
+        const int step = 32 / weight_size; // inputs per register
+        const int steps = len / step;
+        const int temp = 14;
+        const int input_regs = int16 ? 6 : 7;
+        const bool inputs_in_regs = steps <= input_regs;
+
+        const size_t pixel_loop = a.code.size();
+
+        vbroadcastss(a, 15, mem(RCX, 8));
+        lea(a, R10, RSI, 0);
+        lea(a, RAX, RSI, n * len * weight_size);
+        lea(a, R11, RDX, 0);
+        movImm32(a, R9, n / 8);
+
+        if (inputs_in_regs)
+            for (int j = 0; j < steps; j++)
+                vmovups(a, 8 + j, mem(RDI, j * 32));
+
+        const size_t loop = a.code.size();
+
+        for (int j = 0; j < steps; j++) {
+            int input = 8 + j;
+            if (!inputs_in_regs) {
+                input = 8;
+                vmovups(a, input, mem(RDI, j * 32));
+            }
+
+            for (int k = 0; k < 8; k++) {
+                // Neurons i..i+3 come first, then i+4..i+7.
+                const int32_t offset = (k >> 2) * len * 4 * weight_size + j * 128 + (k & 3) * 32;
+
+                if (int16) {
+                    if (j == 0) {
+                        vpmaddwd(a, k, input, mem(R10, offset));
+                    } else {
+                        vpmaddwd(a, temp, input, mem(R10, offset));
+                        vpaddd(a, k, k, temp);
+                    }
+                } else {
+                    // Like the fmadd with zero in dotProd_AVX2, apart from the sign of zero products.
+                    if (j == 0)
+                        vmulps(a, k, input, mem(R10, offset));
+                    else
+                        vfmadd231ps(a, k, input, mem(R10, offset));
+                }
+            }
+        }
+
+        if (int16) {
+            vphaddd(a, 0, 0, 1);
+            vphaddd(a, 2, 2, 3);
+            vphaddd(a, 0, 0, 2);
+            vphaddd(a, 4, 4, 5);
+            vphaddd(a, 6, 6, 7);
+            vphaddd(a, 4, 4, 6);
+
+            vperm2i128(a, 1, 0, 4, 0x20);
+            vperm2i128(a, 2, 0, 4, 0x31);
+            vpaddd(a, 1, 1, 2);
+
+            // Each group of four neurons has four scales followed by four biases.
+            vmovups(a, 5, mem(RAX, 0));
+            vmovups(a, 6, mem(RAX, 32));
+            vperm2f128(a, 2, 5, 6, 0x20);
+            vperm2f128(a, 3, 5, 6, 0x31);
+
+            vcvtdq2ps(a, 1, 1);
+            vmulps(a, 1, 1, 2);
+            vfmadd213ps(a, 1, 15, 3);
+        } else {
+            vhaddps(a, 0, 0, 1);
+            vhaddps(a, 2, 2, 3);
+            vhaddps(a, 0, 0, 2);
+            vhaddps(a, 4, 4, 5);
+            vhaddps(a, 6, 6, 7);
+            vhaddps(a, 4, 4, 6);
+
+            vperm2f128(a, 1, 0, 4, 0x20);
+            vperm2f128(a, 2, 0, 4, 0x31);
+            vaddps(a, 1, 1, 2);
+
+            vfmadd213ps(a, 1, 15, mem(RAX, 0));
+        }
+
+        vmovups(a, mem(R11, 0), 1);
+
+        addImm(a, R10, 8 * len * weight_size);
+        addImm(a, RAX, int16 ? 64 : 32);
+        addImm(a, R11, 32);
+        decJnz(a, R9, loop);
+
+        addImm(a, RDI, PREDICTOR_STRIDE * sizeof(float));
+        addImm(a, RDX, vals_stride * sizeof(float));
+        addImm(a, RCX, 4 * sizeof(float));
+        decJnz(a, R8, pixel_loop);
+
+        vzeroupper(a);
+        ret(a);
+
+        return install(a);
+    } catch (const std::bad_alloc &) {
+        return NULL;
+    }
+}
+
+
+void *jitFunction(const JitCode *code) {
+    return code->code;
+}
+
+
+void jitFree(JitCode *code) {
+    if (!code)
+        return;
+
+    munmap(code->code, code->size);
+    free(code);
+}
@@ -0,0 +1,57 @@
+/*
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef JIT_X86_H
+#define JIT_X86_H
+
+#include <stddef.h>
+
+
+// Machine code generated at runtime for one set of filter parameters.
+//
+// The generated functions follow the System V calling convention, so
+// configure only defines NNEDI3_JIT and builds jit_x86.cpp on x86-64
+// outside of Windows.
+
+
+typedef struct JitCode JitCode;
+
+
+// The new prescreener for eight pixels, like nnedi3_computeNetwork0new_AVX2,
+// with the prepared weights copied into the code. The weights passed to
+// the generated function are ignored.
+//
+// Returns NULL if the code could not be generated.
+JitCode *jitComputeNetwork0new_AVX2(const float *weights);
+
+// The predictor dot products, a nnedi3DotProdFunc like the entries of
+// nnedi3_dotProd_AVX2_nsize (float) or nnedi3_dotProd_i16_AVX2_nsize
+// (int16), for n neurons of len inputs each. The vals_stride and n
+// passed to the generated function are ignored, and count must be at
+// least 1.
+//
+// n must be a multiple of 8, len a multiple of 16, and vals_stride at
+// least n.
+//
+// Returns NULL if the code could not be generated.
+JitCode *jitDotProd_AVX2(int int16, int n, int len, int vals_stride);
+
+// The address of the generated function.
+void *jitFunction(const JitCode *code);
+
+void jitFree(JitCode *code);
+
+#endif // JIT_X86_H
@@ -0,0 +1,125 @@
+/*
+**   Copyright (C) 2010-2011 Kevin Stone
+**
+**   VapourSynth port by dubhater.
+**
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef KERNELS_C_H
+#define KERNELS_C_H
+
+#include <cmath>
+#include <cstdint>
+
+
+// The scalar kernels and the layout of the predictor weights, shared by
+// nnedi3.cpp and the tests, which compare the other kernels with these.
+
+
+static inline void dotProd_C(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *scale) {
+    for (int i = 0; i < n; ++i) {
+        float sum = 0.0f;
+        for (int j = 0; j < len; ++j)
+            sum += data[j] * weights[i * len + j];
+
+        vals[i] = sum * scale[0] + weights[n * len + i];
+    }
+}
+
+
+static inline void dotProdS_C(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *scale) {
+    const int16_t *data = (int16_t *)dataf;
+    const int16_t *weights = (int16_t *)weightsf;
+    const float *wf = (float *)&weights[n * len];
+
+    for (int i = 0; i < n; ++i) {
+        int sum = 0, off = ((i >> 2) << 3) + (i & 3);
+        for (int j = 0; j < len; ++j)
+            sum += data[j] * weights[i * len + j];
+
+        vals[i] = sum * wf[off] * scale[0] + wf[off + 4];
+    }
+}
+
+
+// Stores the outputs of both layers in vals.
+static inline void computeNetwork0new_vals_C(const float *datai, const float *weights, float *vals) {
+    int16_t *data = (int16_t *)datai;
+    int16_t *ws = (int16_t *)weights;
+    float *wf = (float *)&ws[4 * 64];
+    for (int i = 0; i < 4; ++i) {
+        int sum = 0;
+        for (int j = 0; j < 64; ++j)
+            sum += data[j] * ws[(i << 3) + ((j >> 3) << 5) + (j & 7)];
+        const float t = sum * wf[i] + wf[4 + i];
+        vals[i] = t / (1.0f + std::fabs(t));
+    }
+    for (int i = 0; i < 4; ++i) {
+        float sum = 0.0f;
+        for (int j = 0; j < 4; ++j)
+            sum += vals[j] * wf[8 + i + (j << 2)];
+        vals[4 + i] = sum + wf[8 + 16 + i];
+    }
+}
+
+
+static inline void computeNetwork0new_C(const float *datai, const float *weights, uint8_t *d) {
+    float vals[8];
+    computeNetwork0new_vals_C(datai, weights, vals);
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (vals[4 + i] > 0.0f)
+            mask |= (0x1 << (i << 3));
+    }
+    ((int *)d)[0] = mask;
+}
+
+
+// The predictor weights are split into blocks of neurons small enough to
+// stay in the L1 cache while a batch of pixels is processed. The AVX-512
+// dotProd functions need multiples of 16 neurons.
+static inline int predictorBlockNeurons(const int nns, const int asize, const int weight_size) {
+    int neurons = nns * 2;
+    while (neurons > 16 && neurons * asize * weight_size > 16384)
+        neurons /= 2;
+
+    return neurons;
+}
+
+
+// Each block is followed by its own scales and biases, so that
+// the dotProd functions can process one block at a time.
+// The integer weights have a scale and a bias per neuron, the float
+// weights only a bias.
+static inline int predictorBlockStride(const int block_neurons, const int asize, const int weight_size) {
+    if (weight_size < (int)sizeof(float))
+        return block_neurons * asize * weight_size / sizeof(float) + block_neurons * 2;
+    else
+        return block_neurons * asize + block_neurons;
+}
+
+
+// The position of the weight of input k of neuron j, in the predictor weights
+// shuffled for the AVX2 and AVX-512 dotProd functions.
+static inline int avx2WeightPos(const int j, const int k, const int asize) {
+    return (j >> 2) * asize * 4 + (k >> 3) * 32 + (j & 3) * 8 + (k & 7);
+}
+
+static inline int avx2IntWeightPos(const int j, const int k, const int asize) {
+    return (j >> 2) * asize * 4 + (k >> 4) * 64 + (j & 3) * 16 + (k & 15);
+}
+
+#endif // KERNELS_C_H
@@ -28,53 +28,94 @@
 #include <cstring>
 
 #include <algorithm>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <type_traits>
 
 #include <VapourSynth.h>
 #include <VSHelper.h>
 
 #include "cpufeatures.h"
+#include "kernels_c.h"
+#ifdef NNEDI3_JIT
+#include "jit_x86.h"
+#endif
+#include "simd_dotprod.h"
+#if defined(NNEDI3_X86)
+#include "simd_x86.h"
+#endif
+#include "threadpool.h"
 
 #ifdef _WIN32
 #include <codecvt>
 #include <locale>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 
 #if defined(NNEDI3_X86)
-// Functions implemented in simd_x86.h, simd_sse2.c, simd_fma3.c, simd_fma4.c.
+// Functions implemented in simd_x86.h, simd_sse2.c, simd_fma3.c, simd_fma4.c, simd_avx2.c, simd_avx512.c.
 extern "C" {
     extern void nnedi3_byte2float48_SSE2(const uint8_t *t, const intptr_t pitch, float *p);
     extern void nnedi3_word2float48_SSE2(const uint8_t *t, const intptr_t pitch, float *pf);
     extern void nnedi3_byte2word48_SSE2(const uint8_t *t, const intptr_t pitch, float *pf);
     extern void nnedi3_byte2word64_SSE2(const uint8_t *t, const intptr_t pitch, float *p);
+    extern void nnedi3_float2float48_SSE2(const uint8_t *t, const intptr_t pitch, float *p);
+    extern void nnedi3_word2word48_SSE2(const uint8_t *t, const intptr_t pitch, float *pf);
+    extern void nnedi3_word2word48_shift_SSE2(const uint8_t *t, const intptr_t pitch, float *pf);
+    extern void nnedi3_word2word64_SSE2(const uint8_t *t, const intptr_t pitch, float *pf);
+    extern void nnedi3_word2word64_shift_SSE2(const uint8_t *t, const intptr_t pitch, float *pf);
+    extern void nnedi3_float2word64_SSE2(const uint8_t *t, const intptr_t pitch, float *pf);
 
     extern int32_t nnedi3_processLine0_SSE2(const uint8_t *tempu, intptr_t width, uint8_t *dstp, const uint8_t *src3p, const intptr_t src_pitch);
+    extern int32_t nnedi3_processLine0_word_SSE2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value);
+    extern int32_t nnedi3_processLine0_float_SSE2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value);
 
     extern void nnedi3_extract_m8_SSE2(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input);
     extern void nnedi3_extract_m8_i16_SSE2(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf);
+    extern void nnedi3_extract_m8_i8_SSE2(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf);
+    extern void nnedi3_extract_m8_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input);
+    extern void nnedi3_extract_m8_i16_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf);
+    extern void nnedi3_extract_m8_i16_shift_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf);
+    extern void nnedi3_extract_m8_float_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input);
+
+    extern void nnedi3_copyInput_m8_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *input);
 
     extern void nnedi3_computeNetwork0_SSE2(const float *input, const float *weights, uint8_t *d);
     extern void nnedi3_computeNetwork0_i16_SSE2(const float *inputf, const float *weightsf, uint8_t *d);
     extern void nnedi3_computeNetwork0new_SSE2(const float *datai, const float *weights, uint8_t *d);
 
-    extern void nnedi3_weightedAvgElliottMul5_m16_SSE2(const float *w, const intptr_t n, float *mstd);
-
-    extern void nnedi3_e0_m16_SSE2(float *s, const intptr_t n);
-    extern void nnedi3_e1_m16_SSE2(float *s, const intptr_t n);
-    extern void nnedi3_e2_m16_SSE2(float *s, const intptr_t n);
-
-    extern void nnedi3_dotProd_SSE2(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd);
-    extern void nnedi3_dotProd_i16_SSE2(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd);
+    extern const nnedi3DotProdFunc nnedi3_dotProd_SSE2_nsize[7];
+    extern const nnedi3DotProdFunc nnedi3_dotProd_i16_SSE2_nsize[7];
 
     extern void nnedi3_computeNetwork0_FMA3(const float *input, const float *weights, uint8_t *d);
     extern void nnedi3_e0_m16_FMA3(float *s, const intptr_t n);
-    extern void nnedi3_dotProd_FMA3(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd);
+    extern const nnedi3DotProdFunc nnedi3_dotProd_FMA3_nsize[7];
 
     extern void nnedi3_computeNetwork0_FMA4(const float *input, const float *weights, uint8_t *d);
     extern void nnedi3_e0_m16_FMA4(float *s, const intptr_t n);
-    extern void nnedi3_dotProd_FMA4(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd);
+    extern const nnedi3DotProdFunc nnedi3_dotProd_FMA4_nsize[7];
+
+    extern const nnedi3DotProdFunc nnedi3_dotProd_AVX2_nsize[7];
+    extern const nnedi3DotProdFunc nnedi3_dotProd_i16_AVX2_nsize[7];
+    extern const nnedi3DotProdFunc nnedi3_dotProd_i8_AVX2_nsize[7];
+
+    extern void nnedi3_computeNetwork0new_AVX2(const float *dataf, const float *weightsf, uint8_t *d);
+    extern int32_t nnedi3_processLine0_word_AVX2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value);
+    extern int32_t nnedi3_processLine0_float_AVX2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value);
+    extern void nnedi3_extract_m8_float_AVX2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input);
+
+    extern const nnedi3DotProdFunc nnedi3_dotProd_AVX512_nsize[7];
+    extern const nnedi3DotProdFunc nnedi3_dotProd_i16_AVX512_nsize[7];
+    extern const nnedi3DotProdFunc nnedi3_dotProd_i16_AVX512VNNI_nsize[7];
+    extern const nnedi3DotProdFunc nnedi3_dotProd_i8_AVX512_nsize[7];
+    extern const nnedi3DotProdFunc nnedi3_dotProd_i8_AVX512VNNI_nsize[7];
 }
 #elif defined(NNEDI3_ARM)
 // Functions implemented in simd_neon.c
@@ -83,35 +124,93 @@ extern "C" {
     extern void byte2word64_neon(const uint8_t *t, const intptr_t pitch, float *pf);
     extern void byte2float48_neon(const uint8_t *t, const intptr_t pitch, float *p);
     extern void word2float48_neon(const uint8_t *t8, const intptr_t pitch, float *p);
+    extern void word2word48_neon(const uint8_t *t, const intptr_t pitch, float *p);
+    extern void word2word48_shift_neon(const uint8_t *t, const intptr_t pitch, float *p);
+    extern void word2word64_neon(const uint8_t *t, const intptr_t pitch, float *p);
+    extern void word2word64_shift_neon(const uint8_t *t, const intptr_t pitch, float *p);
+    extern void float2word64_neon(const uint8_t *t, const intptr_t pitch, float *p);
 
     extern void computeNetwork0_neon(const float *input, const float *weights, uint8_t *d);
     extern void computeNetwork0_i16_neon(const float *inputf, const float *weightsf, uint8_t *d);
     extern void computeNetwork0new_neon(const float *dataf, const float *weightsf, uint8_t *d);
 
-    extern void dotProd_neon(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd);
-    extern void dotProd_i16_neon(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd);
+    extern const nnedi3DotProdFunc dotProd_neon_nsize[7];
+    extern const nnedi3DotProdFunc dotProd_i16_neon_nsize[7];
+
+    extern void e0_m16_neon(float *s, const intptr_t n);
+    extern void e1_m16_neon(float *s, const intptr_t n);
+    extern void e2_m16_neon(float *s, const intptr_t n);
+
+    extern void weightedAvgElliottMul5_m16_neon(const float *w, const intptr_t n, float *mstd);
+
+    extern void extract_m8_neon(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input);
+    extern void extract_m8_i16_neon(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf);
+    extern void extract_m8_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input);
+    extern void extract_m8_i16_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf);
+    extern void extract_m8_i16_shift_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf);
+    extern void extract_m8_float_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input);
+
+    extern void copyInput_m8_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *input);
+
+    extern int32_t processLine0_neon(const uint8_t *tempu, int width, uint8_t *dstp, const uint8_t *src3p, const int src_pitch, const int max_value);
+    extern int32_t processLine0_word_neon(const uint8_t *tempu, int width, uint8_t *dstp8, const uint8_t *src3p8, const int src_pitch, const int max_value);
+    extern int32_t processLine0_float_neon(const uint8_t *tempu, int width, uint8_t *dstp8, const uint8_t *src3p8, const int src_pitch, const int max_value);
 }
 #endif
 
 
 // Things that mustn't be shared between threads.
 typedef struct {
-    uint8_t *paddedp[3];
-    int padded_stride[3];
+    float *input;
+    float *temp;
+    // The pixels of the current row that need the predictor, found by evalRow_0.
+    int *predict_x;
+    // Used by windowSums.
+    double *window_sums;
+    // The padded rows around the current row. See padRow.
+    uint8_t *rows;
+    int rows_stride;
+} ScratchData;
+
+
+// Things that are shared only by the threads working on the same frame.
+// They are kept in a FrameDataPool between frames, so the buffers are
+// only allocated for the first few frames.
+typedef struct FrameData {
+    // The size of the source planes with 32 columns of padding on each
+    // side and 6 rows above and below. The padding is never stored whole:
+    // each thread pads only the rows it needs, in its ScratchData.
     int padded_width[3];
     int padded_height[3];
 
+    // The source frame. Row y of the output is at
+    // framep + (y - frame_offset) * frame_stride.
+    const uint8_t *framep[3];
+    int frame_stride[3];
+    int frame_offset[3];
+    // Whether the middle of the rows can be read directly from framep.
+    bool frame_direct[3];
+
     uint8_t *dstp[3];
     int dst_stride[3];
 
     int field[3];
 
     int32_t *lcount[3];
-    float *input;
-    float *temp;
+
+    // Used by the thread that requested the frame.
+    ScratchData scratch;
+
+    struct FrameData *next;
 } FrameData;
 
 
+typedef struct {
+    std::mutex lock;
+    FrameData *free_frames;
+} FrameDataPool;
+
+
 typedef struct nnedi3Data nnedi3Data;
 
 
@@ -119,12 +218,15 @@ struct nnedi3Data {
     VSNodeRef *node;
     VSVideoInfo vi;
 
-    float *weights0;
-    float *weights1[2];
+    struct PreparedWeights *weights;
+    const float *weights0;
+    const float *weights1; // the qual predictor networks, as one network
     int asize;
     int nns;
     int xdia;
     int ydia;
+    int block_neurons;
+    int block_stride; // in floats
 
     // Parameters.
     int field;
@@ -138,86 +240,104 @@ struct nnedi3Data {
     int opt;
     int int16_prescreener;
     int int16_predictor;
+    int int8_predictor;
     int exp;
     int show_mask;
+    int weights_cache;
+    int jit;
 
     int max_value;
 
-    void (*copyPad)(const VSFrameRef *, FrameData *, const nnedi3Data *, int, const VSAPI *);
-    void (*evalFunc_0)(const nnedi3Data *, FrameData *);
-    void (*evalFunc_1)(const nnedi3Data *, FrameData *);
+    // The predictor weights are shuffled for the AVX2 and AVX-512 dotProd functions.
+    int dotProd_avx2;
+
+    // With the new prescreener, each call of computeNetwork0 evaluates
+    // this many groups of four pixels.
+    int pscrn_groups;
 
-    // Functions used in evalFunc_0
+    // Each frame is split into this many bands, which are processed in parallel
+    // by the calling thread and the threads - 1 workers in the pool.
+    int threads;
+    int bands;
+    ThreadPool *pool;
+    ScratchData *worker_scratch;
+
+    FrameDataPool *frame_pool;
+
+#ifdef NNEDI3_JIT
+    // Generated by setupJit, or NULL.
+    JitCode *jit_prescreener;
+    JitCode *jit_dotProd;
+#endif
+
+    void (*evalFunc)(const nnedi3Data *, FrameData *, ScratchData *, int, int);
+
+    // Functions used in evalRow_0
     void (*readPixels)(const uint8_t *, const intptr_t, float *);
     void (*computeNetwork0)(const float *, const float *, uint8_t *);
     int32_t (*processLine0)(const uint8_t *, int, uint8_t *, const uint8_t *, const int, const int);
 
-    // Functions used in evalFunc_1
+    // Functions used in evalRow_1
     void (*extract)(const uint8_t *, const intptr_t, const intptr_t, const intptr_t, float *, float *);
-    void (*dotProd)(const float *, const float *, float *, const intptr_t, const intptr_t, const float *);
-    void (*expfunc)(float *, const intptr_t);
-    void (*wae5)(const float *, const intptr_t, float *);
+    // Used instead of extract when most of a row goes through the predictor.
+    void (*windowSums)(const uint8_t *, const intptr_t, const intptr_t, const intptr_t, double *, double *);
+    void (*copyInput)(const uint8_t *, const intptr_t, const intptr_t, const intptr_t, float *);
+    void (*meanStdDev)(const double, const double, const intptr_t, const intptr_t, float *);
+    nnedi3DotProdFunc dotProd;
+    // predictBatch, with the exp and weighted average functions chosen in selectFunctions.
+    void (*predict)(const nnedi3Data *, const float *, float *, float (*)[4], const int);
 };
 
 
-template <typename PixelType>
-static void copyPad(const VSFrameRef *src, FrameData *frameData, const nnedi3Data *d, int fn, const VSAPI *vsapi) {
-    const int off = 1 - fn;
-
-    for (int plane = 0; plane < d->vi.format->numPlanes; ++plane) {
-        if (!d->process[plane])
-            continue;
-
-        const PixelType *srcp = (const PixelType *)vsapi->getReadPtr(src, plane);
-        PixelType *dstp = (PixelType *)frameData->paddedp[plane];
-
-        const int src_stride = vsapi->getStride(src, plane) / sizeof(PixelType);
-        const int dst_stride = frameData->padded_stride[plane] / sizeof(PixelType);
+// The rows at the top and bottom of the padded planes that are always
+// padded whole, and the columns on the left and right that are padded in
+// the other rows. Every window that reaches into the mirrored pixels is
+// found entirely in these.
+#define EDGE_ROWS 18
+#define EDGE_COLUMNS 96
 
-        const int src_height = vsapi->getFrameHeight(src, plane);
-        const int dst_height = frameData->padded_height[plane];
+// The number of padded rows kept by each thread. The predictor needs 6.
+#define RING_ROWS 8
 
-        const int src_width = vsapi->getFrameWidth(src, plane);
-        const int dst_width = frameData->padded_width[plane];
 
-        // Copy.
-        if (!d->dh) {
-            for (int y = off; y < src_height; y += 2)
-                memcpy(dstp + 32 + (6 + y) * dst_stride,
-                       srcp + y * src_stride,
-                       src_width * sizeof(PixelType));
-        } else {
-            for (int y = 0; y < src_height; y++)
-                memcpy(dstp + 32 + (6 + y * 2 + off) * dst_stride,
-                       srcp + y * src_stride,
-                       src_width * sizeof(PixelType));
-        }
-
-        // And pad.
-        dstp += (6 + off) * dst_stride;
-        for (int y = 6 + off; y < dst_height - 6; y += 2) {
-            for (int x = 0; x < 32; ++x)
-                dstp[x] = dstp[64 - x];
+// Writes row r of the padded plane to dstp, with the edges mirrored. Only
+// the rows of the field that is kept can be written. When edges_only is
+// true only the first and last EDGE_COLUMNS columns are written.
+template <typename PixelType>
+static void padRow(const FrameData *frameData, const int plane, int r, PixelType *dstp, const bool edges_only) {
+    const int width = frameData->padded_width[plane];
+    const int height = frameData->padded_height[plane];
+    const int off = frameData->field[plane] ^ 1;
+
+    // The rows above and below the plane are mirrored, more than once in
+    // planes only a few rows tall. When the field that is kept has only one
+    // row, it is used for everything. A plane with only one row has nothing
+    // in the field that is kept, so that row is used instead.
+    const int first = 6 + off;
+    const int last = height - 7 - ((height - 7 - off) & 1);
+    if (last <= first)
+        r = std::max(last, 6);
+    else
+        while (r < first || r > last)
+            r = r < first ? 2 * first - r : 2 * last - r;
 
-            int c = 2;
-            for (int x = dst_width - 32; x < dst_width; ++x, c += 2)
-                dstp[x] = dstp[x - c];
+    const PixelType *srcp = (const PixelType *)(frameData->framep[plane] + (r - 6 - frameData->frame_offset[plane]) * frameData->frame_stride[plane]);
 
-            dstp += dst_stride * 2;
-        }
+    if (!edges_only) {
+        memcpy(dstp + 32, srcp, (width - 64) * sizeof(PixelType));
+    } else {
+        memcpy(dstp + 32, srcp, (EDGE_COLUMNS - 32) * sizeof(PixelType));
+        memcpy(dstp + width - EDGE_COLUMNS,
+               srcp + width - 64 - (EDGE_COLUMNS - 32),
+               (EDGE_COLUMNS - 32) * sizeof(PixelType));
+    }
 
-        dstp = (PixelType *)frameData->paddedp[plane];
-        for (int y = off; y < 6; y += 2)
-            memcpy(dstp + y * dst_stride,
-                   dstp + (12 + 2 * off - y) * dst_stride,
-                   dst_width * sizeof(PixelType));
+    for (int x = 0; x < 32; ++x)
+        dstp[x] = dstp[64 - x];
 
-        int c = 4;
-        for (int y = dst_height - 6 + off; y < dst_height; y += 2, c += 4)
-            memcpy(dstp + y * dst_stride,
-                   dstp + (y - c) * dst_stride,
-                   dst_width * sizeof(PixelType));
-    }
+    int c = 2;
+    for (int x = width - 32; x < width; ++x, c += 2)
+        dstp[x] = dstp[x - c];
 }
 
 
@@ -227,21 +347,10 @@ static void elliott_C(float *data, const int n) {
 }
 
 
-static void dotProd_C(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *scale) {
-    for (int i = 0; i < n; ++i) {
-        float sum = 0.0f;
-        for (int j = 0; j < len; ++j)
-            sum += data[j] * weights[i * len + j];
-
-        vals[i] = sum * scale[0] + weights[n * len + i];
-    }
-}
-
-
-static void dotProdS_C(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *scale) {
-    const int16_t *data = (int16_t *)dataf;
-    const int16_t *weights = (int16_t *)weightsf;
-    const float *wf = (float *)&weights[n * len];
+static inline void dotProdB_C(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *scale) {
+    const uint8_t *data = (const uint8_t *)dataf;
+    const int8_t *weights = (const int8_t *)weightsf;
+    const float *wf = (const float *)&weights[n * len];
 
     for (int i = 0; i < n; ++i) {
         int sum = 0, off = ((i >> 2) << 3) + (i & 3);
@@ -253,6 +362,11 @@ static void dotProdS_C(const float *dataf, const float *weightsf, float *vals, c
 }
 
 
+NNEDI3_DOTPROD_NSIZES(dotProd_C_nsize, dotProd_C, );
+NNEDI3_DOTPROD_NSIZES(dotProdS_C_nsize, dotProdS_C, );
+NNEDI3_DOTPROD_NSIZES(dotProdB_C_nsize, dotProdB_C, );
+
+
 static void computeNetwork0_C(const float *input, const float *weights, uint8_t *d) {
     float temp[12], scale = 1.0f;
     dotProd_C(input, weights, temp, 4, 48, &scale);
@@ -356,6 +470,20 @@ static int32_t processLine0_C(const uint8_t *tempu, int width, uint8_t *dstp8, c
     return count;
 }
 
+#ifdef NNEDI3_X86
+// The SIMD functions process 16 pixels at a time. The rest are done in C.
+template <typename PixelType, typename TempType, int32_t (*processLine0_SIMD)(const uint8_t *, intptr_t, uint8_t *, const uint8_t *, const intptr_t, const int)>
+static int32_t processLine0_maybeSIMD(const uint8_t *tempu, int width, uint8_t *dstp, const uint8_t *src3p, const int src_pitch, const int max_value) {
+    int32_t count = 0;
+    const int remain = width & 15;
+    width -= remain;
+    if (width)
+        count = processLine0_SIMD(tempu, width, dstp, src3p, src_pitch, max_value);
+
+    return count + processLine0_C<PixelType, TempType>(tempu + width, remain, dstp + width * sizeof(PixelType), src3p + width * sizeof(PixelType), src_pitch, max_value);
+}
+#endif
+
 // new prescreener functions
 static void byte2word64_C(const uint8_t *t, const intptr_t pitch, float *p) {
     int16_t *ps = (int16_t *)p;
@@ -384,92 +512,122 @@ static void word2word_C(const uint8_t *t, const intptr_t pitch, float *p) {
 }
 
 
-static void computeNetwork0new_C(const float *datai, const float *weights, uint8_t *d) {
-    int16_t *data = (int16_t *)datai;
-    int16_t *ws = (int16_t *)weights;
-    float *wf = (float *)&ws[4 * 64];
-    float vals[8];
-    for (int i = 0; i < 4; ++i) {
-        int sum = 0;
-        for (int j = 0; j < 64; ++j)
-            sum += data[j] * ws[(i << 3) + ((j >> 3) << 5) + (j & 7)];
-        const float t = sum * wf[i] + wf[4 + i];
-        vals[i] = t / (1.0f + std::fabs(t));
-    }
-    for (int i = 0; i < 4; ++i) {
-        float sum = 0.0f;
-        for (int j = 0; j < 4; ++j)
-            sum += vals[j] * wf[8 + i + (j << 2)];
-        vals[4 + i] = sum + wf[8 + 16 + i];
+// Float pixels are scaled so that 0..1 maps to 0..32767, like 15 bit input.
+static void float2word64_C(const uint8_t *t8, const intptr_t pitch, float *p) {
+    int16_t *ps = (int16_t *)p;
+    const float *t = (const float *)t8;
+
+    for (int y = 0; y < 4; ++y) {
+        for (int x = 0; x < 16; ++x) {
+            const float v = std::max(std::min(t[y * pitch * 2 + x] * 32767.0f, 32767.0f), -32768.0f);
+            ps[y * 16 + x] = (int16_t)std::lrint(v);
+        }
     }
-    int mask = 0;
-    for (int i = 0; i < 4; ++i) {
-        if (vals[4 + i] > 0.0f)
-            mask |= (0x1 << (i << 3));
+}
+
+
+// Finds the part of the rows ystart, ystart + 2, ..., ystop - 1 that belongs to band.
+static void bandRows(const int ystart, const int ystop, const int band, const int bands, int *first, int *last) {
+    const int rows = std::max((ystop - ystart + 1) / 2, 0);
+
+    *first = ystart + rows * band / bands * 2;
+    *last = ystart + rows * (band + 1) / bands * 2;
+}
+
+
+// Where evalRow_0 and evalRow_1 find the pixels around the row they process.
+// Both pointers point to the row being interpolated. The windows of the pixels
+// in the columns [left, right) are read from frame, the others from padded.
+typedef struct {
+    const uint8_t *padded;
+    int padded_stride;
+    const uint8_t *frame; // column 32 of the padded plane, or NULL
+    int frame_stride;
+    int left;
+    int right;
+} RowSource;
+
+
+// Returns the pixel in column x, and the stride to use around it.
+template <typename PixelType>
+static inline const PixelType *rowPixel(const RowSource *src, const int x, int *stride) {
+    if (x >= src->left && x < src->right) {
+        *stride = src->frame_stride;
+        return (const PixelType *)src->frame + x - 32;
+    } else {
+        *stride = src->padded_stride;
+        return (const PixelType *)src->padded + x;
     }
-    ((int *)d)[0] = mask;
 }
 
 
+// Prescreens one row and writes the cubic interpolation where the predictor is not needed.
+// dstp points to the row in the output frame.
+// Returns the number of pixels left for the predictor, whose positions are stored in scratch->predict_x.
 template <typename PixelType>
-static void evalFunc_0(const nnedi3Data *d, FrameData *frameData) {
-    float *input = frameData->input;
+static int evalRow_0(const nnedi3Data *d, ScratchData *scratch, const RowSource *src, PixelType *dstp, const int width) {
+    float *input = scratch->input;
     const float *weights0 = d->weights0;
-    float *temp = frameData->temp;
-    uint8_t *tempu = (uint8_t *)temp;
+    uint8_t *tempu = (uint8_t *)scratch->temp;
+    int *predict_x = scratch->predict_x;
 
-    // And now the actual work.
-    for (int plane = 0; plane < d->vi.format->numPlanes; ++plane) {
-        if (!d->process[plane])
-            continue;
+    dstp -= 32;
 
-        const PixelType *srcp = (const PixelType *)frameData->paddedp[plane];
-        const int src_stride = frameData->padded_stride[plane] / sizeof(PixelType);
+    if (d->pscrn == 0) {// no prescreening
+        memset(dstp + 32, 255, (width - 64) * sizeof(PixelType));
+        for (int x = 32; x < width - 32; ++x)
+            predict_x[x - 32] = x;
+        return width - 64;
+    }
 
-        const int width = frameData->padded_width[plane];
-        const int height = frameData->padded_height[plane];
+    int stride;
+    if (d->pscrn == 1) {// original
+        for (int x = 32; x < width - 32; ++x) {
+            const PixelType *srcp = rowPixel<PixelType>(src, x, &stride);
+            d->readPixels((const uint8_t *)(srcp - stride * 3 - 5), stride, input);
+            d->computeNetwork0(input, weights0, tempu+x);
+        }
+    } else {// new
+        // The last groups can be past the end of the row. The padding
+        // has room for their windows, and tempu for their results.
+        const int groups = d->pscrn_groups;
+
+        for (int x = 32; x < width - 32; x += 4 * groups) {
+            for (int k = 0; k < groups; ++k) {
+                const PixelType *srcp = rowPixel<PixelType>(src, x + k * 4, &stride);
+                d->readPixels((const uint8_t *)(srcp - stride * 3 - 6), stride, input + k * 32);
+            }
+            d->computeNetwork0(input, weights0, tempu + x);
+        }
+    }
 
-        PixelType *dstp = (PixelType *)frameData->dstp[plane];
-        const int dst_stride = frameData->dst_stride[plane] / sizeof(PixelType);
+    // The cubic interpolation only uses the pixels above and below.
+    const PixelType *src3p = src->frame ? (const PixelType *)src->frame : (const PixelType *)src->padded + 32;
+    stride = src->frame ? src->frame_stride : src->padded_stride;
+    d->processLine0(tempu + 32, width - 64, (uint8_t *)(dstp + 32), (const uint8_t *)(src3p - stride * 3), stride, d->max_value);
 
-        for (int y = 1 - frameData->field[plane]; y < height - 12; y += 2)
-            memcpy(dstp + y * dst_stride,
-                   srcp + 32 + (6 + y) * src_stride,
-                   (width - 64) * sizeof(PixelType));
+    int count = 0;
+    for (int x = 32; x < width - 32; ++x) {
+        predict_x[count] = x;
+        count += !tempu[x];
+    }
+    return count;
+}
 
-        const int ystart = 6 + frameData->field[plane];
-        const int ystop = height - 6;
-        srcp += ystart * src_stride;
-        dstp += (ystart - 6) * dst_stride - 32;
-        const PixelType *src3p = srcp - src_stride * 3;
-        int32_t *lcount = frameData->lcount[plane] - 6;
-        if (d->pscrn == 1) {// original
-            for (int y = ystart; y < ystop; y += 2) {
-                for (int x = 32; x < width - 32; ++x) {
-                    d->readPixels((const uint8_t *)(src3p + x - 5), src_stride, input);
-                    d->computeNetwork0(input, weights0, tempu+x);
-                }
-                lcount[y] += d->processLine0(tempu + 32, width - 64, (uint8_t *)(dstp + 32), (const uint8_t *)(src3p + 32), src_stride, d->max_value);
-                src3p += src_stride * 2;
-                dstp += dst_stride * 2;
-            }
-        } else if (d->pscrn >= 2) {// new
-            for (int y = ystart; y < ystop; y += 2) {
-                for (int x = 32; x < width - 32; x += 4) {
-                    d->readPixels((const uint8_t *)(src3p + x - 6), src_stride, input);
-                    d->computeNetwork0(input, weights0, tempu + x);
-                }
-                lcount[y] += d->processLine0(tempu + 32, width - 64, (uint8_t *)(dstp + 32), (const uint8_t *)(src3p + 32), src_stride, d->max_value);
-                src3p += src_stride * 2;
-                dstp += dst_stride * 2;
-            }
-        } else {// no prescreening
-            for (int y = ystart; y < ystop; y += 2) {
-                memset(dstp + 32, 255, (width - 64) * sizeof(PixelType));
-                lcount[y] += width - 64;
-                dstp += dst_stride * 2;
-            }
-        }
+
+// sum and sumsq are exact for 8..16 bit pixels.
+template <typename AccumType, typename FloatType>
+static void meanStdDev_m8_C(const double sum, const double sumsq, const intptr_t xdia, const intptr_t ydia, float *mstd) {
+    const float scale = 1.0f / (xdia * ydia);
+    mstd[0] = (AccumType)sum * scale;
+    // float or double or double
+    const FloatType tmp = (FloatType)(AccumType)sumsq * scale - (FloatType)mstd[0] * mstd[0];
+    mstd[3] = 0.0f;
+    if (tmp <= FLT_EPSILON)
+        mstd[1] = mstd[2] = 0.0f;
+    else {
+        mstd[1] = (float)std::sqrt(tmp);
+        mstd[2] = 1.0f / mstd[1];
     }
 }
 
@@ -493,15 +651,19 @@ static void extract_m8_C(const uint8_t *srcp8, const intptr_t stride, const intp
         }
         input += xdia;
     }
-    const float scale = 1.0f / (xdia * ydia);
-    mstd[0] = sum * scale;
-    // float or double or double
-    const FloatType tmp = (FloatType)sumsq * scale - (FloatType)mstd[0] * mstd[0];
+    meanStdDev_m8_C<AccumType, FloatType>(sum, sumsq, xdia, ydia, mstd);
+}
+
+
+static void meanStdDev_m8_i16_C(const double sum, const double sumsq, const intptr_t xdia, const intptr_t ydia, float *mstd) {
+    const float scale = 1.0f / (float)(xdia * ydia);
+    mstd[0] = (int64_t)sum * scale;
+    mstd[1] = (float)(sumsq * scale - mstd[0] * mstd[0]);
     mstd[3] = 0.0f;
-    if (tmp <= FLT_EPSILON)
+    if (mstd[1] <= FLT_EPSILON)
         mstd[1] = mstd[2] = 0.0f;
     else {
-        mstd[1] = (float)std::sqrt(tmp);
+        mstd[1] = std::sqrt(mstd[1]);
         mstd[2] = 1.0f / mstd[1];
     }
 }
@@ -521,15 +683,105 @@ static void extract_m8_i16_C(const uint8_t *srcp8, const intptr_t stride, const
         }
         input += xdia;
     }
-    const float scale = 1.0f / (float)(xdia * ydia);
-    mstd[0] = sum * scale;
-    mstd[1] = (float)((double)sumsq * scale - mstd[0] * mstd[0]);
-    mstd[3] = 0.0f;
-    if (mstd[1] <= FLT_EPSILON)
-        mstd[1] = mstd[2] = 0.0f;
-    else {
-        mstd[1] = std::sqrt(mstd[1]);
-        mstd[2] = 1.0f / mstd[1];
+    meanStdDev_m8_i16_C(sum, sumsq, xdia, ydia, mstd);
+}
+
+
+// The int16 dotProd functions sum in int32_t, which can overflow with
+// more than 12 bits per sample. With more bits, the mean of the window
+// is subtracted from the pixels, which are then shifted right until
+// std * xdia * ydia < 32768. By the Cauchy-Schwarz inequality, the sums
+// are then smaller than 32767 * sqrt(xdia * ydia) * std * sqrt(xdia * ydia)
+// / 2^shift < 2^30. mstd[2], the scale of the sums, makes up for the shift.
+static void extract_m8_i16_shift_C(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+    int16_t *input = (int16_t *)inputf;
+    int64_t sum = 0, sumsq = 0;
+    for (int y = 0; y < ydia; ++y) {
+        const uint16_t *srcpT = srcp + y * stride * 2;
+        for (int x = 0; x < xdia; ++x) {
+            sum += srcpT[x];
+            sumsq += (uint32_t)srcpT[x] * (uint32_t)srcpT[x];
+        }
+    }
+    meanStdDev_m8_C<int64_t, double>(sum, sumsq, xdia, ydia, mstd);
+
+    int shift = 0;
+    while (mstd[1] * (float)(xdia * ydia) >= (float)(32768 << shift))
+        shift++;
+
+    const int mean = (int)(mstd[0] + 0.5f);
+    const int round = (1 << shift) >> 1;
+    for (int y = 0; y < ydia; ++y) {
+        const uint16_t *srcpT = srcp + y * stride * 2;
+        for (int x = 0; x < xdia; ++x)
+            input[x] = (srcpT[x] - mean + round) >> shift;
+        input += xdia;
+    }
+    mstd[2] *= (float)(1 << shift);
+}
+
+
+// The pixels are stored as they are, for the int8 dotProd functions.
+static void extract_m8_i8_C(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    uint8_t *input = (uint8_t *)inputf;
+    int64_t sum = 0, sumsq = 0;
+    for (int y = 0; y < ydia; ++y) {
+        const uint8_t *srcpT = srcp + y * stride * 2;
+        for (int x = 0; x < xdia; ++x) {
+            sum += srcpT[x];
+            sumsq += srcpT[x] * srcpT[x];
+            input[x] = srcpT[x];
+        }
+        input += xdia;
+    }
+    meanStdDev_m8_i16_C(sum, sumsq, xdia, ydia, mstd);
+}
+
+
+// Sums the ydia pixels of each of the n columns starting at srcp, then adds up
+// the column sums from the left, so the sum over the window starting at column x
+// is sums[x + xdia] - sums[x]. This is exact for 8..16 bit pixels.
+// sums[0] and sumsqs[0] must be set by the caller, to continue a previous call.
+template <typename PixelType, typename AccumType>
+static void windowSums_C(const uint8_t *srcp8, const intptr_t stride, const intptr_t n, const intptr_t ydia, double *sums, double *sumsqs) {
+    const PixelType *srcp = (const PixelType *)srcp8;
+
+    double sum = sums[0], sumsq = sumsqs[0];
+
+    for (int x = 0; x < n; ++x) {
+        // int64_t or double
+        AccumType column = 0, columnsq = 0;
+        for (int y = 0; y < ydia; ++y) {
+            const AccumType pixel = srcp[y * stride * 2 + x];
+            column += pixel;
+            columnsq += pixel * pixel;
+        }
+
+        sum += column;
+        sumsq += columnsq;
+        sums[x + 1] = sum;
+        sumsqs[x + 1] = sumsq;
+    }
+}
+
+
+// Like extract_m8_C and extract_m8_i16_C, without the sums.
+// InputType is float, or int16_t when PixelType is uint16_t.
+template <typename PixelType, typename InputType>
+static void copyInput_m8_C(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *inputf) {
+    const PixelType *srcp = (const PixelType *)srcp8;
+    InputType *input = (InputType *)inputf;
+
+    for (int y = 0; y < ydia; ++y) {
+        const PixelType *srcpT = srcp + y * stride * 2;
+        if (sizeof(PixelType) == sizeof(InputType)) {
+            memcpy(input, srcpT, xdia * sizeof(InputType));
+        } else {
+            for (int x = 0; x < xdia; ++x)
+                input[x] = srcpT[x];
+        }
+        input += xdia;
     }
 }
 
@@ -600,25 +852,124 @@ static void weightedAvgElliottMul5_m16_C(const float *w, const intptr_t n, float
 }
 
 
-template <typename PixelType>
-static void evalFunc_1(const nnedi3Data *d, FrameData *frameData) {
-    float *input = frameData->input;
-    float *temp = frameData->temp;
-    const float * const *weights1 = d->weights1;
+// The predictor runs on this many pixels at a time, so that each block of
+// weights is loaded into the cache only once per batch. The inputs of
+// each pixel are PREDICTOR_STRIDE floats apart (simd_dotprod.h).
+#define PREDICTOR_BATCH 16
+
+
+// Leaves the output of the predictor for pixel k of the batch, before
+// dividing by qual, in mstd[k][3]. selectFunctions picks an instance
+// with the exp and weighted average functions, so they can be inlined.
+template <void (*expfunc)(float *, const intptr_t), void (*wae5)(const float *, const intptr_t, float *)>
+static void predictBatch(const nnedi3Data *d, const float *input, float *temp, float (*mstd)[4], const int count) {
+    const float *weights = d->weights1;
     const int qual = d->qual;
-    const int asize = d->asize;
     const int nns = d->nns;
+    const int block_neurons = d->block_neurons;
+
+    // The outputs of the networks of each pixel, one after the other.
+    const int temp_stride = nns * 2 * qual;
+
+    for (int j = 0; j < temp_stride; j += block_neurons) {
+        d->dotProd(input, weights, temp + j, mstd[0], count, temp_stride, block_neurons);
+        weights += d->block_stride;
+    }
+
+    for (int k = 0; k < count; ++k) {
+        for (int i = 0; i < qual; ++i) {
+            expfunc(temp + k * temp_stride + i * nns * 2, nns);
+            wae5(temp + k * temp_stride + i * nns * 2, nns, mstd[k]);
+        }
+    }
+}
+
+
+// Runs the predictor on the pixels of one row found by evalRow_0.
+template <typename PixelType>
+static void evalRow_1(const nnedi3Data *d, ScratchData *scratch, const RowSource *src, PixelType *dstp, const int width, const int count) {
+    float *input = scratch->input;
+    float *temp = scratch->temp;
+    const int *predict_x = scratch->predict_x;
     const int xdia = d->xdia;
     const int xdiad2m1 = (xdia / 2) - 1;
     const int ydia = d->ydia;
-    const float scale = 1.0f / (float)qual;
+    const float scale = 1.0f / (float)d->qual;
 
+    float mstd[PREDICTOR_BATCH][4];
+
+    dstp -= 32;
+
+    // When the windows of the predicted pixels overlap a lot, it is cheaper
+    // to sum each column of the row once, and find the sums of every window
+    // from those.
+    const int columns = width - 64 + xdia;
+    const bool window_sums = d->windowSums && count * xdia >= columns * 2;
+
+    double *sums = scratch->window_sums;
+    double *sumsqs = sums + columns + 1;
+
+    if (window_sums) {
+        // The windows of the pixels in [left, right) are found in frame.
+        int first = 32;
+        const int last = 32 + columns;
+        const int boundaries[3] = { src->left, src->right, last };
+
+        sums[0] = sumsqs[0] = 0.0;
+        for (int i = 0; i < 3; i++) {
+            const int next = std::min(std::max(boundaries[i], first), last);
+            if (next == first)
+                continue;
+
+            int stride;
+            const PixelType *srcp = rowPixel<PixelType>(src, first, &stride);
+            d->windowSums((const uint8_t *)(srcp - (ydia - 1) * stride - xdiad2m1), stride, next - first, ydia, sums + first - 32, sumsqs + first - 32);
+            first = next;
+        }
+    }
+
+    for (int i = 0; i < count; i += PREDICTOR_BATCH) {
+        const int batch = std::min(count - i, PREDICTOR_BATCH);
+
+        for (int k = 0; k < batch; ++k) {
+            const int x = predict_x[i + k];
+
+            int stride;
+            const PixelType *srcp = rowPixel<PixelType>(src, x, &stride);
+            srcp -= (ydia - 1) * stride + xdiad2m1;
+
+            if (window_sums) {
+                d->copyInput((const uint8_t *)srcp, stride, xdia, ydia, input + k * PREDICTOR_STRIDE);
+                d->meanStdDev(sums[x - 32 + xdia] - sums[x - 32], sumsqs[x - 32 + xdia] - sumsqs[x - 32], xdia, ydia, mstd[k]);
+            } else {
+                d->extract((const uint8_t *)srcp, stride, xdia, ydia, mstd[k], input + k * PREDICTOR_STRIDE);
+            }
+        }
+
+        d->predict(d, input, temp, mstd, batch);
+
+        for (int k = 0; k < batch; ++k) {
+            if (std::is_same<PixelType, float>::value)
+                dstp[predict_x[i + k]] = mstd[k][3] * scale;
+            else
+                dstp[predict_x[i + k]] = std::min(std::max((int)(mstd[k][3] * scale + 0.5f), 0), d->max_value);
+        }
+    }
+}
+
+
+// Each row is prescreened and then predicted right away, while the
+// source rows it needs are still in the cache.
+template <typename PixelType>
+static void evalFunc(const nnedi3Data *d, FrameData *frameData, ScratchData *scratch, int band, int bands) {
     for (int plane = 0; plane < d->vi.format->numPlanes; ++plane) {
         if (!d->process[plane])
             continue;
 
-        const PixelType *srcp = (const PixelType *)frameData->paddedp[plane];
-        const int src_stride = frameData->padded_stride[plane] / sizeof(PixelType);
+        const uint8_t *framep = frameData->framep[plane];
+        const int frame_stride = frameData->frame_stride[plane];
+        const int frame_offset = frameData->frame_offset[plane];
+        const bool frame_direct = frameData->frame_direct[plane];
 
         const int width = frameData->padded_width[plane];
         const int height = frameData->padded_height[plane];
@@ -626,39 +977,53 @@ static void evalFunc_1(const nnedi3Data *d, FrameData *frameData) {
         PixelType *dstp = (PixelType *)frameData->dstp[plane];
         const int dst_stride = frameData->dst_stride[plane] / sizeof(PixelType);
 
-        const int ystart = frameData->field[plane];
-        const int ystop = height - 12;
+        int32_t *lcount = frameData->lcount[plane];
+
+        int ystart, ystop;
+
+        // The rows of the other field are copied as they are.
+        bandRows(1 - frameData->field[plane], height - 12, band, bands, &ystart, &ystop);
+        for (int y = ystart; y < ystop; y += 2)
+            memcpy(dstp + y * dst_stride,
+                   (const PixelType *)(framep + (y - frame_offset) * frame_stride),
+                   (width - 64) * sizeof(PixelType));
 
-        srcp += (ystart + 6) * src_stride;
-        dstp += ystart * dst_stride - 32;
-        const PixelType *srcpp = srcp - (ydia - 1) * src_stride - xdiad2m1;
+        // The rows of the padded plane that are already in scratch->rows.
+        // Each one is written twice, RING_ROWS rows apart, so the 6 rows
+        // around any row are always next to each other.
+        int padded_rows = 0;
 
+        bandRows(frameData->field[plane], height - 12, band, bands, &ystart, &ystop);
         for (int y = ystart; y < ystop; y += 2) {
-            for (int x = 32; x < width - 32; ++x) {
-                uint32_t pixel = 0;
-                memcpy(&pixel, dstp + x, sizeof(PixelType));
-
-                uint32_t all_ones = 0;
-                memset(&all_ones, 255, sizeof(PixelType));
-
-                if (pixel != all_ones)
-                    continue;
-
-                float mstd[4];
-                d->extract((const uint8_t *)(srcpp + x), src_stride, xdia, ydia, mstd, input);
-                for (int i = 0; i < qual; ++i) {
-                    d->dotProd(input, weights1[i], temp, nns * 2, asize, mstd + 2);
-                    d->expfunc(temp, nns);
-                    d->wae5(temp, nns, mstd);
-                }
+            const int rows_stride = scratch->rows_stride;
+
+            for (int r = std::max(padded_rows, 6 + y - 5); r <= 6 + y + 5; r += 2) {
+                const bool edges_only = frame_direct && r >= EDGE_ROWS && r < height - EDGE_ROWS;
+                PixelType *rowp = (PixelType *)(scratch->rows + (r / 2 % RING_ROWS) * rows_stride);
 
-                if (std::is_same<PixelType, float>::value)
-                    dstp[x] = mstd[3] * scale;
-                else
-                    dstp[x] = std::min(std::max((int)(mstd[3] * scale + 0.5f), 0), d->max_value);
+                padRow(frameData, plane, r, rowp, edges_only);
+                memcpy((uint8_t *)rowp + RING_ROWS * rows_stride, rowp, width * sizeof(PixelType));
             }
-            srcpp += src_stride * 2;
-            dstp += dst_stride * 2;
+            padded_rows = 6 + y + 7;
+
+            RowSource row = { scratch->rows + ((6 + y - 5) / 2 % RING_ROWS) * rows_stride + 5 * (rows_stride / 2), (int)(rows_stride / 2 / sizeof(PixelType)), NULL, 0, 0, 0 };
+
+            // Away from the top and bottom, only the first and last
+            // EDGE_COLUMNS columns of the padded rows were written.
+            if (frame_direct && y >= EDGE_ROWS - 12 && y < height - EDGE_ROWS) {
+                row.frame = framep + (y - frame_offset) * frame_stride;
+                row.frame_stride = frame_stride / sizeof(PixelType);
+                row.left = EDGE_COLUMNS - 32;
+                row.right = width - EDGE_COLUMNS + 32;
+            }
+
+            // Handles prescreening and the cubic interpolation.
+            const int count = evalRow_0(d, scratch, &row, dstp + y * dst_stride, width);
+            lcount[y] += count;
+
+            // The rest.
+            if (!d->show_mask)
+                evalRow_1(d, scratch, &row, dstp + y * dst_stride, width, count);
         }
     }
 }
@@ -668,6 +1033,11 @@ static void evalFunc_1(const nnedi3Data *d, FrameData *frameData) {
 #define NUM_NNS 5
 
 
+static const int xdiaTable[NUM_NSIZE] = { 8, 16, 32, 48, 8, 16, 32 };
+static const int ydiaTable[NUM_NSIZE] = { 6, 6, 6, 6, 4, 4, 4 };
+static const int nnsTable[NUM_NNS] = { 16, 32, 64, 128, 256 };
+
+
 static int roundds(const double f) {
     if (f - std::floor(f) >= 0.5)
         return std::min((int)std::ceil(f), 32767);
@@ -702,12 +1072,24 @@ static void selectFunctions(nnedi3Data *d) {
         d->opt = 0;
 #endif
 
+    d->dotProd_avx2 = 0;
+    d->pscrn_groups = 1;
+
+    // The only int8 dotProd functions besides the C one need AVX2.
+#if defined(NNEDI3_X86)
+    if (d->opt && !(cpu.avx2 && cpu.fma3))
+        d->int8_predictor = 0;
+#elif defined(NNEDI3_ARM)
+    if (d->opt)
+        d->int8_predictor = 0;
+#endif
+
     if (d->vi.format->sampleType == stInteger && d->vi.format->bitsPerSample == 8) {
-        d->copyPad = copyPad<uint8_t>;
-        d->evalFunc_0 = evalFunc_0<uint8_t>;
-        d->evalFunc_1 = evalFunc_1<uint8_t>;
+        d->evalFunc = evalFunc<uint8_t>;
+        // With 8 bit pixels the sums in extract are cheap enough.
+        d->windowSums = NULL;
 
-        // evalFunc_0
+        // evalRow_0
         d->processLine0 = processLine0_C<uint8_t, int>;
 
         if (d->pscrn < 2) { // original prescreener
@@ -724,27 +1106,28 @@ static void selectFunctions(nnedi3Data *d) {
             d->computeNetwork0 = computeNetwork0new_C;
         }
 
-        // evalFunc_1
-        d->wae5 = weightedAvgElliottMul5_m16_C;
-
-        if (d->int16_predictor) { // use int16 dot products
+        // evalRow_1
+        if (d->int8_predictor) { // use int8 dot products
+            d->extract = extract_m8_i8_C;
+            d->dotProd = dotProdB_C_nsize[d->nsize];
+        } else if (d->int16_predictor) { // use int16 dot products
             d->extract = extract_m8_i16_C<uint8_t>;
-            d->dotProd = dotProdS_C;
+            d->dotProd = dotProdS_C_nsize[d->nsize];
         } else { // use float dot products
             d->extract = extract_m8_C<uint8_t, int32_t, float>;
-            d->dotProd = dotProd_C;
+            d->dotProd = dotProd_C_nsize[d->nsize];
         }
 
         if (d->exp == 2) // use slow exp
-            d->expfunc = e2_m16_C;
+            d->predict = predictBatch<e2_m16_C, weightedAvgElliottMul5_m16_C>;
         else if (d->exp == 1) // use faster exp
-            d->expfunc = e1_m16_C;
+            d->predict = predictBatch<e1_m16_C, weightedAvgElliottMul5_m16_C>;
         else // use fastest exp
-            d->expfunc = e0_m16_C;
+            d->predict = predictBatch<e0_m16_C, weightedAvgElliottMul5_m16_C>;
 
 #if defined(NNEDI3_X86)
         if (d->opt) {
-            // evalFunc_0
+            // evalRow_0
             d->processLine0 = processLine0_maybeSSE2;
 
             if (d->pscrn < 2) { // original prescreener
@@ -763,37 +1146,69 @@ static void selectFunctions(nnedi3Data *d) {
                 // only int16 dot products
                 d->readPixels = nnedi3_byte2word64_SSE2;
                 d->computeNetwork0 = nnedi3_computeNetwork0new_SSE2;
+                if (cpu.avx2 && cpu.fma3) {
+                    d->computeNetwork0 = nnedi3_computeNetwork0new_AVX2;
+                    d->pscrn_groups = 2;
+                }
             }
 
-            // evalFunc_1
-            d->wae5 = nnedi3_weightedAvgElliottMul5_m16_SSE2;
-
-            if (d->int16_predictor) { // use int16 dot products
+            // evalRow_1
+            if (d->int8_predictor) { // use int8 dot products
+                d->extract = nnedi3_extract_m8_i8_SSE2;
+                d->dotProd = nnedi3_dotProd_i8_AVX2_nsize[d->nsize];
+                d->dotProd_avx2 = 1;
+                if (cpu.avx512f && cpu.avx512bw) {
+                    d->dotProd = nnedi3_dotProd_i8_AVX512_nsize[d->nsize];
+                    if (cpu.avx512vnni)
+                        d->dotProd = nnedi3_dotProd_i8_AVX512VNNI_nsize[d->nsize];
+                }
+            } else if (d->int16_predictor) { // use int16 dot products
                 d->extract = nnedi3_extract_m8_i16_SSE2;
-                d->dotProd = nnedi3_dotProd_i16_SSE2;
+                d->dotProd = nnedi3_dotProd_i16_SSE2_nsize[d->nsize];
+                if (cpu.avx2 && cpu.fma3) {
+                    d->dotProd = nnedi3_dotProd_i16_AVX2_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
+                if (cpu.avx512f && cpu.avx512bw) {
+                    d->dotProd = nnedi3_dotProd_i16_AVX512_nsize[d->nsize];
+                    if (cpu.avx512vnni)
+                        d->dotProd = nnedi3_dotProd_i16_AVX512VNNI_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
             } else { // use float dot products
                 d->extract = nnedi3_extract_m8_SSE2;
-                d->dotProd = nnedi3_dotProd_SSE2;
+                d->dotProd = nnedi3_dotProd_SSE2_nsize[d->nsize];
                 if (cpu.fma3)
-                    d->dotProd = nnedi3_dotProd_FMA3;
+                    d->dotProd = nnedi3_dotProd_FMA3_nsize[d->nsize];
                 if (cpu.fma4)
-                    d->dotProd = nnedi3_dotProd_FMA4;
+                    d->dotProd = nnedi3_dotProd_FMA4_nsize[d->nsize];
+                if (cpu.avx2 && cpu.fma3) {
+                    d->dotProd = nnedi3_dotProd_AVX2_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
+                if (cpu.avx512f && cpu.avx512bw) {
+                    d->dotProd = nnedi3_dotProd_AVX512_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
             }
 
             if (d->exp == 2) { // use slow exp
-                d->expfunc = nnedi3_e2_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e2_m16, nnedi3_weightedAvgElliottMul5_m16>;
             } else if (d->exp == 1) { // use faster exp
-                d->expfunc = nnedi3_e1_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e1_m16, nnedi3_weightedAvgElliottMul5_m16>;
             } else { // use fastest exp
-                d->expfunc = nnedi3_e0_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e0_m16, nnedi3_weightedAvgElliottMul5_m16>;
                 if (cpu.fma3)
-                    d->expfunc = nnedi3_e0_m16_FMA3;
+                    d->predict = predictBatch<nnedi3_e0_m16_FMA3, nnedi3_weightedAvgElliottMul5_m16>;
                 if (cpu.fma4)
-                    d->expfunc = nnedi3_e0_m16_FMA4;
+                    d->predict = predictBatch<nnedi3_e0_m16_FMA4, nnedi3_weightedAvgElliottMul5_m16>;
             }
         }
 #elif defined(NNEDI3_ARM)
         if (d->opt && cpu.neon) {
+            // evalRow_0
+            d->processLine0 = processLine0_neon;
+
             if (d->pscrn < 2) { // original prescreener
                 if (d->int16_prescreener) { // int16 dot products
                     d->readPixels = byte2word48_neon;
@@ -808,19 +1223,28 @@ static void selectFunctions(nnedi3Data *d) {
                 d->computeNetwork0 = computeNetwork0new_neon;
             }
 
-            // evalFunc_1
-            if (d->int16_predictor) // use int16 dot products
-                d->dotProd = dotProd_i16_neon;
-            else // use float dot products
-                d->dotProd = dotProd_neon;
+            // evalRow_1
+            if (d->int16_predictor) { // use int16 dot products
+                d->extract = extract_m8_i16_neon;
+                d->dotProd = dotProd_i16_neon_nsize[d->nsize];
+            } else { // use float dot products
+                d->extract = extract_m8_neon;
+                d->dotProd = dotProd_neon_nsize[d->nsize];
+            }
+
+            if (d->exp == 2) // use slow exp
+                d->predict = predictBatch<e2_m16_neon, weightedAvgElliottMul5_m16_neon>;
+            else if (d->exp == 1) // use faster exp
+                d->predict = predictBatch<e1_m16_neon, weightedAvgElliottMul5_m16_neon>;
+            else // use fastest exp
+                d->predict = predictBatch<e0_m16_neon, weightedAvgElliottMul5_m16_neon>;
         }
 #endif
     } else if (d->vi.format->sampleType == stInteger && d->vi.format->bitsPerSample <= 16) {
-        d->copyPad = copyPad<uint16_t>;
-        d->evalFunc_0 = evalFunc_0<uint16_t>;
-        d->evalFunc_1 = evalFunc_1<uint16_t>;
+        d->evalFunc = evalFunc<uint16_t>;
+        d->windowSums = windowSums_C<uint16_t, int64_t>;
 
-        // evalFunc_0
+        // evalRow_0
         d->processLine0 = processLine0_C<uint16_t, int>;
 
         if (d->pscrn < 2) {
@@ -836,29 +1260,42 @@ static void selectFunctions(nnedi3Data *d) {
             d->computeNetwork0 = computeNetwork0new_C;
         }
 
-        // evalFunc_1
-        d->wae5 = weightedAvgElliottMul5_m16_C;
-
-        if (d->int16_predictor) { // only used for 9..15 bits
+        // evalRow_1
+        if (d->int16_predictor && d->vi.format->bitsPerSample > 12) { // int16 dot products with shifted pixels
+            // The pixels can't be stored until the mean and the standard
+            // deviation of the window are known, so there are no window sums.
+            d->windowSums = NULL;
+            d->extract = extract_m8_i16_shift_C;
+            d->dotProd = dotProdS_C_nsize[d->nsize];
+        } else if (d->int16_predictor) { // use int16 dot products
             d->extract = extract_m8_i16_C<uint16_t>;
-            d->dotProd = dotProdS_C;
+            d->copyInput = copyInput_m8_C<uint16_t, int16_t>;
+            d->meanStdDev = meanStdDev_m8_i16_C;
+            d->dotProd = dotProdS_C_nsize[d->nsize];
         } else {
             d->extract = extract_m8_C<uint16_t, int64_t, double>;
-            d->dotProd = dotProd_C;
+            d->copyInput = copyInput_m8_C<uint16_t, float>;
+            d->meanStdDev = meanStdDev_m8_C<int64_t, double>;
+            d->dotProd = dotProd_C_nsize[d->nsize];
         }
 
         if (d->exp == 2) // use slow exp
-            d->expfunc = e2_m16_C;
+            d->predict = predictBatch<e2_m16_C, weightedAvgElliottMul5_m16_C>;
         else if (d->exp == 1) // use faster exp
-            d->expfunc = e1_m16_C;
+            d->predict = predictBatch<e1_m16_C, weightedAvgElliottMul5_m16_C>;
         else // use fastest exp
-            d->expfunc = e0_m16_C;
+            d->predict = predictBatch<e0_m16_C, weightedAvgElliottMul5_m16_C>;
 
 #if defined(NNEDI3_X86)
         if (d->opt) {
-            // evalFunc_0
+            // evalRow_0
+            d->processLine0 = processLine0_maybeSIMD<uint16_t, int, nnedi3_processLine0_word_SSE2>;
+            if (cpu.avx2 && cpu.fma3)
+                d->processLine0 = processLine0_maybeSIMD<uint16_t, int, nnedi3_processLine0_word_AVX2>;
+
             if (d->pscrn < 2) {
                 if (d->int16_prescreener) {
+                    d->readPixels = d->vi.format->bitsPerSample == 16 ? nnedi3_word2word48_shift_SSE2 : nnedi3_word2word48_SSE2;
                     d->computeNetwork0 = nnedi3_computeNetwork0_i16_SSE2;
                 } else {
                     d->readPixels = nnedi3_word2float48_SSE2;
@@ -869,112 +1306,201 @@ static void selectFunctions(nnedi3Data *d) {
                         d->computeNetwork0 = nnedi3_computeNetwork0_FMA4;
                 }
             } else {
+                d->readPixels = d->vi.format->bitsPerSample == 16 ? nnedi3_word2word64_shift_SSE2 : nnedi3_word2word64_SSE2;
                 d->computeNetwork0 = nnedi3_computeNetwork0new_SSE2;
+                if (cpu.avx2 && cpu.fma3) {
+                    d->computeNetwork0 = nnedi3_computeNetwork0new_AVX2;
+                    d->pscrn_groups = 2;
+                }
             }
 
-            // evalFunc_1
-            d->wae5 = nnedi3_weightedAvgElliottMul5_m16_SSE2;
-
+            // evalRow_1
             if (d->int16_predictor) {
-                d->dotProd = nnedi3_dotProd_i16_SSE2;
+                d->extract = d->vi.format->bitsPerSample > 12 ? nnedi3_extract_m8_i16_shift_word_SSE2 : nnedi3_extract_m8_i16_word_SSE2;
+                d->dotProd = nnedi3_dotProd_i16_SSE2_nsize[d->nsize];
+                if (cpu.avx2 && cpu.fma3) {
+                    d->dotProd = nnedi3_dotProd_i16_AVX2_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
+                if (cpu.avx512f && cpu.avx512bw) {
+                    d->dotProd = nnedi3_dotProd_i16_AVX512_nsize[d->nsize];
+                    if (cpu.avx512vnni)
+                        d->dotProd = nnedi3_dotProd_i16_AVX512VNNI_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
             } else {
-                d->dotProd = nnedi3_dotProd_SSE2;
+                d->extract = nnedi3_extract_m8_word_SSE2;
+                d->copyInput = nnedi3_copyInput_m8_word_SSE2;
+                d->dotProd = nnedi3_dotProd_SSE2_nsize[d->nsize];
                 if (cpu.fma3)
-                    d->dotProd = nnedi3_dotProd_FMA3;
+                    d->dotProd = nnedi3_dotProd_FMA3_nsize[d->nsize];
                 if (cpu.fma4)
-                    d->dotProd = nnedi3_dotProd_FMA4;
+                    d->dotProd = nnedi3_dotProd_FMA4_nsize[d->nsize];
+                if (cpu.avx2 && cpu.fma3) {
+                    d->dotProd = nnedi3_dotProd_AVX2_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
+                if (cpu.avx512f && cpu.avx512bw) {
+                    d->dotProd = nnedi3_dotProd_AVX512_nsize[d->nsize];
+                    d->dotProd_avx2 = 1;
+                }
             }
 
             if (d->exp == 2) { // use slow exp
-                d->expfunc = nnedi3_e2_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e2_m16, nnedi3_weightedAvgElliottMul5_m16>;
             } else if (d->exp == 1) { // use faster exp
-                d->expfunc = nnedi3_e1_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e1_m16, nnedi3_weightedAvgElliottMul5_m16>;
             } else { // use fastest exp
-                d->expfunc = nnedi3_e0_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e0_m16, nnedi3_weightedAvgElliottMul5_m16>;
                 if (cpu.fma3)
-                    d->expfunc = nnedi3_e0_m16_FMA3;
+                    d->predict = predictBatch<nnedi3_e0_m16_FMA3, nnedi3_weightedAvgElliottMul5_m16>;
                 if (cpu.fma4)
-                    d->expfunc = nnedi3_e0_m16_FMA4;
+                    d->predict = predictBatch<nnedi3_e0_m16_FMA4, nnedi3_weightedAvgElliottMul5_m16>;
             }
         }
 #elif defined(NNEDI3_ARM)
         if (d->opt && cpu.neon) {
+            // evalRow_0
+            d->processLine0 = processLine0_word_neon;
+
             if (d->pscrn < 2) {
                 if (d->int16_prescreener) {
+                    d->readPixels = d->vi.format->bitsPerSample == 16 ? word2word48_shift_neon : word2word48_neon;
                     d->computeNetwork0 = computeNetwork0_i16_neon;
                 } else {
                     d->readPixels = word2float48_neon;
                     d->computeNetwork0 = computeNetwork0_neon;
                 }
             } else {
+                d->readPixels = d->vi.format->bitsPerSample == 16 ? word2word64_shift_neon : word2word64_neon;
                 d->computeNetwork0 = computeNetwork0new_neon;
             }
 
+            // evalRow_1
             if (d->int16_predictor) {
-                d->dotProd = dotProd_i16_neon;
+                d->extract = d->vi.format->bitsPerSample > 12 ? extract_m8_i16_shift_word_neon : extract_m8_i16_word_neon;
+                d->dotProd = dotProd_i16_neon_nsize[d->nsize];
             } else {
-                d->dotProd = dotProd_neon;
+                d->extract = extract_m8_word_neon;
+                d->copyInput = copyInput_m8_word_neon;
+                d->dotProd = dotProd_neon_nsize[d->nsize];
             }
+
+            if (d->exp == 2) // use slow exp
+                d->predict = predictBatch<e2_m16_neon, weightedAvgElliottMul5_m16_neon>;
+            else if (d->exp == 1) // use faster exp
+                d->predict = predictBatch<e1_m16_neon, weightedAvgElliottMul5_m16_neon>;
+            else // use fastest exp
+                d->predict = predictBatch<e0_m16_neon, weightedAvgElliottMul5_m16_neon>;
         }
 #endif
     } else if (d->vi.format->sampleType == stFloat && d->vi.format->bitsPerSample == 32) {
-        d->copyPad = copyPad<float>;
-        d->evalFunc_0 = evalFunc_0<float>;
-        d->evalFunc_1 = evalFunc_1<float>;
+        d->evalFunc = evalFunc<float>;
+        d->windowSums = windowSums_C<float, double>;
 
-        // evalFunc_0
+        // evalRow_0
         d->processLine0 = processLine0_C<float, float>;
 
-        d->readPixels = pixel2float48_C<float>;
-        d->computeNetwork0 = computeNetwork0_C;
-
-        // evalFunc_1
-        d->wae5 = weightedAvgElliottMul5_m16_C;
+        if (d->pscrn < 2) { // original prescreener
+            d->readPixels = pixel2float48_C<float>;
+            d->computeNetwork0 = computeNetwork0_C;
+        } else { // new prescreener
+            // only int16 dot products
+            d->readPixels = float2word64_C;
+            d->computeNetwork0 = computeNetwork0new_C;
+        }
 
+        // evalRow_1
         d->extract = extract_m8_C<float, double, double>;
-        d->dotProd = dotProd_C;
+        d->copyInput = copyInput_m8_C<float, float>;
+        d->meanStdDev = meanStdDev_m8_C<double, double>;
+        d->dotProd = dotProd_C_nsize[d->nsize];
 
         if (d->exp == 2) // use slow exp
-            d->expfunc = e2_m16_C;
+            d->predict = predictBatch<e2_m16_C, weightedAvgElliottMul5_m16_C>;
         else if (d->exp == 1) // use faster exp
-            d->expfunc = e1_m16_C;
+            d->predict = predictBatch<e1_m16_C, weightedAvgElliottMul5_m16_C>;
         else // use fastest exp
-            d->expfunc = e0_m16_C;
+            d->predict = predictBatch<e0_m16_C, weightedAvgElliottMul5_m16_C>;
 
 #if defined(NNEDI3_X86)
         if (d->opt) {
-            // evalFunc_0
-            d->computeNetwork0 = nnedi3_computeNetwork0_SSE2;
-            if (cpu.fma3)
-                d->computeNetwork0 = nnedi3_computeNetwork0_FMA3;
-            if (cpu.fma4)
-                d->computeNetwork0 = nnedi3_computeNetwork0_FMA4;
+            // evalRow_0
+            d->processLine0 = processLine0_maybeSIMD<float, float, nnedi3_processLine0_float_SSE2>;
+            if (cpu.avx2 && cpu.fma3)
+                d->processLine0 = processLine0_maybeSIMD<float, float, nnedi3_processLine0_float_AVX2>;
+
+            if (d->pscrn < 2) { // original prescreener
+                d->readPixels = nnedi3_float2float48_SSE2;
+                d->computeNetwork0 = nnedi3_computeNetwork0_SSE2;
+                if (cpu.fma3)
+                    d->computeNetwork0 = nnedi3_computeNetwork0_FMA3;
+                if (cpu.fma4)
+                    d->computeNetwork0 = nnedi3_computeNetwork0_FMA4;
+            } else { // new prescreener
+                // only int16 dot products
+                d->readPixels = nnedi3_float2word64_SSE2;
+                d->computeNetwork0 = nnedi3_computeNetwork0new_SSE2;
+                if (cpu.avx2 && cpu.fma3) {
+                    d->computeNetwork0 = nnedi3_computeNetwork0new_AVX2;
+                    d->pscrn_groups = 2;
+                }
+            }
 
-            // evalFunc_1
-            d->wae5 = nnedi3_weightedAvgElliottMul5_m16_SSE2;
+            // evalRow_1
+            d->extract = nnedi3_extract_m8_float_SSE2;
+            if (cpu.avx2 && cpu.fma3)
+                d->extract = nnedi3_extract_m8_float_AVX2;
 
-            d->dotProd = nnedi3_dotProd_SSE2;
+            d->dotProd = nnedi3_dotProd_SSE2_nsize[d->nsize];
             if (cpu.fma3)
-                d->dotProd = nnedi3_dotProd_FMA3;
+                d->dotProd = nnedi3_dotProd_FMA3_nsize[d->nsize];
             if (cpu.fma4)
-                d->dotProd = nnedi3_dotProd_FMA4;
+                d->dotProd = nnedi3_dotProd_FMA4_nsize[d->nsize];
+            if (cpu.avx2 && cpu.fma3) {
+                d->dotProd = nnedi3_dotProd_AVX2_nsize[d->nsize];
+                d->dotProd_avx2 = 1;
+            }
+            if (cpu.avx512f && cpu.avx512bw) {
+                d->dotProd = nnedi3_dotProd_AVX512_nsize[d->nsize];
+                d->dotProd_avx2 = 1;
+            }
 
             if (d->exp == 2) { // use slow exp
-                d->expfunc = nnedi3_e2_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e2_m16, nnedi3_weightedAvgElliottMul5_m16>;
             } else if (d->exp == 1) { // use faster exp
-                d->expfunc = nnedi3_e1_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e1_m16, nnedi3_weightedAvgElliottMul5_m16>;
             } else { // use fastest exp
-                d->expfunc = nnedi3_e0_m16_SSE2;
+                d->predict = predictBatch<nnedi3_e0_m16, nnedi3_weightedAvgElliottMul5_m16>;
                 if (cpu.fma3)
-                    d->expfunc = nnedi3_e0_m16_FMA3;
+                    d->predict = predictBatch<nnedi3_e0_m16_FMA3, nnedi3_weightedAvgElliottMul5_m16>;
                 if (cpu.fma4)
-                    d->expfunc = nnedi3_e0_m16_FMA4;
+                    d->predict = predictBatch<nnedi3_e0_m16_FMA4, nnedi3_weightedAvgElliottMul5_m16>;
             }
         }
 #elif defined(NNEDI3_ARM)
         if (d->opt && cpu.neon) {
-            d->computeNetwork0 = computeNetwork0_neon;
-            d->dotProd = dotProd_neon;
+            // evalRow_0
+            d->processLine0 = processLine0_float_neon;
+
+            if (d->pscrn < 2) { // original prescreener
+                d->computeNetwork0 = computeNetwork0_neon;
+            } else { // new prescreener
+                // only int16 dot products
+                d->readPixels = float2word64_neon;
+                d->computeNetwork0 = computeNetwork0new_neon;
+            }
+
+            // evalRow_1
+            d->extract = extract_m8_float_neon;
+            d->dotProd = dotProd_neon_nsize[d->nsize];
+
+            if (d->exp == 2) // use slow exp
+                d->predict = predictBatch<e2_m16_neon, weightedAvgElliottMul5_m16_neon>;
+            else if (d->exp == 1) // use faster exp
+                d->predict = predictBatch<e1_m16_neon, weightedAvgElliottMul5_m16_neon>;
+            else // use fastest exp
+                d->predict = predictBatch<e0_m16_neon, weightedAvgElliottMul5_m16_neon>;
         }
 #endif
     }
@@ -994,6 +1520,86 @@ static int modnpf(const int m, const int n) {
 }
 
 
+static void allocScratch(ScratchData *scratch, const VSVideoInfo *vi) {
+    const int width = vi->width;
+
+    scratch->input = vs_aligned_malloc<float>(PREDICTOR_BATCH * PREDICTOR_STRIDE * sizeof(float), 32);
+    // evalRow_0 requires at least width + 64 bytes.
+    // evalRow_1 requires at least PREDICTOR_BATCH * nns * 2 * qual floats.
+    size_t temp_size = std::max((size_t)width + 64, PREDICTOR_BATCH * 256 * 2 * 2 * sizeof(float));
+    scratch->temp = vs_aligned_malloc<float>(temp_size, 16);
+    scratch->predict_x = (int *)malloc(width * sizeof(int));
+    // evalRow_1 requires 2 * (width + xdia + 1) doubles.
+    scratch->window_sums = (double *)malloc(2 * (width + 64) * sizeof(double));
+    // evalFunc requires 2 * RING_ROWS padded rows, with an even number of 16 byte blocks each.
+    scratch->rows_stride = modnpf((width + 64) * vi->format->bytesPerSample, 32);
+    scratch->rows = vs_aligned_malloc<uint8_t>(2 * RING_ROWS * (size_t)scratch->rows_stride, 32);
+}
+
+
+static void freeScratch(ScratchData *scratch) {
+    vs_aligned_free(scratch->input);
+    vs_aligned_free(scratch->temp);
+    free(scratch->predict_x);
+    free(scratch->window_sums);
+    vs_aligned_free(scratch->rows);
+}
+
+
+static FrameData *takeFrameData(const nnedi3Data *d) {
+    FrameDataPool *pool = d->frame_pool;
+    FrameData *frameData;
+
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        frameData = pool->free_frames;
+        if (frameData)
+            pool->free_frames = frameData->next;
+    }
+
+    if (!frameData) {
+        frameData = (FrameData *)malloc(sizeof(FrameData));
+        memset(frameData, 0, sizeof(FrameData));
+    }
+
+    return frameData;
+}
+
+
+static void returnFrameData(const nnedi3Data *d, FrameData *frameData) {
+    FrameDataPool *pool = d->frame_pool;
+
+    std::lock_guard<std::mutex> guard(pool->lock);
+    frameData->next = pool->free_frames;
+    pool->free_frames = frameData;
+}
+
+
+static void freeFrameData(FrameData *frameData) {
+    for (int plane = 0; plane < 3; plane++) {
+        vs_aligned_free(frameData->lcount[plane]);
+    }
+    freeScratch(&frameData->scratch);
+
+    free(frameData);
+}
+
+
+typedef struct {
+    const nnedi3Data *d;
+    FrameData *frameData;
+} BandData;
+
+
+static void processBand(void *userdata, int band, int worker) {
+    const BandData *bandData = (const BandData *)userdata;
+    const nnedi3Data *d = bandData->d;
+    ScratchData *scratch = worker < 0 ? &bandData->frameData->scratch : &d->worker_scratch[worker];
+
+    d->evalFunc(d, bandData->frameData, scratch, band, d->bands);
+}
+
+
 typedef enum VSFieldBased {
     VSFieldBasedProgressive = 0,
     VSFieldBasedBFF,
@@ -1053,63 +1659,54 @@ static const VSFrameRef *VS_CC nnedi3GetFrame(int n, int activationReason, void
         VSFrameRef *dst = vsapi->newVideoFrame(d->vi.format, d->vi.width, d->vi.height, src, core);
 
 
-        FrameData *frameData = (FrameData *)malloc(sizeof(FrameData));
-        memset(frameData, 0, sizeof(FrameData));
+        FrameData *frameData = takeFrameData(d);
 
         for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
             if (!d->process[plane])
                 continue;
 
-            const int min_pad = 10;
-            const int min_alignment = 16;
-
             int dst_width = vsapi->getFrameWidth(dst, plane);
             int dst_height = vsapi->getFrameHeight(dst, plane);
 
             frameData->padded_width[plane]  = dst_width + 64;
             frameData->padded_height[plane] = dst_height + 12;
-            frameData->padded_stride[plane] = modnpf(frameData->padded_width[plane] * d->vi.format->bytesPerSample + min_pad, min_alignment); // TODO: maybe min_pad is in pixels too?
-            frameData->paddedp[plane] = vs_aligned_malloc<uint8_t>((size_t)frameData->padded_stride[plane] * (size_t)frameData->padded_height[plane], min_alignment);
+
+            // The source is read in place, and the rows around the ones
+            // being interpolated are padded by evalFunc as it goes. Nothing
+            // is prepared per field, so with field=2 and field=3 the two
+            // frames made from the same source frame don't repeat any work.
+            // With dh, two rows of the padded plane are one row of src, and
+            // the SSE2 processLine0 needs the half stride to be a multiple
+            // of 16 bytes.
+            frameData->framep[plane] = vsapi->getReadPtr(src, plane);
+            frameData->frame_stride[plane] = vsapi->getStride(src, plane) / (d->dh ? 2 : 1);
+            frameData->frame_offset[plane] = d->dh ? 1 - field_n : 0;
+            frameData->frame_direct[plane] = dst_width >= 2 * EDGE_COLUMNS && vsapi->getStride(src, plane) % 32 == 0;
 
             frameData->dstp[plane] = vsapi->getWritePtr(dst, plane);
             frameData->dst_stride[plane] = vsapi->getStride(dst, plane);
 
-            frameData->lcount[plane] = vs_aligned_malloc<int32_t>(dst_height * sizeof(int32_t), 16);
+            if (!frameData->lcount[plane])
+                frameData->lcount[plane] = vs_aligned_malloc<int32_t>(dst_height * sizeof(int32_t), 16);
             memset(frameData->lcount[plane], 0, dst_height * sizeof(int32_t));
 
             frameData->field[plane] = field_n;
         }
 
-        frameData->input = vs_aligned_malloc<float>(512 * sizeof(float), 16);
-        // evalFunc_0 requires at least padded_width[0] bytes.
-        // evalFunc_1 requires at least 512 floats.
-        size_t temp_size = std::max((size_t)frameData->padded_width[0], 512 * sizeof(float));
-        frameData->temp = vs_aligned_malloc<float>(temp_size, 16);
-
-        // Copy src to a padded "frame" in frameData and mirror the edges.
-        d->copyPad(src, frameData, d, field_n, vsapi);
-
-
-        // Handles prescreening and the cubic interpolation.
-        d->evalFunc_0(d, frameData);
+        if (!frameData->scratch.input)
+            allocScratch(&frameData->scratch, &d->vi);
 
-        // The rest.
-        if (!d->show_mask)
-            d->evalFunc_1(d, frameData);
 
+        BandData bandData = { d, frameData };
 
-        // Clean up.
-        for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
-            if (!d->process[plane])
-                continue;
+        if (d->pool)
+            threadPoolRun(d->pool, processBand, &bandData, d->bands);
+        else
+            processBand(&bandData, 0, -1);
 
-            vs_aligned_free(frameData->paddedp[plane]);
-            vs_aligned_free(frameData->lcount[plane]);
-        }
-        vs_aligned_free(frameData->input);
-        vs_aligned_free(frameData->temp);
 
-        free(frameData);
+        // Keep the buffers for the next frame.
+        returnFrameData(d, frameData);
 
         vsapi->freeFrame(src);
 
@@ -1135,296 +1732,249 @@ static const VSFrameRef *VS_CC nnedi3GetFrame(int n, int activationReason, void
 }
 
 
-static void VS_CC nnedi3Free(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    nnedi3Data *d = (nnedi3Data *)instanceData;
-    vsapi->freeNode(d->node);
-
-    vs_aligned_free(d->weights0);
-
-    for (int i = 0; i < 2; i++)
-        vs_aligned_free(d->weights1[i]);
+// The prepared weights depend only on these. Filter instances with the same
+// key share one read-only copy of the weights.
+typedef struct {
+    int nsize;
+    int nnsparam;
+    int etype;
+    int pscrn;
+    int bits_per_sample;
+    int sample_type;
+    int int16_prescreener;
+    int int16_predictor;
+    int int8_predictor;
+    int qual;
+    int opt;
+    int dotProd_avx2;
+} WeightsKey;
 
-    free(d);
-}
 
+typedef struct PreparedWeights {
+    WeightsKey key;
 
-static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
-    nnedi3Data d;
-    nnedi3Data *data;
-    int err;
+    float *weights0;
+    float *weights1;
+    size_t weights0_size; // in bytes
+    size_t weights1_size; // in bytes
 
-    // Get a clip reference from the input arguments. This must be freed later.
-    d.node = vsapi->propGetNode(in, "clip", 0, 0);
-    d.vi = *vsapi->getVideoInfo(d.node);
+    int refcount;
+    struct PreparedWeights *next;
+} PreparedWeights;
 
-    if (!d.vi.format ||
-        (d.vi.format->sampleType == stInteger && d.vi.format->bitsPerSample > 16) ||
-        (d.vi.format->sampleType == stFloat && d.vi.format->bitsPerSample != 32)) {
-        vsapi->setError(out, "nnedi3: only constant format 8..16 bit integer or 32 bit float input supported");
-        vsapi->freeNode(d.node);
-        return;
-    }
 
-    // Get the parameters.
-    d.field = int64ToIntS(vsapi->propGetInt(in, "field", 0, 0));
+static std::mutex weights_cache_lock;
+static PreparedWeights *weights_cache = NULL;
 
-    // Defaults to 0.
-    d.dh = int64ToIntS(vsapi->propGetInt(in, "dh", 0, &err));
 
-    int n = d.vi.format->numPlanes;
-    int m = vsapi->propNumElements(in, "planes");
+// Version 0.9.4 of the Avisynth plugin.
+static const int64_t weights_file_size = 13574928;
 
-    for (int i = 0; i < 3; i++)
-        d.process[i] = (m <= 0);
 
-    for (int i = 0; i < m; i++) {
-        int o = int64ToIntS(vsapi->propGetInt(in, "planes", i, 0));
+#ifdef NNEDI3_EMBEDDED_WEIGHTS
+// A copy of nnedi3_weights.bin included by embedded_weights.c.
+extern "C" const uint8_t nnedi3_embedded_weights[];
+extern "C" const uint8_t nnedi3_embedded_weights_end[];
 
-        if (o < 0 || o >= n) {
-            vsapi->setError(out, "nnedi3: plane index out of range");
-            vsapi->freeNode(d.node);
-            return;
-        }
 
-        if (d.process[o]) {
-            vsapi->setError(out, "nnedi3: plane specified twice");
-            vsapi->freeNode(d.node);
-            return;
-        }
+static const float *loadWeightsFile(VSMap *out, VSCore *core, const VSAPI *vsapi) {
+    const int64_t size = nnedi3_embedded_weights_end - nnedi3_embedded_weights;
 
-        d.process[o] = 1;
+    if (size != weights_file_size) {
+        vsapi->setError(out, ("nnedi3: the embedded weights have the wrong size. Expected " + std::to_string(weights_file_size) + " bytes, got " + std::to_string(size) + " bytes.").c_str());
+        return NULL;
     }
 
-    d.nsize = int64ToIntS(vsapi->propGetInt(in, "nsize", 0, &err));
-    if (err)
-        d.nsize = 6;
-
-    d.nnsparam = int64ToIntS(vsapi->propGetInt(in, "nns", 0, &err));
-    if (err)
-        d.nnsparam = 1;
-
-    d.qual = int64ToIntS(vsapi->propGetInt(in, "qual", 0, &err));
-    if (err)
-        d.qual = 1;
-
-    d.etype = int64ToIntS(vsapi->propGetInt(in, "etype", 0, &err));
+    return (const float *)nnedi3_embedded_weights;
+}
 
-    d.pscrn = int64ToIntS(vsapi->propGetInt(in, "pscrn", 0, &err));
-    if (err) {
-        if (d.vi.format->sampleType == stInteger)
-            d.pscrn = 2;
-        else
-            d.pscrn = 1;
-    }
 
-    d.opt = !!vsapi->propGetInt(in, "opt", 0, &err);
-#if defined(NNEDI3_X86) || defined(NNEDI3_ARM)
-    if (err)
-        d.opt = 1;
+static void unmapWeightsFile(const float *bdata) {
+}
 #else
-    d.opt = 0;
-#endif
-
-    d.int16_prescreener = !!vsapi->propGetInt(in, "int16_prescreener", 0, &err);
-    if (err)
-        d.int16_prescreener = 1;
-
-    d.int16_predictor = !!vsapi->propGetInt(in, "int16_predictor", 0, &err);
-    if (err)
-        d.int16_predictor = 1;
-
-    d.exp = int64ToIntS(vsapi->propGetInt(in, "exp", 0, &err));
-
-    d.show_mask = !!vsapi->propGetInt(in, "show_mask", 0, &err);
-
-    // Check the values.
-    if (d.field < 0 || d.field > 3) {
-        vsapi->setError(out, "nnedi3: field must be between 0 and 3 (inclusive)");
-        vsapi->freeNode(d.node);
-        return;
-    }
+// Maps the file into memory, so that only the parts of it that are
+// actually used get read from the disk. open_failed is set to 1 if
+// the file couldn't be opened at all.
+// Returns NULL after setting error.
+static const float *mapWeightsFile(const std::string &weights_path, std::string &error, int *open_failed) {
+    *open_failed = 0;
 
-    d.dh = !!d.dh; // Just consider any nonzero value true.
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> utf16;
 
-    if (d.dh && d.field > 1) {
-        vsapi->setError(out, "nnedi3: field must be 0 or 1 when dh is true");
-        vsapi->freeNode(d.node);
-        return;
+    HANDLE file = CreateFileW(utf16.from_bytes(weights_path).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = "Couldn't open file '" + weights_path + "'. Error code: " + std::to_string(GetLastError());
+        *open_failed = 1;
+        return NULL;
     }
 
-    if (d.nsize < 0 || d.nsize >= NUM_NSIZE) {
-        vsapi->setError(out, "nnedi3: nsize must be between 0 and 6 (inclusive)");
-        vsapi->freeNode(d.node);
-        return;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        error = "Failed to determine the size of '" + weights_path + "'. Error code: " + std::to_string(GetLastError());
+        CloseHandle(file);
+        return NULL;
     }
-
-    if (d.nnsparam < 0 || d.nnsparam >= NUM_NNS) {
-        vsapi->setError(out, "nnedi3: nns must be between 0 and 4 (inclusive)");
-        vsapi->freeNode(d.node);
-        return;
+    int64_t weights_size = size.QuadPart;
+#else
+    int fd = open(weights_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        error = "Couldn't open file '" + weights_path + "'. Error message: " + strerror(errno);
+        *open_failed = 1;
+        return NULL;
     }
 
-    if (d.qual < 1 || d.qual > 2) {
-        vsapi->setError(out, "nnedi3: qual must be between 1 and 2 (inclusive)");
-        vsapi->freeNode(d.node);
-        return;
+    struct stat st;
+    if (fstat(fd, &st)) {
+        error = "Failed to determine the size of '" + weights_path + "'. Error message: " + strerror(errno);
+        close(fd);
+        return NULL;
     }
+    int64_t weights_size = st.st_size;
+#endif
 
-    if (d.etype < 0 || d.etype > 1) {
-        vsapi->setError(out, "nnedi3: etype must be between 0 and 1 (inclusive)");
-        vsapi->freeNode(d.node);
-        return;
+    if (weights_size != weights_file_size) {
+        error = "'" + weights_path + "' has the wrong size. Expected " + std::to_string(weights_file_size) + " bytes, got " + std::to_string(weights_size) + " bytes.";
+#ifdef _WIN32
+        CloseHandle(file);
+#else
+        close(fd);
+#endif
+        return NULL;
     }
 
-    if (d.vi.format->sampleType == stInteger) {
-        if (d.pscrn < 0 || d.pscrn > 4) {
-            vsapi->setError(out, "nnedi3: pscrn must be between 0 and 4 (inclusive)");
-            vsapi->freeNode(d.node);
-            return;
-        }
-    } else {
-        if (d.pscrn < 0 || d.pscrn > 1) {
-            vsapi->setError(out, "nnedi3: pscrn must be between 0 and 1 (inclusive)");
-            vsapi->freeNode(d.node);
-            return;
-        }
+#ifdef _WIN32
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        error = "Failed to map '" + weights_path + "'. Error code: " + std::to_string(GetLastError());
+        return NULL;
     }
 
-    if (d.exp < 0 || d.exp > 2) {
-        vsapi->setError(out, "nnedi3: exp must be between 0 and 2 (inclusive)");
-        vsapi->freeNode(d.node);
-        return;
+    void *bdata = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!bdata) {
+        error = "Failed to map '" + weights_path + "'. Error code: " + std::to_string(GetLastError());
+        return NULL;
     }
-
-    // Changing the video info probably has to be done before createFilter.
-    if (d.field > 1) {
-        if (d.vi.numFrames > INT_MAX / 2) {
-            vsapi->setError(out, "nnedi3: output clip would be too long");
-            vsapi->freeNode(d.node);
-            return;
-        }
-
-        d.vi.numFrames *= 2;
-        muldivRational(&d.vi.fpsNum, &d.vi.fpsDen, 2, 1);
+#else
+    void *bdata = mmap(NULL, weights_file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bdata == MAP_FAILED) {
+        error = "Failed to map '" + weights_path + "'. Error message: " + strerror(errno);
+        return NULL;
     }
+#endif
 
-    if (d.dh)
-        d.vi.height *= 2;
-
-    d.max_value = 65535 >> (16 - d.vi.format->bitsPerSample);
-
-    if (d.vi.format->sampleType == stFloat)
-        d.int16_prescreener = 0;
+    return (const float *)bdata;
+}
 
-    // int16 dotProd can be used with up to 15 bits input
-    if (d.vi.format->bitsPerSample > 15)
-        d.int16_predictor = 0;
 
-    selectFunctions(&d);
+static void unmapWeightsFile(const float *bdata) {
+#ifdef _WIN32
+    UnmapViewOfFile(bdata);
+#else
+    munmap((void *)bdata, weights_file_size);
+#endif
+}
 
 
+// Returns NULL after setting an error message.
+static const float *loadWeightsFile(VSMap *out, VSCore *core, const VSAPI *vsapi) {
     std::string weights_name("nnedi3_weights.bin");
 
     VSPlugin *nnedi3Plugin = vsapi->getPluginById("com.deinterlace.nnedi3", core);
     std::string plugin_path(vsapi->getPluginPath(nnedi3Plugin));
     std::string weights_path(plugin_path.substr(0, plugin_path.find_last_of('/')) + "/" + weights_name);
 
-    FILE *weights_file = NULL;
-
-#ifdef _WIN32
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> utf16;
-
-    weights_file = _wfopen(utf16.from_bytes(weights_path).c_str(), L"rb");
-#else
-    weights_file = fopen(weights_path.c_str(), "rb");
-#endif
+    std::string error;
+    int open_failed;
 
+    const float *bdata = mapWeightsFile(weights_path, error, &open_failed);
 
 #if ! defined(_WIN32) && defined(NNEDI3_DATADIR)
-    if (!weights_file) {
+    if (!bdata && open_failed) {
         weights_path = std::string(NNEDI3_DATADIR) + "/" + weights_name;
-        weights_file = fopen(weights_path.c_str(), "rb");
+        bdata = mapWeightsFile(weights_path, error, &open_failed);
     }
 #endif
-    if (!weights_file) {
-        vsapi->setError(out, ("nnedi3: Couldn't open file '" + weights_path + "'. Error message: " + strerror(errno)).c_str());
-        vsapi->freeNode(d.node);
-        return;
-    }
+    if (!bdata)
+        vsapi->setError(out, ("nnedi3: " + error).c_str());
 
-    if (fseek(weights_file, 0, SEEK_END)) {
-        vsapi->setError(out, ("nnedi3: Failed to seek to the end of '" + weights_path + "'. Error message: " + strerror(errno)).c_str());
-        fclose(weights_file);
-        vsapi->freeNode(d.node);
-        return;
-    }
+    return bdata;
+}
+#endif
 
-    long expected_size = 13574928; // Version 0.9.4 of the Avisynth plugin.
-    long weights_size = ftell(weights_file);
-    if (weights_size == -1) {
-        vsapi->setError(out, ("nnedi3: Failed to determine the size of '" + weights_path + "'. Error message: " + strerror(errno)).c_str());
-        fclose(weights_file);
-        vsapi->freeNode(d.node);
-        return;
-    } else if (weights_size != expected_size) {
-        vsapi->setError(out, ("nnedi3: '" + weights_path + "' has the wrong size. Expected " + std::to_string(expected_size) + " bytes, got " + std::to_string(weights_size) + " bytes.").c_str());
-        fclose(weights_file);
-        vsapi->freeNode(d.node);
-        return;
-    }
-
-    if (fseek(weights_file, 0, SEEK_SET)) {
-        vsapi->setError(out, ("nnedi3: Failed to seek back to the beginning of '" + weights_path + "'. Error message: " + strerror(errno)).c_str());
-        fclose(weights_file);
-        vsapi->freeNode(d.node);
-        return;
-    }
-
-    float *bdata = (float *)malloc(expected_size);
-    size_t bytes_read = fread(bdata, 1, expected_size, weights_file);
-
-    if (bytes_read != (size_t)expected_size) {
-        vsapi->setError(out, ("nnedi3: Expected to read " + std::to_string(expected_size) + " bytes from '" + weights_path + "', read " + std::to_string(bytes_read) + " bytes instead.").c_str());
-        fclose(weights_file);
-        free(bdata);
-        vsapi->freeNode(d.node);
-        return;
-    }
 
-    fclose(weights_file);
+// The size of one predictor weight, in bytes.
+static int predictorWeightSize(const int int16_predictor, const int int8_predictor) {
+    if (int8_predictor)
+        return sizeof(int8_t);
+    return int16_predictor ? sizeof(int16_t) : sizeof(float);
+}
 
-    const int xdiaTable[NUM_NSIZE] = { 8, 16, 32, 48, 8, 16, 32 };
-    const int ydiaTable[NUM_NSIZE] = { 6, 6, 6, 6, 4, 4, 4 };
-    const int nnsTable[NUM_NNS] = { 16, 32, 64, 128, 256 };
 
+// The parts of nnedi3_weights.bin that prepareWeights reads for key: the
+// prescreener weights, and the predictor networks. Offsets and sizes are
+// in floats.
+static void weightsFileParts(const WeightsKey *key, int *prescreener_offset, int *prescreener_size, int *predictor_offset, int *predictor_size) {
     const int dims0 = 49 * 4 + 5 * 4 + 9 * 4;
     const int dims0new = 4 * 65 + 4 * 5;
-    const int dims1 = nnsTable[d.nnsparam] * 2 * (xdiaTable[d.nsize] * ydiaTable[d.nsize] + 1);
+    const int dims1 = nnsTable[key->nnsparam] * 2 * (xdiaTable[key->nsize] * ydiaTable[key->nsize] + 1);
     int dims1tsize = 0;
     int dims1offset = 0;
 
     for (int j = 0; j < NUM_NNS; ++j) {
         for (int i = 0; i < NUM_NSIZE; ++i) {
-            if (i == d.nsize && j == d.nnsparam)
+            if (i == key->nsize && j == key->nnsparam)
                 dims1offset = dims1tsize;
             dims1tsize += nnsTable[j] * 2 * (xdiaTable[i] * ydiaTable[i] + 1) * 2;
         }
     }
 
-    d.weights0 = vs_aligned_malloc<float>(std::max(dims0, dims0new) * sizeof(float), 16);
+    if (key->pscrn >= 2) {
+        *prescreener_offset = dims0 + dims0new * (key->pscrn - 2);
+        *prescreener_size = dims0new;
+    } else {
+        *prescreener_offset = 0;
+        *prescreener_size = dims0;
+    }
+
+    *predictor_offset = dims0 + dims0new * 3 + dims1tsize * key->etype + dims1offset;
+    *predictor_size = dims1 * key->qual;
+}
+
+
+static PreparedWeights *prepareWeights(const float *bdata, const WeightsKey *key) {
+    PreparedWeights *w = (PreparedWeights *)malloc(sizeof(PreparedWeights));
+    w->key = *key;
+    w->refcount = 0;
+    w->next = NULL;
+
+    const int dims0 = 49 * 4 + 5 * 4 + 9 * 4;
+    const int dims0new = 4 * 65 + 4 * 5;
+    const int dims1 = nnsTable[key->nnsparam] * 2 * (xdiaTable[key->nsize] * ydiaTable[key->nsize] + 1);
+
+    int prescreener_offset, prescreener_size, predictor_offset, predictor_size;
+    weightsFileParts(key, &prescreener_offset, &prescreener_size, &predictor_offset, &predictor_size);
+
+    w->weights0_size = std::max(dims0, dims0new) * sizeof(float);
+    w->weights1_size = dims1 * key->qual * sizeof(float);
 
-    for (int i = 0; i < 2; ++i)
-        d.weights1[i] = vs_aligned_malloc<float>(dims1 * sizeof(float), 16);
+    w->weights0 = vs_aligned_malloc<float>(w->weights0_size, 16);
+
+    w->weights1 = vs_aligned_malloc<float>(w->weights1_size, 64);
+    memset(w->weights1, 0, w->weights1_size);
 
 
     // Adjust prescreener weights
-    if (d.pscrn >= 2) {// using new prescreener
+    if (key->pscrn >= 2) {// using new prescreener
         int *offt = (int *)calloc(4 * 64, sizeof(int));
         for (int j = 0; j < 4; ++j)
             for (int k = 0; k < 64; ++k)
                 offt[j * 64 + k] = ((k >> 3) << 5) + ((j & 3) << 3) + (k & 7);
-        const float *bdw = bdata + dims0 + dims0new * (d.pscrn - 2);
-        int16_t *ws = (int16_t *)d.weights0;
+        const float *bdw = bdata + prescreener_offset;
+        int16_t *ws = (int16_t *)w->weights0;
         float *wf = (float *)&ws[4 * 64];
         double mean[4] = { 0.0, 0.0, 0.0, 0.0 };
         // Calculate mean weight of each first layer neuron
@@ -1436,7 +1986,8 @@ static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCo
         }
 
         // 16 bit pixels will be shifted by 1 for the prescreener.
-        const int prescreener_bits = std::min(d.vi.format->bitsPerSample, 15);
+        // Float pixels will be scaled to 15 bits.
+        const int prescreener_bits = std::min(key->bits_per_sample, 15);
         const double half = ((1 << prescreener_bits) - 1) / 2.0;
 
         // Factor mean removal and 1.0/half scaling
@@ -1461,12 +2012,12 @@ static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCo
                 cmean += bdata[j * 48 + k];
             mean[j] = cmean / 48.0;
         }
-        if (d.int16_prescreener) {// use int16 dot products in first layer
-            int16_t *ws = (int16_t *)d.weights0;
+        if (key->int16_prescreener) {// use int16 dot products in first layer
+            int16_t *ws = (int16_t *)w->weights0;
             float *wf = (float *)&ws[4 * 48];
 
             // 16 bit pixels will be shifted by 1 for the prescreener.
-            const int prescreener_bits = std::min(d.vi.format->bitsPerSample, 15);
+            const int prescreener_bits = std::min(key->bits_per_sample, 15);
             const double half = ((1 << prescreener_bits) - 1) / 2.0;
 
             // Factor mean removal and 1.0/half scaling
@@ -1481,9 +2032,9 @@ static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCo
                 wf[j] = (float)(mval / 32767.0);
             }
             memcpy(wf + 4, bdata + 4 * 48, (dims0 - 4 * 48) * sizeof(float));
-            if (d.opt) {// shuffle weight order for asm
+            if (key->opt) {// shuffle weight order for asm
                 int16_t *rs = (int16_t *)malloc(dims0 * sizeof(float));
-                memcpy(rs, d.weights0, dims0 * sizeof(float));
+                memcpy(rs, w->weights0, dims0 * sizeof(float));
                 for (int j = 0; j < 4; ++j)
                     for (int k = 0; k < 48; ++k)
                         ws[(k >> 3) * 32 + j * 8 + (k & 7)] = rs[j * 48 + k];
@@ -1491,8 +2042,8 @@ static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCo
                 free(rs);
             }
         } else {// use float dot products in first layer
-            double half = (1 << d.vi.format->bitsPerSample) - 1;
-            if (d.vi.format->sampleType == stFloat)
+            double half = (1 << key->bits_per_sample) - 1;
+            if (key->sample_type == stFloat)
                 half = 1.0;
             half /= 2;
 
@@ -1500,12 +2051,12 @@ static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCo
             // into first layer weights.
             for (int j = 0; j < 4; ++j)
                 for (int k = 0; k < 48; ++k)
-                    d.weights0[j * 48 + k] = (float)((bdata[j * 48 + k] - mean[j]) / half);
-            memcpy(d.weights0 + 4 * 48, bdata + 4 * 48, (dims0 - 4 * 48) * sizeof(float));
-            if (d.opt) {// shuffle weight order for asm
-                float *wf = d.weights0;
+                    w->weights0[j * 48 + k] = (float)((bdata[j * 48 + k] - mean[j]) / half);
+            memcpy(w->weights0 + 4 * 48, bdata + 4 * 48, (dims0 - 4 * 48) * sizeof(float));
+            if (key->opt) {// shuffle weight order for asm
+                float *wf = w->weights0;
                 float *rf = (float *)malloc(dims0 * sizeof(float));
-                memcpy(rf, d.weights0, dims0 * sizeof(float));
+                memcpy(rf, w->weights0, dims0 * sizeof(float));
                 for (int j = 0; j < 4; ++j)
                     for (int k = 0; k < 48; ++k)
                         wf[(k >> 2) * 16 + j * 4 + (k & 3)] = rf[j * 48 + k];
@@ -1516,10 +2067,19 @@ static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCo
     }
 
     // Adjust prediction weights
-    for (int i = 0; i < 2; ++i) {
-        const float *bdataT = bdata + dims0 + dims0new * 3 + dims1tsize * d.etype + dims1offset + i * dims1;
-        const int nnst = nnsTable[d.nnsparam];
-        const int asize = xdiaTable[d.nsize] * ydiaTable[d.nsize];
+    const int nnst = nnsTable[key->nnsparam];
+    const int asize = xdiaTable[key->nsize] * ydiaTable[key->nsize];
+
+    // With qual=2 the two networks are stored as a single network with
+    // twice as many neurons, so that dotProd evaluates both in one pass.
+    // Each network is prepared on its own in net first.
+    const int weight_size = predictorWeightSize(key->int16_predictor, key->int8_predictor);
+    const size_t net_weights_size = nnst * 2 * asize * weight_size;
+    const size_t net_tail_size = nnst * 2 * (weight_size < (int)sizeof(float) ? 2 : 1) * sizeof(float);
+    float *net = vs_aligned_malloc<float>(dims1 * sizeof(float), 64);
+
+    for (int i = 0; i < key->qual; ++i) {
+        const float *bdataT = bdata + predictor_offset + i * dims1;
         const int boff = nnst * 2 * asize;
         double *mean = (double *)calloc(asize + 1 + nnst * 2, sizeof(double));
         // Calculate mean weight of each neuron (ignore bias)
@@ -1538,64 +2098,742 @@ static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCo
         for (int j = 0; j < asize + 1; ++j)
             mean[j] /= (double)(nnst);
 
-        if (d.int16_predictor) {// use int16 dot products
-            int16_t *ws = (int16_t *)d.weights1[i];
-            float *wf = (float *)&ws[nnst * 2 * asize];
+        if (key->int8_predictor || key->int16_predictor) {// use integer dot products
+            // The largest weight of each neuron becomes 127 or 32767.
+            const double range = key->int8_predictor ? 127.0 : 32767.0;
+            int16_t *ws = (int16_t *)malloc(nnst * 2 * asize * sizeof(int16_t));
+            float *wf = (float *)((uint8_t *)net + net_weights_size);
             // Factor mean removal into weights, remove global offset from
-            // softmax neurons, and scale weights to int16 range.
+            // softmax neurons, and scale weights to the integer range.
             for (int j = 0; j < nnst; ++j) {// softmax neurons
                 double mval = 0.0;
                 for (int k = 0; k < asize; ++k)
                     mval = std::max(mval, std::fabs(bdataT[j * asize + k] - mean[asize + 1 + j] - mean[k]));
-                const double scale = 32767.0 / mval;
+                const double scale = range / mval;
                 for (int k = 0; k < asize; ++k)
                     ws[j * asize + k] = roundds((bdataT[j * asize + k] - mean[asize + 1 + j] - mean[k]) * scale);
-                wf[(j >> 2) * 8 + (j & 3)] = (float)(mval / 32767.0);
+                wf[(j >> 2) * 8 + (j & 3)] = (float)(mval / range);
                 wf[(j >> 2) * 8 + (j & 3) + 4] = (float)(bdataT[boff + j] - mean[asize]);
             }
             for (int j = nnst; j < nnst * 2; ++j) {// elliott neurons
                 double mval = 0.0;
                 for (int k = 0; k < asize; ++k)
                     mval = std::max(mval, std::fabs(bdataT[j * asize + k] - mean[asize + 1 + j]));
-                const double scale = 32767.0 / mval;
+                const double scale = range / mval;
                 for (int k = 0; k < asize; ++k)
                     ws[j * asize + k] = roundds((bdataT[j * asize + k] - mean[asize + 1 + j]) * scale);
-                wf[(j >> 2) * 8 + (j & 3)] = (float)(mval / 32767.0);
+                wf[(j >> 2) * 8 + (j & 3)] = (float)(mval / range);
                 wf[(j >> 2) * 8 + (j & 3) + 4] = bdataT[boff + j];
             }
-            if (d.opt) {// shuffle weight order for asm
-                int16_t *rs = (int16_t *)malloc(nnst * 2 * asize * sizeof(int16_t));
-                memcpy(rs, ws, nnst * 2 * asize * sizeof(int16_t));
-                for (int j = 0; j < nnst * 2; ++j)
-                    for (int k = 0; k < asize; ++k)
-                        ws[(j >> 2) * asize * 4 + (k >> 3) * 32 + (j & 3) * 8 + (k & 7)] = rs[j * asize + k];
-                free(rs);
+            // Store the weights with their final size, in the order the
+            // dotProd functions expect. The int8 functions with opt use the
+            // AVX2 order.
+            for (int j = 0; j < nnst * 2; ++j) {
+                for (int k = 0; k < asize; ++k) {
+                    int pos = j * asize + k;
+                    if (key->opt && key->dotProd_avx2) // shuffle weight order for AVX2/AVX-512
+                        pos = avx2IntWeightPos(j, k, asize);
+                    else if (key->opt) // shuffle weight order for asm
+                        pos = (j >> 2) * asize * 4 + (k >> 3) * 32 + (j & 3) * 8 + (k & 7);
+
+                    if (key->int8_predictor)
+                        ((int8_t *)net)[pos] = (int8_t)ws[j * asize + k];
+                    else
+                        ((int16_t *)net)[pos] = ws[j * asize + k];
+                }
             }
+            free(ws);
         } else {// use float dot products
             // Factor mean removal into weights, and remove global
             // offset from softmax neurons.
             for (int j = 0; j < nnst * 2; ++j) {
                 for (int k = 0; k < asize; ++k) {
                     const double q = j < nnst ? mean[k] : 0.0;
-                    if (d.opt) // shuffle weight order for asm
-                        d.weights1[i][(j >> 2) * asize * 4 + (k >> 2) * 16 + (j & 3) * 4 + (k & 3)] =
+                    if (key->opt && key->dotProd_avx2) // shuffle weight order for AVX2/AVX-512
+                        net[avx2WeightPos(j, k, asize)] =
+                            (float)(bdataT[j * asize + k] - mean[asize + 1 + j] - q);
+                    else if (key->opt) // shuffle weight order for asm
+                        net[(j >> 2) * asize * 4 + (k >> 2) * 16 + (j & 3) * 4 + (k & 3)] =
                             (float)(bdataT[j * asize + k] - mean[asize + 1 + j] - q);
                     else
-                        d.weights1[i][j * asize + k] = (float)(bdataT[j * asize + k] - mean[asize + 1 + j] - q);
+                        net[j * asize + k] = (float)(bdataT[j * asize + k] - mean[asize + 1 + j] - q);
                 }
-                d.weights1[i][boff + j] = (float)(bdataT[boff + j] - (j < nnst ? mean[asize] : 0.0));
+                net[boff + j] = (float)(bdataT[boff + j] - (j < nnst ? mean[asize] : 0.0));
             }
         }
         free(mean);
+
+        // The weights of all the networks come first, then their scales and biases.
+        // Neurons are stored in groups of 4, so this is the same as one network
+        // with the neurons of each network in turn.
+        memcpy((uint8_t *)w->weights1 + i * net_weights_size, net, net_weights_size);
+        memcpy((uint8_t *)w->weights1 + key->qual * net_weights_size + i * net_tail_size, (uint8_t *)net + net_weights_size, net_tail_size);
+    }
+
+    vs_aligned_free(net);
+
+    const int neurons = nnst * 2 * key->qual;
+    const int block_neurons = predictorBlockNeurons(nnst * key->qual, asize, weight_size);
+    if (block_neurons < neurons) {
+        // Move the scales and biases of each block right after its weights.
+        // Neurons are stored in groups of 4, so the weights of a block are contiguous.
+        const size_t block_weights_size = block_neurons * asize * weight_size;
+        const size_t block_tail_size = block_neurons * (weight_size < (int)sizeof(float) ? 2 : 1) * sizeof(float);
+        uint8_t *rw = (uint8_t *)malloc(w->weights1_size);
+        memcpy(rw, w->weights1, w->weights1_size);
+        const uint8_t *rt = rw + (neurons / block_neurons) * block_weights_size;
+        uint8_t *bw = (uint8_t *)w->weights1;
+        for (int j = 0; j < neurons / block_neurons; ++j) {
+            memcpy(bw, rw + j * block_weights_size, block_weights_size);
+            memcpy(bw + block_weights_size, rt + j * block_tail_size, block_tail_size);
+            bw += block_weights_size + block_tail_size;
+        }
+        free(rw);
+    }
+
+    return w;
+}
+
+
+static void freePreparedWeights(PreparedWeights *w) {
+    vs_aligned_free(w->weights0);
+    vs_aligned_free(w->weights1);
+
+    free(w);
+}
+
+
+// The on-disk cache of prepared weights.
+//
+// Each file holds one set of prepared weights: a WeightsCacheHeader followed
+// by weights0 and weights1. The key includes opt and the
+// AVX2 weight layout, so files written on one CPU are never used with the
+// wrong layout on another. The header also identifies the copy of
+// nnedi3_weights.bin the weights were prepared from, so that replacing the
+// file, or switching between the embedded and the external copy, doesn't
+// bring back weights prepared from the old one. Bump WEIGHTS_CACHE_VERSION
+// whenever prepareWeights or the layout of the weights changes.
+
+#define WEIGHTS_CACHE_VERSION 5
+
+
+// Identifies the source of the prepared weights.
+typedef struct {
+    uint64_t size; // of nnedi3_weights.bin
+    uint64_t checksum; // of the parts of it that prepareWeights reads
+} WeightsSource;
+
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    WeightsKey key;
+    WeightsSource source;
+    uint64_t weights0_size;
+    uint64_t weights1_size;
+    uint64_t checksum;
+} WeightsCacheHeader;
+
+
+static const char weights_cache_magic[8] = { 'N', 'N', 'E', 'D', 'I', '3', 'W', 'C' };
+
+
+// FNV-1a
+static uint64_t checksum(const void *data, size_t size, uint64_t hash) {
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+
+    return hash;
+}
+
+
+static uint64_t checksumWeights(const PreparedWeights *w) {
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    hash = checksum(w->weights0, w->weights0_size, hash);
+    hash = checksum(w->weights1, w->weights1_size, hash);
+
+    return hash;
+}
+
+
+static WeightsSource weightsSource(const float *bdata, const WeightsKey *key) {
+    int prescreener_offset, prescreener_size, predictor_offset, predictor_size;
+    weightsFileParts(key, &prescreener_offset, &prescreener_size, &predictor_offset, &predictor_size);
+
+    WeightsSource source;
+    source.size = weights_file_size;
+    source.checksum = UINT64_C(0xcbf29ce484222325);
+    source.checksum = checksum(bdata + prescreener_offset, prescreener_size * sizeof(float), source.checksum);
+    source.checksum = checksum(bdata + predictor_offset, predictor_size * sizeof(float), source.checksum);
+
+    return source;
+}
+
+
+static FILE *openFile(const std::string &path, const char *mode) {
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> utf16;
+
+    return _wfopen(utf16.from_bytes(path).c_str(), utf16.from_bytes(mode).c_str());
+#else
+    return fopen(path.c_str(), mode);
+#endif
+}
+
+
+// Creates the directory and any missing parents. Failures are ignored.
+static void makeDirectory(const std::string &path) {
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> utf16;
+    const char *separators = "/\\";
+#else
+    const char *separators = "/";
+#endif
+
+    size_t pos = 0;
+    do {
+        pos = path.find_first_of(separators, pos + 1);
+
+#ifdef _WIN32
+        _wmkdir(utf16.from_bytes(path.substr(0, pos)).c_str());
+#else
+        mkdir(path.substr(0, pos).c_str(), 0755);
+#endif
+    } while (pos != std::string::npos);
+}
+
+
+// Returns an empty string if there is nowhere to put the cache.
+static std::string weightsCacheDirectory() {
+    std::string dir;
+
+#ifdef _WIN32
+    const wchar_t *local_app_data = _wgetenv(L"LOCALAPPDATA");
+    if (!local_app_data || !local_app_data[0])
+        return dir;
+
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> utf16;
+
+    dir = utf16.to_bytes(local_app_data) + "/nnedi3";
+#else
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (xdg_cache_home && xdg_cache_home[0] == '/') {
+        dir = xdg_cache_home;
+    } else if (home && home[0]) {
+        dir = std::string(home) + "/.cache";
+    } else {
+        return dir;
+    }
+
+    dir += "/nnedi3";
+#endif
+
+    makeDirectory(dir);
+
+    return dir;
+}
+
+
+static std::string weightsCachePath(const std::string &dir, const WeightsKey *key, const WeightsSource *source) {
+    char name[128];
+
+    snprintf(name, sizeof(name), "weights-v%d-n%d-%d-e%d-p%d-b%d%c-i%d%d%d-q%d-o%d%d-s%08x.bin",
+             WEIGHTS_CACHE_VERSION,
+             key->nsize, key->nnsparam, key->etype, key->pscrn,
+             key->bits_per_sample, key->sample_type == stFloat ? 'f' : 'i',
+             key->int16_prescreener, key->int16_predictor, key->int8_predictor,
+             key->qual, key->opt, key->dotProd_avx2,
+             (unsigned)(source->checksum & 0xffffffff));
+
+    return dir + "/" + name;
+}
+
+
+// Returns NULL if the file doesn't exist or doesn't match key and source.
+static PreparedWeights *readWeightsCache(const WeightsKey *key, const WeightsSource *source) {
+    std::string dir = weightsCacheDirectory();
+    if (dir.empty())
+        return NULL;
+
+    FILE *file = openFile(weightsCachePath(dir, key, source), "rb");
+    if (!file)
+        return NULL;
+
+    WeightsCacheHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, weights_cache_magic, sizeof(header.magic)) ||
+        header.version != WEIGHTS_CACHE_VERSION ||
+        header.header_size != sizeof(header) ||
+        memcmp(&header.key, key, sizeof(WeightsKey)) ||
+        header.source.size != source->size ||
+        header.source.checksum != source->checksum ||
+        header.weights0_size == 0 || header.weights0_size > (1 << 20) ||
+        header.weights1_size == 0 || header.weights1_size > (1 << 24)) {
+        fclose(file);
+        return NULL;
+    }
+
+    PreparedWeights *w = (PreparedWeights *)malloc(sizeof(PreparedWeights));
+    w->key = *key;
+    w->refcount = 0;
+    w->next = NULL;
+    w->weights0_size = header.weights0_size;
+    w->weights1_size = header.weights1_size;
+
+    w->weights0 = vs_aligned_malloc<float>(w->weights0_size, 16);
+    w->weights1 = vs_aligned_malloc<float>(w->weights1_size, 64);
+
+    bool ok = fread(w->weights0, w->weights0_size, 1, file) == 1 &&
+              fread(w->weights1, w->weights1_size, 1, file) == 1 &&
+              checksumWeights(w) == header.checksum;
+
+    fclose(file);
+
+    if (!ok) {
+        freePreparedWeights(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+
+// Failures are ignored. The weights will simply be prepared again next time.
+static void writeWeightsCache(const PreparedWeights *w, const WeightsSource *source) {
+    std::string dir = weightsCacheDirectory();
+    if (dir.empty())
+        return;
+
+    std::string path = weightsCachePath(dir, &w->key, source);
+
+    // Write to a temporary file first, so that other processes
+    // never see a partially written file.
+#ifdef _WIN32
+    std::string temp_path = path + "." + std::to_string(GetCurrentProcessId()) + ".tmp";
+#else
+    std::string temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+#endif
+
+    FILE *file = openFile(temp_path, "wb");
+    if (!file)
+        return;
+
+    WeightsCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, weights_cache_magic, sizeof(header.magic));
+    header.version = WEIGHTS_CACHE_VERSION;
+    header.header_size = sizeof(header);
+    header.key = w->key;
+    header.source = *source;
+    header.weights0_size = w->weights0_size;
+    header.weights1_size = w->weights1_size;
+    header.checksum = checksumWeights(w);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(w->weights0, w->weights0_size, 1, file) == 1 &&
+              fwrite(w->weights1, w->weights1_size, 1, file) == 1;
+
+    ok = !fclose(file) && ok;
+
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> utf16;
+
+    if (!ok || !MoveFileExW(utf16.from_bytes(temp_path).c_str(), utf16.from_bytes(path).c_str(), MOVEFILE_REPLACE_EXISTING))
+        _wremove(utf16.from_bytes(temp_path).c_str());
+#else
+    if (!ok || rename(temp_path.c_str(), path.c_str()))
+        remove(temp_path.c_str());
+#endif
+}
+
+
+// Returns NULL after setting an error message.
+static PreparedWeights *acquireWeights(const WeightsKey *key, int use_disk_cache, VSMap *out, VSCore *core, const VSAPI *vsapi) {
+    std::lock_guard<std::mutex> guard(weights_cache_lock);
+
+    PreparedWeights *w;
+    for (w = weights_cache; w; w = w->next)
+        if (!memcmp(&w->key, key, sizeof(WeightsKey)))
+            break;
+
+    if (!w) {
+        // The disk cache is checked against the weights file, so it is
+        // needed either way. Only the parts that are used get read.
+        const float *bdata = loadWeightsFile(out, core, vsapi);
+        if (!bdata)
+            return NULL;
+
+        WeightsSource source;
+        if (use_disk_cache) {
+            source = weightsSource(bdata, key);
+            w = readWeightsCache(key, &source);
+        }
+
+        if (!w) {
+            w = prepareWeights(bdata, key);
+
+            if (use_disk_cache)
+                writeWeightsCache(w, &source);
+        }
+
+        unmapWeightsFile(bdata);
+
+        w->next = weights_cache;
+        weights_cache = w;
     }
 
+    w->refcount++;
+
+    return w;
+}
+
+
+static void releaseWeights(PreparedWeights *w) {
+    std::lock_guard<std::mutex> guard(weights_cache_lock);
+
+    if (--w->refcount)
+        return;
+
+    PreparedWeights **prev = &weights_cache;
+    while (*prev != w)
+        prev = &(*prev)->next;
+    *prev = w->next;
+
+    freePreparedWeights(w);
+}
+
+
+// With jit, replaces the AVX2 new prescreener and dotProd functions with code
+// generated for these parameters. tests/jit_x86.cpp compares the generated
+// code with the C functions.
+static void setupJit(nnedi3Data *d) {
+#ifdef NNEDI3_JIT
+    d->jit_prescreener = NULL;
+    d->jit_dotProd = NULL;
+
+    if (!d->jit)
+        return;
+
+    if (d->computeNetwork0 == nnedi3_computeNetwork0new_AVX2) {
+        d->jit_prescreener = jitComputeNetwork0new_AVX2(d->weights0);
+        if (d->jit_prescreener)
+            d->computeNetwork0 = (decltype(d->computeNetwork0))jitFunction(d->jit_prescreener);
+    }
+
+    int int16 = -1;
+    if (d->dotProd == nnedi3_dotProd_AVX2_nsize[d->nsize])
+        int16 = 0;
+    else if (d->dotProd == nnedi3_dotProd_i16_AVX2_nsize[d->nsize])
+        int16 = 1;
+
+    if (int16 >= 0) {
+        d->jit_dotProd = jitDotProd_AVX2(int16, d->block_neurons, d->asize, d->nns * 2 * d->qual);
+        if (d->jit_dotProd)
+            d->dotProd = (nnedi3DotProdFunc)jitFunction(d->jit_dotProd);
+    }
+#endif
+}
+
+
+static void VS_CC nnedi3Free(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    nnedi3Data *d = (nnedi3Data *)instanceData;
+    vsapi->freeNode(d->node);
+
+    threadPoolFree(d->pool);
+
+    while (d->frame_pool->free_frames) {
+        FrameData *frameData = d->frame_pool->free_frames;
+        d->frame_pool->free_frames = frameData->next;
+        freeFrameData(frameData);
+    }
+    delete d->frame_pool;
+
+    if (d->worker_scratch) {
+        for (int i = 0; i < d->threads - 1; i++)
+            freeScratch(&d->worker_scratch[i]);
+        free(d->worker_scratch);
+    }
+
+    releaseWeights(d->weights);
+
+#ifdef NNEDI3_JIT
+    jitFree(d->jit_prescreener);
+    jitFree(d->jit_dotProd);
+#endif
+
+    free(d);
+}
+
+
+static void VS_CC nnedi3Create(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    nnedi3Data d;
+    nnedi3Data *data;
+    int err;
+
+    // Get a clip reference from the input arguments. This must be freed later.
+    d.node = vsapi->propGetNode(in, "clip", 0, 0);
+    d.vi = *vsapi->getVideoInfo(d.node);
+
+    if (!d.vi.format ||
+        (d.vi.format->sampleType == stInteger && d.vi.format->bitsPerSample > 16) ||
+        (d.vi.format->sampleType == stFloat && d.vi.format->bitsPerSample != 32)) {
+        vsapi->setError(out, "nnedi3: only constant format 8..16 bit integer or 32 bit float input supported");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    // Get the parameters.
+    d.field = int64ToIntS(vsapi->propGetInt(in, "field", 0, 0));
+
+    // Defaults to 0.
+    d.dh = int64ToIntS(vsapi->propGetInt(in, "dh", 0, &err));
+
+    int n = d.vi.format->numPlanes;
+    int m = vsapi->propNumElements(in, "planes");
+
+    for (int i = 0; i < 3; i++)
+        d.process[i] = (m <= 0);
+
+    for (int i = 0; i < m; i++) {
+        int o = int64ToIntS(vsapi->propGetInt(in, "planes", i, 0));
+
+        if (o < 0 || o >= n) {
+            vsapi->setError(out, "nnedi3: plane index out of range");
+            vsapi->freeNode(d.node);
+            return;
+        }
+
+        if (d.process[o]) {
+            vsapi->setError(out, "nnedi3: plane specified twice");
+            vsapi->freeNode(d.node);
+            return;
+        }
+
+        d.process[o] = 1;
+    }
+
+    d.nsize = int64ToIntS(vsapi->propGetInt(in, "nsize", 0, &err));
+    if (err)
+        d.nsize = 6;
+
+    d.nnsparam = int64ToIntS(vsapi->propGetInt(in, "nns", 0, &err));
+    if (err)
+        d.nnsparam = 1;
+
+    d.qual = int64ToIntS(vsapi->propGetInt(in, "qual", 0, &err));
+    if (err)
+        d.qual = 1;
+
+    d.etype = int64ToIntS(vsapi->propGetInt(in, "etype", 0, &err));
+
+    d.pscrn = int64ToIntS(vsapi->propGetInt(in, "pscrn", 0, &err));
+    if (err) {
+        if (d.vi.format->sampleType == stInteger)
+            d.pscrn = 2;
+        else
+            d.pscrn = 1;
+    }
+
+    d.opt = !!vsapi->propGetInt(in, "opt", 0, &err);
+#if defined(NNEDI3_X86) || defined(NNEDI3_ARM)
+    if (err)
+        d.opt = 1;
+#else
+    d.opt = 0;
+#endif
+
+    d.int16_prescreener = !!vsapi->propGetInt(in, "int16_prescreener", 0, &err);
+    if (err)
+        d.int16_prescreener = 1;
+
+    d.int16_predictor = !!vsapi->propGetInt(in, "int16_predictor", 0, &err);
+    if (err)
+        d.int16_predictor = 1;
+
+    d.int8_predictor = !!vsapi->propGetInt(in, "int8_predictor", 0, &err);
+
+    d.exp = int64ToIntS(vsapi->propGetInt(in, "exp", 0, &err));
+
+    d.show_mask = !!vsapi->propGetInt(in, "show_mask", 0, &err);
+
+    d.threads = int64ToIntS(vsapi->propGetInt(in, "threads", 0, &err));
+    if (err)
+        d.threads = 1;
+
+    d.weights_cache = !!vsapi->propGetInt(in, "weights_cache", 0, &err);
+
+    d.jit = !!vsapi->propGetInt(in, "jit", 0, &err);
+
+    // Check the values.
+    if (d.field < 0 || d.field > 3) {
+        vsapi->setError(out, "nnedi3: field must be between 0 and 3 (inclusive)");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.dh = !!d.dh; // Just consider any nonzero value true.
+
+    if (d.dh && d.field > 1) {
+        vsapi->setError(out, "nnedi3: field must be 0 or 1 when dh is true");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.nsize < 0 || d.nsize >= NUM_NSIZE) {
+        vsapi->setError(out, "nnedi3: nsize must be between 0 and 6 (inclusive)");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.nnsparam < 0 || d.nnsparam >= NUM_NNS) {
+        vsapi->setError(out, "nnedi3: nns must be between 0 and 4 (inclusive)");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.qual < 1 || d.qual > 2) {
+        vsapi->setError(out, "nnedi3: qual must be between 1 and 2 (inclusive)");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.etype < 0 || d.etype > 1) {
+        vsapi->setError(out, "nnedi3: etype must be between 0 and 1 (inclusive)");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.pscrn < 0 || d.pscrn > 4) {
+        vsapi->setError(out, "nnedi3: pscrn must be between 0 and 4 (inclusive)");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.exp < 0 || d.exp > 2) {
+        vsapi->setError(out, "nnedi3: exp must be between 0 and 2 (inclusive)");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    if (d.threads < 0) {
+        vsapi->setError(out, "nnedi3: threads must not be negative");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    // hardware_concurrency returns 0 when it doesn't know.
+    const int processors = (int)std::thread::hardware_concurrency();
+    if (d.threads == 0)
+        d.threads = std::max(processors, 1);
+    else if (processors > 0)
+        d.threads = std::min(d.threads, processors);
+
+    // Changing the video info probably has to be done before createFilter.
+    if (d.field > 1) {
+        if (d.vi.numFrames > INT_MAX / 2) {
+            vsapi->setError(out, "nnedi3: output clip would be too long");
+            vsapi->freeNode(d.node);
+            return;
+        }
+
+        d.vi.numFrames *= 2;
+        muldivRational(&d.vi.fpsNum, &d.vi.fpsDen, 2, 1);
+    }
+
+    if (d.dh)
+        d.vi.height *= 2;
+
+    d.max_value = 65535 >> (16 - d.vi.format->bitsPerSample);
+
+    if (d.vi.format->sampleType == stFloat)
+        d.int16_prescreener = 0;
+
+    // int16 dotProd can be used with integer input. With more than 12 bits,
+    // the pixels are shifted right as needed first.
+    if (d.vi.format->sampleType == stFloat)
+        d.int16_predictor = 0;
+
+    // int8 dotProd only with 8 bit input
+    if (d.vi.format->sampleType != stInteger || d.vi.format->bitsPerSample != 8)
+        d.int8_predictor = 0;
+
+    selectFunctions(&d);
+
+
+    WeightsKey key;
+    memset(&key, 0, sizeof(key));
+    key.nsize = d.nsize;
+    key.nnsparam = d.nnsparam;
+    key.etype = d.etype;
+    key.pscrn = d.pscrn;
+    key.bits_per_sample = d.vi.format->bitsPerSample;
+    key.sample_type = d.vi.format->sampleType;
+    key.int16_prescreener = d.int16_prescreener;
+    key.int16_predictor = d.int16_predictor;
+    key.int8_predictor = d.int8_predictor;
+    key.qual = d.qual;
+    key.opt = d.opt;
+    key.dotProd_avx2 = d.dotProd_avx2;
+
+    d.weights = acquireWeights(&key, d.weights_cache, out, core, vsapi);
+    if (!d.weights) {
+        vsapi->freeNode(d.node);
+        return;
+    }
+    d.weights0 = d.weights->weights0;
+    d.weights1 = d.weights->weights1;
+
     d.nns = nnsTable[d.nnsparam];
     d.xdia = xdiaTable[d.nsize];
     d.ydia = ydiaTable[d.nsize];
     d.asize = xdiaTable[d.nsize] * ydiaTable[d.nsize];
+    const int weight_size = predictorWeightSize(d.int16_predictor, d.int8_predictor);
+    d.block_neurons = predictorBlockNeurons(d.nns * d.qual, d.asize, weight_size);
+    d.block_stride = predictorBlockStride(d.block_neurons, d.asize, weight_size);
+
+
+    d.bands = 1;
+    d.pool = NULL;
+    d.worker_scratch = NULL;
+
+    // Every band should get at least one of the rows interpolated in the
+    // smallest plane.
+    const int rows = std::max((d.vi.height >> d.vi.format->subSamplingH) / 2, 1);
+    d.threads = std::min(d.threads, rows);
+
+    if (d.threads > 1) {
+        // More bands than threads, because some bands need the predictor
+        // for many more pixels than others.
+        d.bands = std::min(d.threads * 4, rows);
+
+        d.worker_scratch = (ScratchData *)calloc(d.threads - 1, sizeof(ScratchData));
+        for (int i = 0; i < d.threads - 1; i++)
+            allocScratch(&d.worker_scratch[i], &d.vi);
+
+        d.pool = threadPoolCreate(d.threads - 1);
+        if (!d.pool) {
+            vsapi->setError(out, "nnedi3: failed to start the worker threads");
+            for (int i = 0; i < d.threads - 1; i++)
+                freeScratch(&d.worker_scratch[i]);
+            free(d.worker_scratch);
+            vsapi->freeNode(d.node);
+            releaseWeights(d.weights);
+            return;
+        }
+    }
 
-    free(bdata);
+    setupJit(&d);
 
+    d.frame_pool = new FrameDataPool;
+    d.frame_pool->free_frames = NULL;
 
     data = (nnedi3Data *)malloc(sizeof(d));
     *data = d;
@@ -1619,8 +2857,12 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
             "opt:int:opt;"
             "int16_prescreener:int:opt;"
             "int16_predictor:int:opt;"
+            "int8_predictor:int:opt;"
             "exp:int:opt;"
             "show_mask:int:opt;"
+            "threads:int:opt;"
+            "weights_cache:int:opt;"
+            "jit:int:opt;"
             , nnedi3Create, 0, plugin);
 }
 
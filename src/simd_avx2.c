@@ -0,0 +1,349 @@
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "simd_dotprod.h"
+
+
+// The AVX2 functions expect the weights shuffled differently than
+// the SSE2 functions. See nnedi3Create.
+//
+// The dotProd functions process eight neurons (two groups of four) per
+// iteration of the outer loop, so n must be a multiple of 8, and
+// len must be a multiple of 8 (float) or 16 (int16, int8).
+
+
+static inline __attribute__((always_inline)) void dotProd_AVX2(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    __m256 scale = _mm256_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 8) {
+        const float *w0 = weights + i * len;
+        const float *w1 = w0 + len * 4;
+
+        __m256 m0, m1, m2, m3, m4, m5, m6, m7;
+        m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = _mm256_setzero_ps();
+
+        for (int j = 0; j < len; j += 8) {
+            __m256 m8 = _mm256_load_ps(data + j);
+
+            m0 = _mm256_fmadd_ps(m8, _mm256_load_ps(w0), m0);
+            m1 = _mm256_fmadd_ps(m8, _mm256_load_ps(w0 + 8), m1);
+            m2 = _mm256_fmadd_ps(m8, _mm256_load_ps(w0 + 16), m2);
+            m3 = _mm256_fmadd_ps(m8, _mm256_load_ps(w0 + 24), m3);
+
+            m4 = _mm256_fmadd_ps(m8, _mm256_load_ps(w1), m4);
+            m5 = _mm256_fmadd_ps(m8, _mm256_load_ps(w1 + 8), m5);
+            m6 = _mm256_fmadd_ps(m8, _mm256_load_ps(w1 + 16), m6);
+            m7 = _mm256_fmadd_ps(m8, _mm256_load_ps(w1 + 24), m7);
+
+            w0 += 32;
+            w1 += 32;
+        }
+
+        // Each lane now holds the partial sums of neurons i..i+3 and i+4..i+7.
+        m0 = _mm256_hadd_ps(_mm256_hadd_ps(m0, m1), _mm256_hadd_ps(m2, m3));
+        m4 = _mm256_hadd_ps(_mm256_hadd_ps(m4, m5), _mm256_hadd_ps(m6, m7));
+
+        __m256 sum = _mm256_add_ps(_mm256_permute2f128_ps(m0, m4, 0x20),
+                                   _mm256_permute2f128_ps(m0, m4, 0x31));
+
+        sum = _mm256_fmadd_ps(sum, scale, _mm256_loadu_ps(weights + n * len + i));
+        _mm256_storeu_ps(vals + i, sum);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_AVX2_nsize, dotProd_AVX2, );
+
+
+static inline __attribute__((always_inline)) void dotProd_i16_AVX2(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    const int16_t *data = (const int16_t *)dataf;
+    const int16_t *weights = (const int16_t *)weightsf;
+    const float *wf = (const float *)(weights + n * len);
+
+    __m256 scale = _mm256_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 8) {
+        const int16_t *w0 = weights + i * len;
+        const int16_t *w1 = w0 + len * 4;
+
+        __m256i m0, m1, m2, m3, m4, m5, m6, m7;
+        m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = _mm256_setzero_si256();
+
+        for (int j = 0; j < len; j += 16) {
+            __m256i m8 = _mm256_load_si256((const __m256i *)(data + j));
+
+            m0 = _mm256_add_epi32(m0, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)w0)));
+            m1 = _mm256_add_epi32(m1, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)(w0 + 16))));
+            m2 = _mm256_add_epi32(m2, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)(w0 + 32))));
+            m3 = _mm256_add_epi32(m3, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)(w0 + 48))));
+
+            m4 = _mm256_add_epi32(m4, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)w1)));
+            m5 = _mm256_add_epi32(m5, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)(w1 + 16))));
+            m6 = _mm256_add_epi32(m6, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)(w1 + 32))));
+            m7 = _mm256_add_epi32(m7, _mm256_madd_epi16(m8, _mm256_load_si256((const __m256i *)(w1 + 48))));
+
+            w0 += 64;
+            w1 += 64;
+        }
+
+        m0 = _mm256_hadd_epi32(_mm256_hadd_epi32(m0, m1), _mm256_hadd_epi32(m2, m3));
+        m4 = _mm256_hadd_epi32(_mm256_hadd_epi32(m4, m5), _mm256_hadd_epi32(m6, m7));
+
+        __m256i sum = _mm256_add_epi32(_mm256_permute2x128_si256(m0, m4, 0x20),
+                                       _mm256_permute2x128_si256(m0, m4, 0x31));
+
+        // Each group of four neurons has four scales followed by four biases.
+        __m256 wf0 = _mm256_loadu_ps(wf + i * 2);
+        __m256 wf1 = _mm256_loadu_ps(wf + i * 2 + 8);
+
+        __m256 val = _mm256_mul_ps(_mm256_cvtepi32_ps(sum), _mm256_permute2f128_ps(wf0, wf1, 0x20));
+        val = _mm256_fmadd_ps(val, scale, _mm256_permute2f128_ps(wf0, wf1, 0x31));
+        _mm256_storeu_ps(vals + i, val);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_i16_AVX2_nsize, dotProd_i16_AVX2, );
+
+
+// The int8 weights are stored like the int16 weights and widened to int16
+// as they are loaded. The inputs are the pixels themselves, as uint8_t.
+static inline __attribute__((always_inline)) void dotProd_i8_AVX2(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    const uint8_t *data = (const uint8_t *)dataf;
+    const int8_t *weights = (const int8_t *)weightsf;
+    const float *wf = (const float *)(weights + n * len);
+
+    __m256 scale = _mm256_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 8) {
+        const int8_t *w0 = weights + i * len;
+        const int8_t *w1 = w0 + len * 4;
+
+        __m256i m0, m1, m2, m3, m4, m5, m6, m7;
+        m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = _mm256_setzero_si256();
+
+        for (int j = 0; j < len; j += 16) {
+            __m256i m8 = _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i *)(data + j)));
+
+            m0 = _mm256_add_epi32(m0, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)w0))));
+            m1 = _mm256_add_epi32(m1, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)(w0 + 16)))));
+            m2 = _mm256_add_epi32(m2, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)(w0 + 32)))));
+            m3 = _mm256_add_epi32(m3, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)(w0 + 48)))));
+
+            m4 = _mm256_add_epi32(m4, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)w1))));
+            m5 = _mm256_add_epi32(m5, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)(w1 + 16)))));
+            m6 = _mm256_add_epi32(m6, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)(w1 + 32)))));
+            m7 = _mm256_add_epi32(m7, _mm256_madd_epi16(m8, _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)(w1 + 48)))));
+
+            w0 += 64;
+            w1 += 64;
+        }
+
+        m0 = _mm256_hadd_epi32(_mm256_hadd_epi32(m0, m1), _mm256_hadd_epi32(m2, m3));
+        m4 = _mm256_hadd_epi32(_mm256_hadd_epi32(m4, m5), _mm256_hadd_epi32(m6, m7));
+
+        __m256i sum = _mm256_add_epi32(_mm256_permute2x128_si256(m0, m4, 0x20),
+                                       _mm256_permute2x128_si256(m0, m4, 0x31));
+
+        __m256 wf0 = _mm256_loadu_ps(wf + i * 2);
+        __m256 wf1 = _mm256_loadu_ps(wf + i * 2 + 8);
+
+        __m256 val = _mm256_mul_ps(_mm256_cvtepi32_ps(sum), _mm256_permute2f128_ps(wf0, wf1, 0x20));
+        val = _mm256_fmadd_ps(val, scale, _mm256_permute2f128_ps(wf0, wf1, 0x31));
+        _mm256_storeu_ps(vals + i, val);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_i8_AVX2_nsize, dotProd_i8_AVX2, );
+
+
+// The new prescreener for eight pixels: the group of four whose inputs are
+// at dataf, and the next group, whose inputs are at dataf + 32. Each half
+// of the registers does what nnedi3_computeNetwork0new_SSE2 does for one
+// group, with the same weights, so the results are the same.
+void nnedi3_computeNetwork0new_AVX2(const float *dataf, const float *weightsf, uint8_t *d) {
+    const uint8_t *data = (const uint8_t *)dataf;
+    const uint8_t *weights = (const uint8_t *)weightsf;
+
+    __m256i m0, m1, m2, m3;
+    m0 = m1 = m2 = m3 = _mm256_setzero_si256();
+
+    for (int i = 0; i < 128; i += 16) {
+        __m256i m4 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *)(data + i))),
+                                             _mm_load_si128((const __m128i *)(data + 128 + i)), 1);
+
+        m0 = _mm256_add_epi32(m0, _mm256_madd_epi16(m4, _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(weights + i * 4)))));
+        m1 = _mm256_add_epi32(m1, _mm256_madd_epi16(m4, _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(weights + i * 4 + 16)))));
+        m2 = _mm256_add_epi32(m2, _mm256_madd_epi16(m4, _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(weights + i * 4 + 32)))));
+        m3 = _mm256_add_epi32(m3, _mm256_madd_epi16(m4, _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(weights + i * 4 + 48)))));
+    }
+
+    m0 = _mm256_add_epi32(_mm256_unpacklo_epi64(m0, m1), _mm256_unpackhi_epi64(m0, m1));
+    m2 = _mm256_add_epi32(_mm256_unpacklo_epi64(m2, m3), _mm256_unpackhi_epi64(m2, m3));
+
+    m0 = _mm256_add_epi32(_mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(m0), _mm256_castsi256_ps(m2), 136)),
+                          _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(m0), _mm256_castsi256_ps(m2), 221)));
+
+    // Separate multiplications and additions, like in the SSE2 version.
+    __m256 m7 = _mm256_mul_ps(_mm256_cvtepi32_ps(m0), _mm256_broadcast_ps((const __m128 *)(weights + 512)));
+    m7 = _mm256_add_ps(m7, _mm256_broadcast_ps((const __m128 *)(weights + 528)));
+
+    __m256 m8 = _mm256_and_ps(m7, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+    m8 = _mm256_add_ps(m8, _mm256_set1_ps(1.0f));
+    m7 = _mm256_mul_ps(_mm256_rcp_ps(m8), m7);
+
+    __m256 m9 = _mm256_mul_ps(_mm256_permute_ps(m7, 0), _mm256_broadcast_ps((const __m128 *)(weights + 544)));
+    __m256 m10 = _mm256_mul_ps(_mm256_permute_ps(m7, 85), _mm256_broadcast_ps((const __m128 *)(weights + 560)));
+    __m256 m11 = _mm256_mul_ps(_mm256_permute_ps(m7, 170), _mm256_broadcast_ps((const __m128 *)(weights + 576)));
+    __m256 m12 = _mm256_mul_ps(_mm256_permute_ps(m7, 255), _mm256_broadcast_ps((const __m128 *)(weights + 592)));
+
+    m9 = _mm256_add_ps(m9, m10);
+    m11 = _mm256_add_ps(m11, m12);
+    m9 = _mm256_add_ps(m9, m11);
+
+    m9 = _mm256_add_ps(m9, _mm256_broadcast_ps((const __m128 *)(weights + 608)));
+
+    __m256i m13 = _mm256_castps_si256(_mm256_cmp_ps(m9, _mm256_setzero_ps(), _CMP_LT_OQ));
+
+    m13 = _mm256_packs_epi32(m13, m13);
+    m13 = _mm256_packs_epi16(m13, m13);
+
+    // The four bytes of each group are at the start of its half.
+    __m128i result = _mm_unpacklo_epi32(_mm256_castsi256_si128(m13), _mm256_extracti128_si256(m13, 1));
+    result = _mm_andnot_si128(result, _mm_set1_epi8(1));
+    _mm_storel_epi64((__m128i *)d, result);
+}
+
+
+// width must be a multiple of 16.
+int32_t nnedi3_processLine0_word_AVX2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value) {
+    const uint16_t *src3p = (const uint16_t *)src3p8;
+    uint16_t *dstp = (uint16_t *)dstp8;
+
+    __m256i dword_19 = _mm256_set1_epi32(19);
+    __m256i dword_3 = _mm256_set1_epi32(3);
+    __m256i dword_16 = _mm256_set1_epi32(16);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i maximum = _mm256_set1_epi32(max_value - 1);
+
+    int32_t count = 0;
+
+    for (int x = 0; x < width; x += 16) {
+        __m256i m0 = _mm256_loadu_si256((const __m256i *)(src3p + x));
+        __m256i m1 = _mm256_loadu_si256((const __m256i *)(src3p + x + src_pitch * 2));
+        __m256i m2 = _mm256_loadu_si256((const __m256i *)(src3p + x + src_pitch * 4));
+        __m256i m3 = _mm256_loadu_si256((const __m256i *)(src3p + x + src_pitch * 6));
+
+        // The unpacks work within each 128 bit lane, which the final pack undoes.
+        __m256i m4 = _mm256_add_epi32(_mm256_unpacklo_epi16(m1, zero), _mm256_unpacklo_epi16(m2, zero));
+        __m256i m5 = _mm256_add_epi32(_mm256_unpackhi_epi16(m1, zero), _mm256_unpackhi_epi16(m2, zero));
+        __m256i m6 = _mm256_add_epi32(_mm256_unpacklo_epi16(m0, zero), _mm256_unpacklo_epi16(m3, zero));
+        __m256i m7 = _mm256_add_epi32(_mm256_unpackhi_epi16(m0, zero), _mm256_unpackhi_epi16(m3, zero));
+
+        m4 = _mm256_sub_epi32(_mm256_mullo_epi32(m4, dword_19), _mm256_mullo_epi32(m6, dword_3));
+        m5 = _mm256_sub_epi32(_mm256_mullo_epi32(m5, dword_19), _mm256_mullo_epi32(m7, dword_3));
+
+        m4 = _mm256_srai_epi32(_mm256_add_epi32(m4, dword_16), 5);
+        m5 = _mm256_srai_epi32(_mm256_add_epi32(m5, dword_16), 5);
+
+        m4 = _mm256_min_epi32(m4, maximum);
+        m5 = _mm256_min_epi32(m5, maximum);
+
+        // packusdw clamps the negative values to 0.
+        m4 = _mm256_packus_epi32(m4, m5);
+
+        __m128i m8 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(tempu + x)), _mm_setzero_si128());
+
+        m4 = _mm256_or_si256(m4, _mm256_cvtepi8_epi16(m8));
+        _mm256_storeu_si256((__m256i *)(dstp + x), m4);
+
+        count += __builtin_popcount(_mm_movemask_epi8(m8));
+    }
+
+    return count;
+}
+
+
+// width must be a multiple of 8.
+int32_t nnedi3_processLine0_float_AVX2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value) {
+    const float *src3p = (const float *)src3p8;
+    float *dstp = (float *)dstp8;
+
+    __m256 float_19 = _mm256_set1_ps(19.0f);
+    __m256 float_3 = _mm256_set1_ps(3.0f);
+    __m256 float_1_32 = _mm256_set1_ps(1.0f / 32.0f);
+
+    int32_t count = 0;
+
+    for (int x = 0; x < width; x += 8) {
+        __m256 m0 = _mm256_add_ps(_mm256_loadu_ps(src3p + x + src_pitch * 2), _mm256_loadu_ps(src3p + x + src_pitch * 4));
+        __m256 m1 = _mm256_add_ps(_mm256_loadu_ps(src3p + x), _mm256_loadu_ps(src3p + x + src_pitch * 6));
+
+        m0 = _mm256_sub_ps(_mm256_mul_ps(m0, float_19), _mm256_mul_ps(m1, float_3));
+        m0 = _mm256_mul_ps(m0, float_1_32);
+
+        __m128i m2 = _mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i *)(tempu + x)), _mm_setzero_si128());
+
+        m0 = _mm256_or_ps(m0, _mm256_castsi256_ps(_mm256_cvtepi8_epi32(m2)));
+        _mm256_storeu_ps(dstp + x, m0);
+
+        count += __builtin_popcount(_mm_movemask_epi8(m2) & 0xff);
+    }
+
+    return count;
+}
+
+
+// Compensated sums, like nnedi3_extract_m8_float_SSE2.
+void nnedi3_extract_m8_float_AVX2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input) {
+    const float *srcp = (const float *)srcp8;
+
+    __m256 sum = _mm256_setzero_ps();
+    __m256 sum_c = _mm256_setzero_ps();
+    __m256 sumsq = _mm256_setzero_ps();
+    __m256 sumsq_c = _mm256_setzero_ps();
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            __m256 m0 = _mm256_loadu_ps(srcp + x);
+
+            _mm256_store_ps(input + x, m0);
+
+            __m256 m1 = _mm256_sub_ps(m0, sum_c);
+            __m256 m2 = _mm256_add_ps(sum, m1);
+            sum_c = _mm256_sub_ps(_mm256_sub_ps(m2, sum), m1);
+            sum = m2;
+
+            m1 = _mm256_sub_ps(_mm256_mul_ps(m0, m0), sumsq_c);
+            m2 = _mm256_add_ps(sumsq, m1);
+            sumsq_c = _mm256_sub_ps(_mm256_sub_ps(m2, sumsq), m1);
+            sumsq = m2;
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    float lanes[8], lanes_c[8], lanes_sq[8], lanes_sq_c[8];
+    _mm256_storeu_ps(lanes, sum);
+    _mm256_storeu_ps(lanes_c, sum_c);
+    _mm256_storeu_ps(lanes_sq, sumsq);
+    _mm256_storeu_ps(lanes_sq_c, sumsq_c);
+
+    double dsum = 0.0, dsumsq = 0.0;
+    for (int i = 0; i < 8; i++) {
+        dsum += (double)lanes[i] - lanes_c[i];
+        dsumsq += (double)lanes_sq[i] - lanes_sq_c[i];
+    }
+
+    const float scale = 1.0f / (xdia * ydia);
+    mstd[0] = dsum * scale;
+    const double tmp = dsumsq * scale - (double)mstd[0] * mstd[0];
+    mstd[3] = 0.0f;
+    if (tmp <= FLT_EPSILON) {
+        mstd[1] = mstd[2] = 0.0f;
+    } else {
+        mstd[1] = (float)sqrt(tmp);
+        mstd[2] = 1.0f / mstd[1];
+    }
+}
@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "simd_dotprod.h"
+
+
+// The AVX-512 functions use the same weight order as the AVX2 functions.
+// One zmm register holds the weights of two neurons for the same eight
+// (float) or sixteen (int16) inputs, so the inputs are broadcast to both
+// halves of the register.
+//
+// Sixteen neurons (four groups of four) are processed per iteration of
+// the outer loop, so n must be a multiple of 16.
+//
+// The int8 functions use the same weight order as the int16 functions,
+// with one byte per weight, and the pixels themselves as uint8_t inputs.
+
+
+// Turns eight accumulators, each holding the partial sums of two neurons,
+// into the sixteen final sums, in order.
+static inline __m512i reduce16_epi32(__m512i m0, __m512i m1, __m512i m2, __m512i m3, __m512i m4, __m512i m5, __m512i m6, __m512i m7) {
+    m0 = _mm512_add_epi32(_mm512_unpacklo_epi32(m0, m1), _mm512_unpackhi_epi32(m0, m1));
+    m2 = _mm512_add_epi32(_mm512_unpacklo_epi32(m2, m3), _mm512_unpackhi_epi32(m2, m3));
+    m4 = _mm512_add_epi32(_mm512_unpacklo_epi32(m4, m5), _mm512_unpackhi_epi32(m4, m5));
+    m6 = _mm512_add_epi32(_mm512_unpacklo_epi32(m6, m7), _mm512_unpackhi_epi32(m6, m7));
+
+    m0 = _mm512_add_epi32(_mm512_unpacklo_epi64(m0, m2), _mm512_unpackhi_epi64(m0, m2));
+    m4 = _mm512_add_epi32(_mm512_unpacklo_epi64(m4, m6), _mm512_unpackhi_epi64(m4, m6));
+
+    // Lanes are now (0 2 4 6) (0 2 4 6) (1 3 5 7) (1 3 5 7) for m0,
+    // and the same plus 8 for m4.
+    m0 = _mm512_add_epi32(_mm512_shuffle_i64x2(m0, m4, _MM_SHUFFLE(2, 0, 2, 0)),
+                          _mm512_shuffle_i64x2(m0, m4, _MM_SHUFFLE(3, 1, 3, 1)));
+
+    return _mm512_permutexvar_epi32(_mm512_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15), m0);
+}
+
+
+// Like reduce16_epi32, for four accumulators holding the partial sums of
+// four neurons each, one neuron per 128-bit lane.
+static inline __m512i reduce16_lanes_epi32(__m512i m0, __m512i m1, __m512i m2, __m512i m3) {
+    m0 = _mm512_add_epi32(_mm512_unpacklo_epi32(m0, m1), _mm512_unpackhi_epi32(m0, m1));
+    m2 = _mm512_add_epi32(_mm512_unpacklo_epi32(m2, m3), _mm512_unpackhi_epi32(m2, m3));
+
+    m0 = _mm512_add_epi32(_mm512_unpacklo_epi64(m0, m2), _mm512_unpackhi_epi64(m0, m2));
+
+    // Lane l now holds neurons l, l + 4, l + 8, l + 12.
+    return _mm512_permutexvar_epi32(_mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15), m0);
+}
+
+
+static inline __m512 reduce16_ps(__m512 m0, __m512 m1, __m512 m2, __m512 m3, __m512 m4, __m512 m5, __m512 m6, __m512 m7) {
+    m0 = _mm512_add_ps(_mm512_unpacklo_ps(m0, m1), _mm512_unpackhi_ps(m0, m1));
+    m2 = _mm512_add_ps(_mm512_unpacklo_ps(m2, m3), _mm512_unpackhi_ps(m2, m3));
+    m4 = _mm512_add_ps(_mm512_unpacklo_ps(m4, m5), _mm512_unpackhi_ps(m4, m5));
+    m6 = _mm512_add_ps(_mm512_unpacklo_ps(m6, m7), _mm512_unpackhi_ps(m6, m7));
+
+    m0 = _mm512_add_ps(_mm512_castpd_ps(_mm512_unpacklo_pd(_mm512_castps_pd(m0), _mm512_castps_pd(m2))),
+                       _mm512_castpd_ps(_mm512_unpackhi_pd(_mm512_castps_pd(m0), _mm512_castps_pd(m2))));
+    m4 = _mm512_add_ps(_mm512_castpd_ps(_mm512_unpacklo_pd(_mm512_castps_pd(m4), _mm512_castps_pd(m6))),
+                       _mm512_castpd_ps(_mm512_unpackhi_pd(_mm512_castps_pd(m4), _mm512_castps_pd(m6))));
+
+    m0 = _mm512_add_ps(_mm512_shuffle_f32x4(m0, m4, _MM_SHUFFLE(2, 0, 2, 0)),
+                       _mm512_shuffle_f32x4(m0, m4, _MM_SHUFFLE(3, 1, 3, 1)));
+
+    return _mm512_permutexvar_ps(_mm512_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15), m0);
+}
+
+
+// Applies the per neuron scales and biases stored after the int16 weights.
+static inline void store16_i16(__m512i sum, const float *wf, float *vals, __m512 scale) {
+    __m512 wf0 = _mm512_loadu_ps(wf);
+    __m512 wf1 = _mm512_loadu_ps(wf + 16);
+
+    __m512 val = _mm512_mul_ps(_mm512_cvtepi32_ps(sum), _mm512_shuffle_f32x4(wf0, wf1, _MM_SHUFFLE(2, 0, 2, 0)));
+    val = _mm512_fmadd_ps(val, scale, _mm512_shuffle_f32x4(wf0, wf1, _MM_SHUFFLE(3, 1, 3, 1)));
+    _mm512_storeu_ps(vals, val);
+}
+
+
+static inline __attribute__((always_inline)) void dotProd_AVX512(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    __m512 scale = _mm512_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 16) {
+        const float *w = weights + i * len;
+
+        __m512 m0, m1, m2, m3, m4, m5, m6, m7;
+        m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = _mm512_setzero_ps();
+
+        for (int j = 0; j < len; j += 8) {
+            __m512 m8 = _mm512_castpd_ps(_mm512_broadcast_f64x4(_mm256_load_pd((const double *)(data + j))));
+
+            m0 = _mm512_fmadd_ps(m8, _mm512_load_ps(w), m0);
+            m1 = _mm512_fmadd_ps(m8, _mm512_load_ps(w + 16), m1);
+            m2 = _mm512_fmadd_ps(m8, _mm512_load_ps(w + len * 4), m2);
+            m3 = _mm512_fmadd_ps(m8, _mm512_load_ps(w + len * 4 + 16), m3);
+            m4 = _mm512_fmadd_ps(m8, _mm512_load_ps(w + len * 8), m4);
+            m5 = _mm512_fmadd_ps(m8, _mm512_load_ps(w + len * 8 + 16), m5);
+            m6 = _mm512_fmadd_ps(m8, _mm512_load_ps(w + len * 12), m6);
+            m7 = _mm512_fmadd_ps(m8, _mm512_load_ps(w + len * 12 + 16), m7);
+
+            w += 32;
+        }
+
+        __m512 sum = reduce16_ps(m0, m1, m2, m3, m4, m5, m6, m7);
+
+        sum = _mm512_fmadd_ps(sum, scale, _mm512_loadu_ps(weights + n * len + i));
+        _mm512_storeu_ps(vals + i, sum);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_AVX512_nsize, dotProd_AVX512, );
+
+
+static inline __attribute__((always_inline)) void dotProd_i16_AVX512(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    const int16_t *data = (const int16_t *)dataf;
+    const int16_t *weights = (const int16_t *)weightsf;
+    const float *wf = (const float *)(weights + n * len);
+
+    __m512 scale = _mm512_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 16) {
+        const int16_t *w = weights + i * len;
+
+        __m512i m0, m1, m2, m3, m4, m5, m6, m7;
+        m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = _mm512_setzero_si512();
+
+        for (int j = 0; j < len; j += 16) {
+            __m512i m8 = _mm512_broadcast_i64x4(_mm256_load_si256((const __m256i *)(data + j)));
+
+            m0 = _mm512_add_epi32(m0, _mm512_madd_epi16(m8, _mm512_load_si512(w)));
+            m1 = _mm512_add_epi32(m1, _mm512_madd_epi16(m8, _mm512_load_si512(w + 32)));
+            m2 = _mm512_add_epi32(m2, _mm512_madd_epi16(m8, _mm512_load_si512(w + len * 4)));
+            m3 = _mm512_add_epi32(m3, _mm512_madd_epi16(m8, _mm512_load_si512(w + len * 4 + 32)));
+            m4 = _mm512_add_epi32(m4, _mm512_madd_epi16(m8, _mm512_load_si512(w + len * 8)));
+            m5 = _mm512_add_epi32(m5, _mm512_madd_epi16(m8, _mm512_load_si512(w + len * 8 + 32)));
+            m6 = _mm512_add_epi32(m6, _mm512_madd_epi16(m8, _mm512_load_si512(w + len * 12)));
+            m7 = _mm512_add_epi32(m7, _mm512_madd_epi16(m8, _mm512_load_si512(w + len * 12 + 32)));
+
+            w += 64;
+        }
+
+        store16_i16(reduce16_epi32(m0, m1, m2, m3, m4, m5, m6, m7), wf + i * 2, vals + i, scale);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_i16_AVX512_nsize, dotProd_i16_AVX512, );
+
+
+static inline __attribute__((always_inline)) void dotProd_i8_AVX512(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    const uint8_t *data = (const uint8_t *)dataf;
+    const int8_t *weights = (const int8_t *)weightsf;
+    const float *wf = (const float *)(weights + n * len);
+
+    __m512 scale = _mm512_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 16) {
+        const int8_t *w = weights + i * len;
+
+        __m512i m0, m1, m2, m3, m4, m5, m6, m7;
+        m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = _mm512_setzero_si512();
+
+        for (int j = 0; j < len; j += 16) {
+            __m512i m8 = _mm512_broadcast_i64x4(_mm256_cvtepu8_epi16(_mm_load_si128((const __m128i *)(data + j))));
+
+            m0 = _mm512_add_epi32(m0, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)w))));
+            m1 = _mm512_add_epi32(m1, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)(w + 32)))));
+            m2 = _mm512_add_epi32(m2, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)(w + len * 4)))));
+            m3 = _mm512_add_epi32(m3, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)(w + len * 4 + 32)))));
+            m4 = _mm512_add_epi32(m4, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)(w + len * 8)))));
+            m5 = _mm512_add_epi32(m5, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)(w + len * 8 + 32)))));
+            m6 = _mm512_add_epi32(m6, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)(w + len * 12)))));
+            m7 = _mm512_add_epi32(m7, _mm512_madd_epi16(m8, _mm512_cvtepi8_epi16(_mm256_load_si256((const __m256i *)(w + len * 12 + 32)))));
+
+            w += 64;
+        }
+
+        store16_i16(reduce16_epi32(m0, m1, m2, m3, m4, m5, m6, m7), wf + i * 2, vals + i, scale);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_i8_AVX512_nsize, dotProd_i8_AVX512, );
+
+
+// Only these functions may use VNNI instructions. Compiling the whole file
+// with -mavx512vnni would let clang fuse the madd+add pairs above into
+// vpdpwssd, which would then crash on CPUs without VNNI.
+__attribute__((target("avx512vnni")))
+static inline __attribute__((always_inline)) void dotProd_i16_AVX512VNNI(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    const int16_t *data = (const int16_t *)dataf;
+    const int16_t *weights = (const int16_t *)weightsf;
+    const float *wf = (const float *)(weights + n * len);
+
+    __m512 scale = _mm512_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 16) {
+        const int16_t *w = weights + i * len;
+
+        __m512i m0, m1, m2, m3, m4, m5, m6, m7;
+        m0 = m1 = m2 = m3 = m4 = m5 = m6 = m7 = _mm512_setzero_si512();
+
+        for (int j = 0; j < len; j += 16) {
+            __m512i m8 = _mm512_broadcast_i64x4(_mm256_load_si256((const __m256i *)(data + j)));
+
+            m0 = _mm512_dpwssd_epi32(m0, m8, _mm512_load_si512(w));
+            m1 = _mm512_dpwssd_epi32(m1, m8, _mm512_load_si512(w + 32));
+            m2 = _mm512_dpwssd_epi32(m2, m8, _mm512_load_si512(w + len * 4));
+            m3 = _mm512_dpwssd_epi32(m3, m8, _mm512_load_si512(w + len * 4 + 32));
+            m4 = _mm512_dpwssd_epi32(m4, m8, _mm512_load_si512(w + len * 8));
+            m5 = _mm512_dpwssd_epi32(m5, m8, _mm512_load_si512(w + len * 8 + 32));
+            m6 = _mm512_dpwssd_epi32(m6, m8, _mm512_load_si512(w + len * 12));
+            m7 = _mm512_dpwssd_epi32(m7, m8, _mm512_load_si512(w + len * 12 + 32));
+
+            w += 64;
+        }
+
+        store16_i16(reduce16_epi32(m0, m1, m2, m3, m4, m5, m6, m7), wf + i * 2, vals + i, scale);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_i16_AVX512VNNI_nsize, dotProd_i16_AVX512VNNI, __attribute__((target("avx512vnni"))));
+
+
+// One zmm register holds the weights of a whole group of four neurons,
+// because vpdpbusd adds up four products in each dword.
+__attribute__((target("avx512vnni")))
+static inline __attribute__((always_inline)) void dotProd_i8_AVX512VNNI(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+    const uint8_t *data = (const uint8_t *)dataf;
+    const int8_t *weights = (const int8_t *)weightsf;
+    const float *wf = (const float *)(weights + n * len);
+
+    __m512 scale = _mm512_set1_ps(istd[0]);
+
+    for (int i = 0; i < n; i += 16) {
+        const int8_t *w = weights + i * len;
+
+        __m512i m0, m1, m2, m3;
+        m0 = m1 = m2 = m3 = _mm512_setzero_si512();
+
+        for (int j = 0; j < len; j += 16) {
+            __m512i m8 = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)(data + j)));
+
+            m0 = _mm512_dpbusd_epi32(m0, m8, _mm512_load_si512(w));
+            m1 = _mm512_dpbusd_epi32(m1, m8, _mm512_load_si512(w + len * 4));
+            m2 = _mm512_dpbusd_epi32(m2, m8, _mm512_load_si512(w + len * 8));
+            m3 = _mm512_dpbusd_epi32(m3, m8, _mm512_load_si512(w + len * 12));
+
+            w += 64;
+        }
+
+        store16_i16(reduce16_lanes_epi32(m0, m1, m2, m3), wf + i * 2, vals + i, scale);
+    }
+}
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_i8_AVX512VNNI_nsize, dotProd_i8_AVX512VNNI, __attribute__((target("avx512vnni"))));
@@ -0,0 +1,45 @@
+#ifndef SIMD_DOTPROD_H
+#define SIMD_DOTPROD_H
+
+#include <stdint.h>
+
+
+// The space used by the inputs of each pixel of a batch, in floats.
+#define PREDICTOR_STRIDE 512
+
+
+// Runs the dot products of n neurons for count pixels. The inputs of
+// pixel k start at data + k * PREDICTOR_STRIDE, its outputs at
+// vals + k * vals_stride, and its four values from extract at
+// mstd + k * 4. The third of those scales the sums.
+typedef void (*nnedi3DotProdFunc)(const float *data, const float *weights, float *vals, const float *mstd, const intptr_t count, const intptr_t vals_stride, const intptr_t n);
+
+
+// Defines the array table, with a nnedi3DotProdFunc for each nsize, in
+// the order of xdiaTable and ydiaTable in nnedi3.cpp. Each one calls the
+// dotProd function func for every pixel, with len a constant, so the
+// inner loop can be unrolled completely.
+//
+// func must be a static inline function. The SIMD ones also have the
+// always_inline attribute.
+// attr is placed in front of each copy, for the target attribute.
+#define NNEDI3_DOTPROD_LEN(func, length, attr) \
+    attr static void func##_##length(const float *data, const float *weights, float *vals, const float *mstd, const intptr_t count, const intptr_t vals_stride, const intptr_t n) { \
+        for (intptr_t k = 0; k < count; k++) \
+            func(data + k * PREDICTOR_STRIDE, weights, vals + k * vals_stride, n, length, mstd + k * 4 + 2); \
+    }
+
+#define NNEDI3_DOTPROD_NSIZES(table, func, attr) \
+    NNEDI3_DOTPROD_LEN(func, 48, attr) \
+    NNEDI3_DOTPROD_LEN(func, 96, attr) \
+    NNEDI3_DOTPROD_LEN(func, 192, attr) \
+    NNEDI3_DOTPROD_LEN(func, 288, attr) \
+    NNEDI3_DOTPROD_LEN(func, 32, attr) \
+    NNEDI3_DOTPROD_LEN(func, 64, attr) \
+    NNEDI3_DOTPROD_LEN(func, 128, attr) \
+    \
+    const nnedi3DotProdFunc table[7] = { \
+        func##_48, func##_96, func##_192, func##_288, func##_32, func##_64, func##_128 \
+    }
+
+#endif // SIMD_DOTPROD_H
@@ -17,6 +17,4 @@ void nnedi3_e0_m16_FMA4(float *s, const intptr_t n) {
 }
 
 
-void nnedi3_dotProd_FMA4(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
-    nnedi3_dotProd(data, weights, vals, n, len, istd);
-}
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_FMA4_nsize, nnedi3_dotProd, );
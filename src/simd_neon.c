@@ -1,6 +1,11 @@
+#include <float.h>
+#include <math.h>
 #include <stdint.h>
+#include <string.h>
 #include <arm_neon.h>
 
+#include "simd_dotprod.h"
+
 
 static const uint32x4_t sign_bits_f = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
 static const uint32x4_t sign_bits_f_zero_l = { 0, 0x7fffffff, 0x7fffffff, 0x7fffffff };
@@ -17,7 +22,93 @@ static inline __attribute__((always_inline)) float32x4_t reciprocal(float32x4_t
 }
 
 
-void byte2word48_neon(const uint8_t *t, const int pitch, float *pf) {
+// ARMv8 has fused multiply-add and across-vector additions.
+// ARMv7 NEON only has the unfused vmla, which gives the same results as
+// separate vmul and vadd, so that is what it gets.
+static inline __attribute__((always_inline)) float32x4_t mla_f32(float32x4_t acc, float32x4_t a, float32x4_t b) {
+#if defined(__aarch64__)
+    return vfmaq_f32(acc, a, b);
+#else
+    return vaddq_f32(acc, vmulq_f32(a, b));
+#endif
+}
+
+
+// Returns { sum(m0), sum(m1), sum(m2), sum(m3) }.
+static inline __attribute__((always_inline)) float32x4_t hadd4_f32(float32x4_t m0, float32x4_t m1, float32x4_t m2, float32x4_t m3) {
+#if defined(__aarch64__)
+    return vpaddq_f32(vpaddq_f32(m0, m1), vpaddq_f32(m2, m3));
+#else
+    float32x2_t sum0 = vpadd_f32(vget_low_f32(m0), vget_high_f32(m0));
+    float32x2_t sum1 = vpadd_f32(vget_low_f32(m1), vget_high_f32(m1));
+    float32x2_t sum2 = vpadd_f32(vget_low_f32(m2), vget_high_f32(m2));
+    float32x2_t sum3 = vpadd_f32(vget_low_f32(m3), vget_high_f32(m3));
+    sum0 = vpadd_f32(sum0, sum1);
+    sum1 = vpadd_f32(sum2, sum3);
+    return vcombine_f32(sum0, sum1);
+#endif
+}
+
+
+static inline __attribute__((always_inline)) int32x4_t hadd4_s32(int32x4_t m0, int32x4_t m1, int32x4_t m2, int32x4_t m3) {
+#if defined(__aarch64__)
+    return vpaddq_s32(vpaddq_s32(m0, m1), vpaddq_s32(m2, m3));
+#else
+    int32x2_t sum0 = vpadd_s32(vget_low_s32(m0), vget_high_s32(m0));
+    int32x2_t sum1 = vpadd_s32(vget_low_s32(m1), vget_high_s32(m1));
+    int32x2_t sum2 = vpadd_s32(vget_low_s32(m2), vget_high_s32(m2));
+    int32x2_t sum3 = vpadd_s32(vget_low_s32(m3), vget_high_s32(m3));
+    sum0 = vpadd_s32(sum0, sum1);
+    sum1 = vpadd_s32(sum2, sum3);
+    return vcombine_s32(sum0, sum1);
+#endif
+}
+
+
+static inline __attribute__((always_inline)) float hsum_f32(float32x4_t m0) {
+#if defined(__aarch64__)
+    return vaddvq_f32(m0);
+#else
+    float32x2_t sum = vadd_f32(vget_low_f32(m0), vget_high_f32(m0));
+    return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#endif
+}
+
+
+static inline __attribute__((always_inline)) uint32_t hsum_u32(uint32x4_t m0) {
+#if defined(__aarch64__)
+    return vaddvq_u32(m0);
+#else
+    uint32x2_t sum = vadd_u32(vget_low_u32(m0), vget_high_u32(m0));
+    return vget_lane_u32(vpadd_u32(sum, sum), 0);
+#endif
+}
+
+
+static inline __attribute__((always_inline)) uint64_t hsum_u64(uint64x2_t m0) {
+    return vgetq_lane_u64(m0, 0) + vgetq_lane_u64(m0, 1);
+}
+
+
+// accum += dot products of the pairs of int16 in data and weights.
+// The order of the partial sums doesn't matter because the caller adds
+// all four lanes together.
+static inline __attribute__((always_inline)) int32x4_t madd_s16(int32x4_t accum, const int16_t *data, const int16_t *weights) {
+#if defined(__aarch64__)
+    int16x8_t d0 = vld1q_s16(data);
+    int16x8_t w0 = vld1q_s16(weights);
+    accum = vmlal_s16(accum, vget_low_s16(d0), vget_low_s16(w0));
+    return vmlal_high_s16(accum, d0, w0);
+#else
+    int16x4x2_t d0 = vld2_s16(data);
+    int16x4x2_t w0 = vld2_s16(weights);
+    accum = vmlal_s16(accum, d0.val[0], w0.val[0]);
+    return vmlal_s16(accum, d0.val[1], w0.val[1]);
+#endif
+}
+
+
+void byte2word48_neon(const uint8_t *t, const intptr_t pitch, float *pf) {
     uint16_t *p = (uint16_t *)pf;
 
     uint8x8_t m0, m1, m2, m3, m4, m5;
@@ -43,7 +134,7 @@ void byte2word48_neon(const uint8_t *t, const int pitch, float *pf) {
 }
 
 
-void byte2word64_neon(const uint8_t *t, const int pitch, float *pf) {
+void byte2word64_neon(const uint8_t *t, const intptr_t pitch, float *pf) {
     uint16_t *p = (uint16_t *)pf;
 
     vst1q_u16(p, vmovl_u8(vld1_u8(t)));
@@ -57,7 +148,7 @@ void byte2word64_neon(const uint8_t *t, const int pitch, float *pf) {
 }
 
 
-void byte2float48_neon(const uint8_t *t, const int pitch, float *p) {
+void byte2float48_neon(const uint8_t *t, const intptr_t pitch, float *p) {
     uint16x8_t m0, m1, m2, m3, m4, m5;
     uint32x2_t temp1, temp4;
 
@@ -90,7 +181,7 @@ void byte2float48_neon(const uint8_t *t, const int pitch, float *p) {
 }
 
 
-void word2float48_neon(const uint8_t *t8, const int pitch, float *p) {
+void word2float48_neon(const uint8_t *t8, const intptr_t pitch, float *p) {
     const uint16_t *t = (const uint16_t *)t8;
 
     for (int i = 0; i < 4; i++) {
@@ -112,6 +203,77 @@ void word2float48_neon(const uint8_t *t8, const int pitch, float *p) {
 }
 
 
+// The 16 bit input is shifted right by one so that it fits in int16_t.
+static inline __attribute__((always_inline)) void word2word_neon(const uint8_t *t8, const intptr_t pitch, float *pf, const int width, const int shift) {
+    const uint16_t *t = (const uint16_t *)t8;
+    uint16_t *p = (uint16_t *)pf;
+
+    const int16x8_t shift_v = vdupq_n_s16(-shift);
+
+    for (int y = 0; y < 4; y++) {
+        vst1q_u16(p, vshlq_u16(vld1q_u16(t), shift_v));
+        if (width == 16)
+            vst1q_u16(p + 8, vshlq_u16(vld1q_u16(t + 8), shift_v));
+        else
+            vst1_u16(p + 8, vshl_u16(vld1_u16(t + 8), vget_low_s16(shift_v)));
+
+        t += pitch * 2; // it was already halved
+        p += width;
+    }
+}
+
+
+void word2word48_neon(const uint8_t *t, const intptr_t pitch, float *p) {
+    word2word_neon(t, pitch, p, 12, 0);
+}
+
+
+void word2word48_shift_neon(const uint8_t *t, const intptr_t pitch, float *p) {
+    word2word_neon(t, pitch, p, 12, 1);
+}
+
+
+void word2word64_neon(const uint8_t *t, const intptr_t pitch, float *p) {
+    word2word_neon(t, pitch, p, 16, 0);
+}
+
+
+void word2word64_shift_neon(const uint8_t *t, const intptr_t pitch, float *p) {
+    word2word_neon(t, pitch, p, 16, 1);
+}
+
+
+static inline __attribute__((always_inline)) int32x4_t float2int_neon(const float *t, const float32x4_t scale) {
+    float32x4_t f = vmulq_f32(vld1q_f32(t), scale);
+#if defined(__aarch64__)
+    return vcvtnq_s32_f32(f);
+#else
+    // Round half away from zero, since vcvtq_s32_f32 truncates.
+    const uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(f), vdupq_n_u32(0x80000000));
+    const float32x4_t half = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vdupq_n_f32(0.5f)), sign));
+    return vcvtq_s32_f32(vaddq_f32(f, half));
+#endif
+}
+
+
+// Float input is scaled so that 0..1 maps to 0..32767.
+void float2word64_neon(const uint8_t *t8, const intptr_t pitch, float *pf) {
+    const float *t = (const float *)t8;
+    int16_t *p = (int16_t *)pf;
+
+    const float32x4_t scale = vdupq_n_f32(32767.0f);
+
+    for (int y = 0; y < 4; y++) {
+        // The conversions and the narrowing saturate.
+        vst1q_s16(p, vcombine_s16(vqmovn_s32(float2int_neon(t, scale)), vqmovn_s32(float2int_neon(t + 4, scale))));
+        vst1q_s16(p + 8, vcombine_s16(vqmovn_s32(float2int_neon(t + 8, scale)), vqmovn_s32(float2int_neon(t + 12, scale))));
+
+        t += pitch * 2;
+        p += 16;
+    }
+}
+
+
 void computeNetwork0_neon(const float *input, const float *weights, uint8_t *d) {
     float32x4_t m0 = { 0.0f, 0.0f, 0.0f, 0.0f };
     float32x4_t m1 = m0;
@@ -122,28 +284,14 @@ void computeNetwork0_neon(const float *input, const float *weights, uint8_t *d)
 
     for (int i = 0; i < 192/4; i += 4) {
         m4 = vld1q_f32(input + i);
-        m5 = m4;
-        m6 = m4;
-        m7 = m4;
-
-        m4 = vmulq_f32(m4, vld1q_f32(weights + i * 4));
-        m5 = vmulq_f32(m5, vld1q_f32(weights + i * 4 + 4));
-        m6 = vmulq_f32(m6, vld1q_f32(weights + i * 4 + 8));
-        m7 = vmulq_f32(m7, vld1q_f32(weights + i * 4 + 12));
-
-        m0 = vaddq_f32(m0, m4);
-        m1 = vaddq_f32(m1, m5);
-        m2 = vaddq_f32(m2, m6);
-        m3 = vaddq_f32(m3, m7);
+
+        m0 = mla_f32(m0, m4, vld1q_f32(weights + i * 4));
+        m1 = mla_f32(m1, m4, vld1q_f32(weights + i * 4 + 4));
+        m2 = mla_f32(m2, m4, vld1q_f32(weights + i * 4 + 8));
+        m3 = mla_f32(m3, m4, vld1q_f32(weights + i * 4 + 12));
     }
 
-    float32x2_t sum0 = vpadd_f32(vget_low_f32(m0), vget_high_f32(m0));
-    float32x2_t sum1 = vpadd_f32(vget_low_f32(m1), vget_high_f32(m1));
-    float32x2_t sum2 = vpadd_f32(vget_low_f32(m2), vget_high_f32(m2));
-    float32x2_t sum3 = vpadd_f32(vget_low_f32(m3), vget_high_f32(m3));
-    sum0 = vpadd_f32(sum0, sum1);
-    sum1 = vpadd_f32(sum2, sum3);
-    m0 = vcombine_f32(sum0, sum1);
+    m0 = hadd4_f32(m0, m1, m2, m3);
 
     m0 = vaddq_f32(m0, vld1q_f32(weights + 768/4));
 
@@ -220,33 +368,13 @@ void computeNetwork0_i16_neon(const float *inputf, const float *weightsf, uint8_
     int32x4_t accum3 = accum0;
 
     for (int i = 0; i < 96/2; i += 8) {
-        int16x4x2_t d0 = vld2_s16(input + i);
-
-        int16x4x2_t w0 = vld2_s16(weights + i * 4);
-        int16x4x2_t w1 = vld2_s16(weights + i * 4 + 8);
-        int16x4x2_t w2 = vld2_s16(weights + i * 4 + 16);
-        int16x4x2_t w3 = vld2_s16(weights + i * 4 + 24);
-
-        accum0 = vmlal_s16(accum0, d0.val[0], w0.val[0]);
-        accum0 = vmlal_s16(accum0, d0.val[1], w0.val[1]);
-
-        accum1 = vmlal_s16(accum1, d0.val[0], w1.val[0]);
-        accum1 = vmlal_s16(accum1, d0.val[1], w1.val[1]);
-
-        accum2 = vmlal_s16(accum2, d0.val[0], w2.val[0]);
-        accum2 = vmlal_s16(accum2, d0.val[1], w2.val[1]);
-
-        accum3 = vmlal_s16(accum3, d0.val[0], w3.val[0]);
-        accum3 = vmlal_s16(accum3, d0.val[1], w3.val[1]);
+        accum0 = madd_s16(accum0, input + i, weights + i * 4);
+        accum1 = madd_s16(accum1, input + i, weights + i * 4 + 8);
+        accum2 = madd_s16(accum2, input + i, weights + i * 4 + 16);
+        accum3 = madd_s16(accum3, input + i, weights + i * 4 + 24);
     }
 
-    int32x2_t sum0 = vpadd_s32(vget_low_s32(accum0), vget_high_s32(accum0));
-    int32x2_t sum1 = vpadd_s32(vget_low_s32(accum1), vget_high_s32(accum1));
-    int32x2_t sum2 = vpadd_s32(vget_low_s32(accum2), vget_high_s32(accum2));
-    int32x2_t sum3 = vpadd_s32(vget_low_s32(accum3), vget_high_s32(accum3));
-    sum0 = vpadd_s32(sum0, sum1);
-    sum1 = vpadd_s32(sum2, sum3);
-    int32x4_t sum = vcombine_s32(sum0, sum1);
+    int32x4_t sum = hadd4_s32(accum0, accum1, accum2, accum3);
 
     float32x4_t m0 = vcvtq_f32_s32(sum);
 
@@ -329,33 +457,13 @@ void computeNetwork0new_neon(const float *dataf, const float *weightsf, uint8_t
     int32x4_t accum3 = accum0;
 
     for (int i = 0; i < 128/2; i += 8) {
-        int16x4x2_t d0 = vld2_s16(data + i);
-
-        int16x4x2_t w0 = vld2_s16(weights + i * 4);
-        int16x4x2_t w1 = vld2_s16(weights + i * 4 + 8);
-        int16x4x2_t w2 = vld2_s16(weights + i * 4 + 16);
-        int16x4x2_t w3 = vld2_s16(weights + i * 4 + 24);
-
-        accum0 = vmlal_s16(accum0, d0.val[0], w0.val[0]);
-        accum0 = vmlal_s16(accum0, d0.val[1], w0.val[1]);
-
-        accum1 = vmlal_s16(accum1, d0.val[0], w1.val[0]);
-        accum1 = vmlal_s16(accum1, d0.val[1], w1.val[1]);
-
-        accum2 = vmlal_s16(accum2, d0.val[0], w2.val[0]);
-        accum2 = vmlal_s16(accum2, d0.val[1], w2.val[1]);
-
-        accum3 = vmlal_s16(accum3, d0.val[0], w3.val[0]);
-        accum3 = vmlal_s16(accum3, d0.val[1], w3.val[1]);
+        accum0 = madd_s16(accum0, data + i, weights + i * 4);
+        accum1 = madd_s16(accum1, data + i, weights + i * 4 + 8);
+        accum2 = madd_s16(accum2, data + i, weights + i * 4 + 16);
+        accum3 = madd_s16(accum3, data + i, weights + i * 4 + 24);
     }
 
-    int32x2_t sum0 = vpadd_s32(vget_low_s32(accum0), vget_high_s32(accum0));
-    int32x2_t sum1 = vpadd_s32(vget_low_s32(accum1), vget_high_s32(accum1));
-    int32x2_t sum2 = vpadd_s32(vget_low_s32(accum2), vget_high_s32(accum2));
-    int32x2_t sum3 = vpadd_s32(vget_low_s32(accum3), vget_high_s32(accum3));
-    sum0 = vpadd_s32(sum0, sum1);
-    sum1 = vpadd_s32(sum2, sum3);
-    int32x4_t sum = vcombine_s32(sum0, sum1);
+    int32x4_t sum = hadd4_s32(accum0, accum1, accum2, accum3);
 
     float32x4_t m0 = vcvtq_f32_s32(sum);
 
@@ -393,7 +501,7 @@ void computeNetwork0new_neon(const float *dataf, const float *weightsf, uint8_t
 }
 
 
-void dotProd_neon(const float *data, const float *weights, float *vals, const int n, const int len, const float *istd) {
+static inline __attribute__((always_inline)) void dotProd_neon(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
     const float *orig_weights = weights;
 
     for (int i = 0; i < n; i += 4) {
@@ -404,39 +512,26 @@ void dotProd_neon(const float *data, const float *weights, float *vals, const in
 
         for (int j = 0; j < len; j += 4) {
             float32x4_t d0 = vld1q_f32(data + j);
-            float32x4_t d1 = d0;
-            float32x4_t d2 = d0;
-            float32x4_t d3 = d0;
 
-            float32x4_t w0 = vld1q_f32(weights);
-            float32x4_t w1 = vld1q_f32(weights + 4);
-            float32x4_t w2 = vld1q_f32(weights + 8);
-            float32x4_t w3 = vld1q_f32(weights + 12);
-
-            accum0 = vaddq_f32(accum0, vmulq_f32(d0, w0));
-            accum1 = vaddq_f32(accum1, vmulq_f32(d1, w1));
-            accum2 = vaddq_f32(accum2, vmulq_f32(d2, w2));
-            accum3 = vaddq_f32(accum3, vmulq_f32(d3, w3));
+            accum0 = mla_f32(accum0, d0, vld1q_f32(weights));
+            accum1 = mla_f32(accum1, d0, vld1q_f32(weights + 4));
+            accum2 = mla_f32(accum2, d0, vld1q_f32(weights + 8));
+            accum3 = mla_f32(accum3, d0, vld1q_f32(weights + 12));
 
             weights += 16;
         }
 
-        float32x2_t sum0 = vpadd_f32(vget_low_f32(accum0), vget_high_f32(accum0));
-        float32x2_t sum1 = vpadd_f32(vget_low_f32(accum1), vget_high_f32(accum1));
-        float32x2_t sum2 = vpadd_f32(vget_low_f32(accum2), vget_high_f32(accum2));
-        float32x2_t sum3 = vpadd_f32(vget_low_f32(accum3), vget_high_f32(accum3));
-        sum0 = vpadd_f32(sum0, sum1);
-        sum1 = vpadd_f32(sum2, sum3);
-        float32x4_t sum = vcombine_f32(sum0, sum1);
-        
-        sum = vmulq_n_f32(sum, istd[0]);
-        sum = vaddq_f32(sum, vld1q_f32(orig_weights + n*len + i));
+        float32x4_t sum = hadd4_f32(accum0, accum1, accum2, accum3);
+
+        sum = mla_f32(vld1q_f32(orig_weights + n*len + i), sum, vdupq_n_f32(istd[0]));
         vst1q_f32(vals + i, sum);
     }
 }
 
+NNEDI3_DOTPROD_NSIZES(dotProd_neon_nsize, dotProd_neon, );
 
-void dotProd_i16_neon(const float *dataf, const float *weightsf, float *vals, const int n, const int len, const float *istd) {
+
+static inline __attribute__((always_inline)) void dotProd_i16_neon(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
     const int16_t *data = (const int16_t *)dataf;
     const int16_t *weights = (const int16_t *)weightsf;
     weightsf += n * len / 2; // sizeof(float) / sizeof(int16_t)
@@ -448,40 +543,550 @@ void dotProd_i16_neon(const float *dataf, const float *weightsf, float *vals, co
         int32x4_t accum3 = accum0;
 
         for (int j = 0; j < len; j += 8) {
-            int16x4x2_t d0 = vld2_s16(data + j);
+            accum0 = madd_s16(accum0, data + j, weights);
+            accum1 = madd_s16(accum1, data + j, weights + 8);
+            accum2 = madd_s16(accum2, data + j, weights + 16);
+            accum3 = madd_s16(accum3, data + j, weights + 24);
 
-            int16x4x2_t w0 = vld2_s16(weights);
-            int16x4x2_t w1 = vld2_s16(weights + 8);
-            int16x4x2_t w2 = vld2_s16(weights + 16);
-            int16x4x2_t w3 = vld2_s16(weights + 24);
+            weights += 32;
+        }
 
-            accum0 = vmlal_s16(accum0, d0.val[0], w0.val[0]);
-            accum0 = vmlal_s16(accum0, d0.val[1], w0.val[1]);
+        int32x4_t sum = hadd4_s32(accum0, accum1, accum2, accum3);
 
-            accum1 = vmlal_s16(accum1, d0.val[0], w1.val[0]);
-            accum1 = vmlal_s16(accum1, d0.val[1], w1.val[1]);
+        float32x4_t val = vcvtq_f32_s32(sum);
+        val = vmulq_f32(val, vld1q_f32(weightsf + i*2));
+        val = mla_f32(vld1q_f32(weightsf + i*2 + 4), val, vdupq_n_f32(istd[0]));
+        vst1q_f32(vals + i, val);
+    }
+}
 
-            accum2 = vmlal_s16(accum2, d0.val[0], w2.val[0]);
-            accum2 = vmlal_s16(accum2, d0.val[1], w2.val[1]);
+NNEDI3_DOTPROD_NSIZES(dotProd_i16_neon_nsize, dotProd_i16_neon, );
 
-            accum3 = vmlal_s16(accum3, d0.val[0], w3.val[0]);
-            accum3 = vmlal_s16(accum3, d0.val[1], w3.val[1]);
 
-            weights += 32;
+static const float32x4_t exp_hi = { 80.0f, 80.0f, 80.0f, 80.0f };
+static const float32x4_t exp_lo = { -80.0f, -80.0f, -80.0f, -80.0f };
+
+
+void e0_m16_neon(float *s, const intptr_t n) {
+    const float32x4_t e0_mult = vdupq_n_f32(12102203.161561486f); // (1.0/ln(2))*(2^23)
+    const float32x4_t e0_bias = vdupq_n_f32(1064866805.0f); // (2^23)*127.0-486411.0
+
+    for (int i = 0; i < n; i += 4) {
+        float32x4_t m0 = vld1q_f32(s + i);
+        m0 = vminq_f32(m0, exp_hi);
+        m0 = vmaxq_f32(m0, exp_lo);
+        m0 = mla_f32(e0_bias, m0, e0_mult);
+
+        vst1q_s32((int32_t *)(s + i), vcvtq_s32_f32(m0));
+    }
+}
+
+
+void e1_m16_neon(float *s, const intptr_t n) {
+    const float32x4_t e1_scale = vdupq_n_f32(1.4426950409f); // 1/ln(2)
+    const float32x4_t e1_round = vdupq_n_f32(128.5f);
+    const int32x4_t e1_offset = vdupq_n_s32(128);
+    const int32x4_t e1_exp_bias = vdupq_n_s32(127);
+    const float32x4_t e1_c0 = vdupq_n_f32(1.00035f);
+    const float32x4_t e1_c1 = vdupq_n_f32(0.701277797f);
+    const float32x4_t e1_c2 = vdupq_n_f32(0.237348593f);
+
+    for (int i = 0; i < n; i += 4) {
+        float32x4_t m0 = vld1q_f32(s + i);
+        m0 = vminq_f32(m0, exp_hi);
+        m0 = vmaxq_f32(m0, exp_lo);
+        m0 = vmulq_f32(m0, e1_scale);
+
+        // Same as the C version: round to nearest, halfway cases up.
+        int32x4_t i0 = vsubq_s32(vcvtq_s32_f32(vaddq_f32(m0, e1_round)), e1_offset);
+        m0 = vsubq_f32(m0, vcvtq_f32_s32(i0));
+
+        float32x4_t m1 = mla_f32(e1_c1, m0, e1_c2);
+        m1 = mla_f32(e1_c0, m1, m0);
+
+        i0 = vshlq_n_s32(vaddq_s32(i0, e1_exp_bias), 23);
+        vst1q_f32(s + i, vmulq_f32(m1, vreinterpretq_f32_s32(i0)));
+    }
+}
+
+
+// exp from Intel Approximate Math (AM) Library, like nnedi3_e2_m16_SSE2.
+void e2_m16_neon(float *s, const intptr_t n) {
+    const float32x4_t am_0p5 = vdupq_n_f32(0.5f);
+    const float32x4_t exp_rln2 = vdupq_n_f32(1.442695041f);
+    const float32x4_t exp_p0 = vdupq_n_f32(1.261771931e-4f);
+    const float32x4_t exp_p1 = vdupq_n_f32(3.029944077e-2f);
+    const float32x4_t exp_q0 = vdupq_n_f32(3.001985051e-6f);
+    const float32x4_t exp_q1 = vdupq_n_f32(2.524483403e-3f);
+    const float32x4_t exp_q2 = vdupq_n_f32(2.272655482e-1f);
+    const float32x4_t exp_q3 = vdupq_n_f32(2.0f);
+    const float32x4_t exp_c1 = vdupq_n_f32(6.931457520e-1f);
+    const float32x4_t exp_c2 = vdupq_n_f32(1.428606820e-6f);
+    const int32x4_t epi32_1 = vdupq_n_s32(1);
+    const int32x4_t epi32_0x7f = vdupq_n_s32(0x7f);
+
+    for (int i = 0; i < n; i += 4) {
+        float32x4_t m0 = vld1q_f32(s + i);
+        m0 = vminq_f32(m0, exp_hi);
+        m0 = vmaxq_f32(m0, exp_lo);
+
+        // floor(x / ln(2) + 0.5)
+        float32x4_t m1 = mla_f32(am_0p5, m0, exp_rln2);
+        int32x4_t i1 = vcvtq_s32_f32(m1);
+        i1 = vsubq_s32(i1, vandq_s32(vreinterpretq_s32_u32(vcleq_f32(m1, zeroes_f)), epi32_1));
+
+        float32x4_t m3 = vcvtq_f32_s32(i1);
+        m0 = vsubq_f32(m0, vmulq_f32(m3, exp_c2));
+        m0 = vsubq_f32(m0, vmulq_f32(m3, exp_c1));
+
+        float32x4_t m2 = vmulq_f32(m0, m0);
+
+        float32x4_t p = mla_f32(exp_p1, m2, exp_p0);
+        p = vmulq_f32(vmulq_f32(p, m2), m0);
+        p = vaddq_f32(p, m0);
+
+        float32x4_t q = mla_f32(exp_q1, m2, exp_q0);
+        q = mla_f32(exp_q2, q, m2);
+        q = mla_f32(exp_q3, q, m2);
+
+        m0 = vmulq_f32(p, reciprocal(vsubq_f32(q, p)));
+        m0 = vaddq_f32(ones_f, vaddq_f32(m0, m0));
+
+        i1 = vshlq_n_s32(vaddq_s32(i1, epi32_0x7f), 23);
+        vst1q_f32(s + i, vmulq_f32(m0, vreinterpretq_f32_s32(i1)));
+    }
+}
+
+
+void weightedAvgElliottMul5_m16_neon(const float *w, const intptr_t n, float *mstd) {
+    float32x4_t vsum0 = zeroes_f;
+    float32x4_t vsum1 = zeroes_f;
+    float32x4_t wsum0 = zeroes_f;
+    float32x4_t wsum1 = zeroes_f;
+
+    for (int i = 0; i < n; i += 8) {
+        float32x4_t w0 = vld1q_f32(w + i);
+        float32x4_t w1 = vld1q_f32(w + i + 4);
+        float32x4_t v0 = vld1q_f32(w + n + i);
+        float32x4_t v1 = vld1q_f32(w + n + i + 4);
+
+        wsum0 = vaddq_f32(wsum0, w0);
+        wsum1 = vaddq_f32(wsum1, w1);
+
+        // elliott
+        v0 = vmulq_f32(v0, reciprocal(vaddq_f32(vabsq_f32(v0), ones_f)));
+        v1 = vmulq_f32(v1, reciprocal(vaddq_f32(vabsq_f32(v1), ones_f)));
+
+        vsum0 = mla_f32(vsum0, w0, v0);
+        vsum1 = mla_f32(vsum1, w1, v1);
+    }
+
+    const float vsum = hsum_f32(vaddq_f32(vsum0, vsum1));
+    const float wsum = hsum_f32(vaddq_f32(wsum0, wsum1));
+
+    const float min_weight_sum = 1e-10f;
+
+    if (wsum > min_weight_sum)
+        mstd[3] += ((5.0f * vsum) / wsum) * mstd[1] + mstd[0];
+    else
+        mstd[3] += mstd[0];
+}
+
+
+// The extract functions calculate the mean and the standard deviation
+// exactly like the C versions, so the integer sums are exact.
+
+
+// Finishes extract_m8_neon and extract_m8_i16_neon.
+static inline __attribute__((always_inline)) void mstd_i16(int64_t sum, int64_t sumsq, const intptr_t xdia, const intptr_t ydia, float *mstd) {
+    const float scale = 1.0f / (float)(xdia * ydia);
+    mstd[0] = sum * scale;
+    mstd[1] = (float)((double)sumsq * scale - mstd[0] * mstd[0]);
+    mstd[3] = 0.0f;
+    if (mstd[1] <= FLT_EPSILON) {
+        mstd[1] = mstd[2] = 0.0f;
+    } else {
+        mstd[1] = sqrtf(mstd[1]);
+        mstd[2] = 1.0f / mstd[1];
+    }
+}
+
+
+static inline __attribute__((always_inline)) void mstd_float(float mean, double variance, float *mstd) {
+    mstd[0] = mean;
+    mstd[3] = 0.0f;
+    if (variance <= FLT_EPSILON) {
+        mstd[1] = mstd[2] = 0.0f;
+    } else {
+        mstd[1] = (float)sqrt(variance);
+        mstd[2] = 1.0f / mstd[1];
+    }
+}
+
+
+void extract_m8_neon(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input) {
+    uint32x4_t sum = vdupq_n_u32(0);
+    uint32x4_t sumsq = sum;
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            uint16x8_t m0 = vmovl_u8(vld1_u8(srcp + x));
+
+            sum = vpadalq_u16(sum, m0);
+            sumsq = vmlal_u16(sumsq, vget_low_u16(m0), vget_low_u16(m0));
+            sumsq = vmlal_u16(sumsq, vget_high_u16(m0), vget_high_u16(m0));
+
+            vst1q_f32(input + x, vcvtq_f32_u32(vmovl_u16(vget_low_u16(m0))));
+            vst1q_f32(input + x + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(m0))));
         }
 
-        int32x2_t sum0 = vpadd_s32(vget_low_s32(accum0), vget_high_s32(accum0));
-        int32x2_t sum1 = vpadd_s32(vget_low_s32(accum1), vget_high_s32(accum1));
-        int32x2_t sum2 = vpadd_s32(vget_low_s32(accum2), vget_high_s32(accum2));
-        int32x2_t sum3 = vpadd_s32(vget_low_s32(accum3), vget_high_s32(accum3));
-        sum0 = vpadd_s32(sum0, sum1);
-        sum1 = vpadd_s32(sum2, sum3);
-        int32x4_t sum = vcombine_s32(sum0, sum1);
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    const float scale = 1.0f / (xdia * ydia);
+    const float mean = (int32_t)hsum_u32(sum) * scale;
+    const float variance = (float)(int32_t)hsum_u32(sumsq) * scale - mean * mean;
 
-        float32x4_t val = vcvtq_f32_s32(sum);
-        val = vmulq_f32(val, vld1q_f32(weightsf + i*2));
-        val = vmulq_n_f32(val, istd[0]);
-        val = vaddq_f32(val, vld1q_f32(weightsf + i*2 + 4));
-        vst1q_f32(vals + i, val);
+    mstd_float(mean, variance, mstd);
+}
+
+
+void extract_m8_i16_neon(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    uint16_t *input = (uint16_t *)inputf;
+
+    uint32x4_t sum = vdupq_n_u32(0);
+    uint32x4_t sumsq = sum;
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            uint16x8_t m0 = vmovl_u8(vld1_u8(srcp + x));
+
+            sum = vpadalq_u16(sum, m0);
+            sumsq = vmlal_u16(sumsq, vget_low_u16(m0), vget_low_u16(m0));
+            sumsq = vmlal_u16(sumsq, vget_high_u16(m0), vget_high_u16(m0));
+
+            vst1q_u16(input + x, m0);
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    mstd_i16(hsum_u32(sum), hsum_u32(sumsq), xdia, ydia, mstd);
+}
+
+
+// The squares of 16 bit pixels need 32 bits each, so they are summed
+// in 64 bit lanes.
+// With store_input = 0, only mstd is calculated.
+static inline void extract_m8_word(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input, const int store_input) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+
+    uint32x4_t sum = vdupq_n_u32(0);
+    uint64x2_t sumsq = vdupq_n_u64(0);
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            uint16x8_t m0 = vld1q_u16(srcp + x);
+
+            sum = vpadalq_u16(sum, m0);
+            sumsq = vpadalq_u32(sumsq, vmull_u16(vget_low_u16(m0), vget_low_u16(m0)));
+            sumsq = vpadalq_u32(sumsq, vmull_u16(vget_high_u16(m0), vget_high_u16(m0)));
+
+            if (store_input) {
+                vst1q_f32(input + x, vcvtq_f32_u32(vmovl_u16(vget_low_u16(m0))));
+                vst1q_f32(input + x + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(m0))));
+            }
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    const float scale = 1.0f / (xdia * ydia);
+    const float mean = (int64_t)hsum_u32(sum) * scale;
+    const double variance = (double)(int64_t)hsum_u64(sumsq) * scale - (double)mean * mean;
+
+    mstd_float(mean, variance, mstd);
+}
+
+
+void extract_m8_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input) {
+    extract_m8_word(srcp8, stride, xdia, ydia, mstd, input, 1);
+}
+
+
+// For more than 12 bits per sample, with the int16 dotProd functions.
+// The pixels minus the mean are shifted right like in
+// extract_m8_i16_shift_C, which rounds the same way as vrshlq_s32.
+void extract_m8_i16_shift_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+    int16_t *input = (int16_t *)inputf;
+
+    extract_m8_word(srcp8, stride, xdia, ydia, mstd, inputf, 0);
+
+    int shift = 0;
+    while (mstd[1] * (float)(xdia * ydia) >= (float)(32768 << shift))
+        shift++;
+
+    const int32x4_t mean = vdupq_n_s32((int)(mstd[0] + 0.5f));
+    const int32x4_t count = vdupq_n_s32(-shift);
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            uint16x8_t m0 = vld1q_u16(srcp + x);
+
+            int32x4_t m1 = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(m0))), mean);
+            int32x4_t m2 = vsubq_s32(vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(m0))), mean);
+
+            m1 = vrshlq_s32(m1, count);
+            m2 = vrshlq_s32(m2, count);
+
+            vst1q_s16(input + x, vcombine_s16(vmovn_s32(m1), vmovn_s32(m2)));
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    mstd[2] *= (float)(1 << shift);
+}
+
+
+// Only used with up to 12 bits per sample.
+void extract_m8_i16_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+    uint16_t *input = (uint16_t *)inputf;
+
+    uint32x4_t sum = vdupq_n_u32(0);
+    uint64x2_t sumsq = vdupq_n_u64(0);
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            uint16x8_t m0 = vld1q_u16(srcp + x);
+
+            sum = vpadalq_u16(sum, m0);
+            sumsq = vpadalq_u32(sumsq, vmull_u16(vget_low_u16(m0), vget_low_u16(m0)));
+            sumsq = vpadalq_u32(sumsq, vmull_u16(vget_high_u16(m0), vget_high_u16(m0)));
+
+            vst1q_u16(input + x, m0);
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    mstd_i16(hsum_u32(sum), hsum_u64(sumsq), xdia, ydia, mstd);
+}
+
+
+// The C version sums in double precision. Here every lane keeps
+// compensated (Kahan) sums instead, which are only combined in double
+// precision at the end.
+void extract_m8_float_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input) {
+    const float *srcp = (const float *)srcp8;
+
+    float32x4_t sum = zeroes_f, sum_c = zeroes_f;
+    float32x4_t sumsq = zeroes_f, sumsq_c = zeroes_f;
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 4) {
+            float32x4_t m0 = vld1q_f32(srcp + x);
+
+            float32x4_t m1 = vsubq_f32(m0, sum_c);
+            float32x4_t m2 = vaddq_f32(sum, m1);
+            sum_c = vsubq_f32(vsubq_f32(m2, sum), m1);
+            sum = m2;
+
+            m1 = vsubq_f32(vmulq_f32(m0, m0), sumsq_c);
+            m2 = vaddq_f32(sumsq, m1);
+            sumsq_c = vsubq_f32(vsubq_f32(m2, sumsq), m1);
+            sumsq = m2;
+
+            vst1q_f32(input + x, m0);
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    float lanes[4], lanes_c[4], lanes_sq[4], lanes_sq_c[4];
+    vst1q_f32(lanes, sum);
+    vst1q_f32(lanes_c, sum_c);
+    vst1q_f32(lanes_sq, sumsq);
+    vst1q_f32(lanes_sq_c, sumsq_c);
+
+    double dsum = 0.0, dsumsq = 0.0;
+    for (int i = 0; i < 4; i++) {
+        dsum += (double)lanes[i] - lanes_c[i];
+        dsumsq += (double)lanes_sq[i] - lanes_sq_c[i];
+    }
+
+    const float scale = 1.0f / (xdia * ydia);
+    const float mean = dsum * scale;
+    const double variance = dsumsq * scale - (double)mean * mean;
+
+    mstd_float(mean, variance, mstd);
+}
+
+
+// Like extract_m8_word_neon, without the sums.
+void copyInput_m8_word_neon(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *input) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            uint16x8_t m0 = vld1q_u16(srcp + x);
+
+            vst1q_f32(input + x, vcvtq_f32_u32(vmovl_u16(vget_low_u16(m0))));
+            vst1q_f32(input + x + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(m0))));
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+}
+
+
+int32_t processLine0_neon(const uint8_t *tempu, int width, uint8_t *dstp, const uint8_t *src3p, const int src_pitch, const int max_value) {
+    const uint16x8_t word_19 = vdupq_n_u16(19);
+    const uint16x8_t word_3 = vdupq_n_u16(3);
+    const uint8x16_t byte_1 = vdupq_n_u8(1);
+    const uint8x16_t byte_254 = vdupq_n_u8(254);
+
+    uint16x8_t accum = vdupq_n_u16(0);
+
+    int x;
+    for (x = 0; x + 16 <= width; x += 16) {
+        uint8x16_t m0 = vld1q_u8(src3p + x);
+        uint8x16_t m1 = vld1q_u8(src3p + x + src_pitch * 2);
+        uint8x16_t m2 = vld1q_u8(src3p + x + src_pitch * 4);
+        uint8x16_t m3 = vld1q_u8(src3p + x + src_pitch * 6);
+
+        uint16x8_t lo = vmulq_u16(vaddl_u8(vget_low_u8(m1), vget_low_u8(m2)), word_19);
+        uint16x8_t hi = vmulq_u16(vaddl_u8(vget_high_u8(m1), vget_high_u8(m2)), word_19);
+
+        // Negative values are clamped to 0 by the saturating subtraction.
+        lo = vqsubq_u16(lo, vmulq_u16(vaddl_u8(vget_low_u8(m0), vget_low_u8(m3)), word_3));
+        hi = vqsubq_u16(hi, vmulq_u16(vaddl_u8(vget_high_u8(m0), vget_high_u8(m3)), word_3));
+
+        uint8x16_t result = vcombine_u8(vqrshrn_n_u16(lo, 5), vqrshrn_n_u16(hi, 5));
+        result = vminq_u8(result, byte_254);
+
+        uint8x16_t skip = vceqq_u8(vld1q_u8(tempu + x), vdupq_n_u8(0));
+
+        vst1q_u8(dstp + x, vorrq_u8(result, skip));
+
+        accum = vpadalq_u8(accum, vandq_u8(skip, byte_1));
+    }
+
+    int32_t count = hsum_u32(vpaddlq_u16(accum));
+
+    for (; x < width; x++) {
+        if (tempu[x]) {
+            int tmp = 19 * (src3p[x + src_pitch * 2] + src3p[x + src_pitch * 4]) - 3 * (src3p[x] + src3p[x + src_pitch * 6]);
+            tmp = (tmp + 16) / 32;
+            dstp[x] = tmp < 0 ? 0 : (tmp > 254 ? 254 : tmp);
+        } else {
+            dstp[x] = 255;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+int32_t processLine0_word_neon(const uint8_t *tempu, int width, uint8_t *dstp8, const uint8_t *src3p8, const int src_pitch, const int max_value) {
+    uint16_t *dstp = (uint16_t *)dstp8;
+    const uint16_t *src3p = (const uint16_t *)src3p8;
+
+    const int32x4_t maximum = vdupq_n_s32(max_value - 1);
+    const uint8x8_t byte_1 = vdup_n_u8(1);
+
+    uint16x4_t accum = vdup_n_u16(0);
+
+    int x;
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t m0 = vld1q_u16(src3p + x);
+        uint16x8_t m1 = vld1q_u16(src3p + x + src_pitch * 2);
+        uint16x8_t m2 = vld1q_u16(src3p + x + src_pitch * 4);
+        uint16x8_t m3 = vld1q_u16(src3p + x + src_pitch * 6);
+
+        int32x4_t lo = vreinterpretq_s32_u32(vmulq_n_u32(vaddl_u16(vget_low_u16(m1), vget_low_u16(m2)), 19));
+        int32x4_t hi = vreinterpretq_s32_u32(vmulq_n_u32(vaddl_u16(vget_high_u16(m1), vget_high_u16(m2)), 19));
+
+        lo = vsubq_s32(lo, vreinterpretq_s32_u32(vmulq_n_u32(vaddl_u16(vget_low_u16(m0), vget_low_u16(m3)), 3)));
+        hi = vsubq_s32(hi, vreinterpretq_s32_u32(vmulq_n_u32(vaddl_u16(vget_high_u16(m0), vget_high_u16(m3)), 3)));
+
+        // The rounding shift differs from the C division only for
+        // negative values, which are clamped to 0 anyway.
+        lo = vminq_s32(vrshrq_n_s32(lo, 5), maximum);
+        hi = vminq_s32(vrshrq_n_s32(hi, 5), maximum);
+
+        uint16x8_t result = vcombine_u16(vqmovun_s32(lo), vqmovun_s32(hi));
+
+        uint8x8_t skip = vceq_u8(vld1_u8(tempu + x), vdup_n_u8(0));
+
+        vst1q_u16(dstp + x, vorrq_u16(result, vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(skip)))));
+
+        accum = vpadal_u8(accum, vand_u8(skip, byte_1));
+    }
+
+    int32_t count = hsum_u32(vmovl_u16(accum));
+
+    for (; x < width; x++) {
+        if (tempu[x]) {
+            int tmp = 19 * (src3p[x + src_pitch * 2] + src3p[x + src_pitch * 4]) - 3 * (src3p[x] + src3p[x + src_pitch * 6]);
+            tmp = (tmp + 16) / 32;
+            dstp[x] = tmp < 0 ? 0 : (tmp > max_value - 1 ? max_value - 1 : tmp);
+        } else {
+            dstp[x] = 65535;
+            count++;
+        }
     }
+
+    return count;
+}
+
+
+int32_t processLine0_float_neon(const uint8_t *tempu, int width, uint8_t *dstp8, const uint8_t *src3p8, const int src_pitch, const int max_value) {
+    float *dstp = (float *)dstp8;
+    const float *src3p = (const float *)src3p8;
+
+    const float32x4_t float_19 = vdupq_n_f32(19.0f);
+    const float32x4_t float_3 = vdupq_n_f32(3.0f);
+    const uint32x4_t dword_1 = vdupq_n_u32(1);
+
+    uint32x4_t accum = vdupq_n_u32(0);
+
+    int x;
+    for (x = 0; x + 4 <= width; x += 4) {
+        float32x4_t m0 = vaddq_f32(vld1q_f32(src3p + x + src_pitch * 2), vld1q_f32(src3p + x + src_pitch * 4));
+        float32x4_t m1 = vaddq_f32(vld1q_f32(src3p + x), vld1q_f32(src3p + x + src_pitch * 6));
+
+        m0 = vsubq_f32(vmulq_f32(m0, float_19), vmulq_f32(m1, float_3));
+        m0 = vmulq_n_f32(m0, 1.0f / 32.0f);
+
+        uint8x8_t t = vreinterpret_u8_u32(vld1_lane_u32((const uint32_t *)(tempu + x), vdup_n_u32(0), 0));
+        uint32x4_t skip = vceqq_u32(vmovl_u16(vget_low_u16(vmovl_u8(t))), vdupq_n_u32(0));
+
+        vst1q_f32(dstp + x, vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(m0), skip)));
+
+        accum = vaddq_u32(accum, vandq_u32(skip, dword_1));
+    }
+
+    int32_t count = hsum_u32(accum);
+
+    for (; x < width; x++) {
+        if (tempu[x]) {
+            dstp[x] = (19 * (src3p[x + src_pitch * 2] + src3p[x + src_pitch * 4]) - 3 * (src3p[x] + src3p[x + src_pitch * 6])) / 32;
+        } else {
+            memset(dstp + x, 255, sizeof(float));
+            count++;
+        }
+    }
+
+    return count;
 }
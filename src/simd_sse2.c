@@ -1,4 +1,5 @@
 #include <float.h>
+#include <math.h>
 #include <stdint.h>
 #include <string.h>
 #include <emmintrin.h>
@@ -161,6 +162,87 @@ void nnedi3_byte2word64_SSE2(const uint8_t *t, const intptr_t pitch, float *pf)
 }
 
 
+void nnedi3_float2float48_SSE2(const uint8_t *t, const intptr_t pitch, float *p) {
+    for (int i = 0; i < 4; i++) {
+        _mm_store_ps(p, _mm_loadu_ps((const float *)t));
+        _mm_store_ps(p + 4, _mm_loadu_ps((const float *)t + 4));
+        _mm_store_ps(p + 8, _mm_loadu_ps((const float *)t + 8));
+
+        p += 12;
+        t += pitch * 8;
+    }
+}
+
+
+// 16 bit input is shifted right by one so that it fits in int16_t.
+static inline void nnedi3_word2word(const uint8_t *t, const intptr_t pitch, float *pf, const int width, const int shift) {
+    uint8_t *p = (uint8_t *)pf;
+
+    __m128i count = _mm_cvtsi32_si128(shift);
+
+    for (int i = 0; i < 4; i++) {
+        __m128i m0 = _mm_loadu_si128((const __m128i *)t);
+        _mm_storeu_si128((__m128i *)p, _mm_srl_epi16(m0, count));
+
+        if (width == 16) {
+            __m128i m1 = _mm_loadu_si128((const __m128i *)(t + 16));
+            _mm_storeu_si128((__m128i *)(p + 16), _mm_srl_epi16(m1, count));
+        } else {
+            __m128i m1 = _mm_loadl_epi64((const __m128i *)(t + 16));
+            _mm_storel_epi64((__m128i *)(p + 16), _mm_srl_epi16(m1, count));
+        }
+
+        p += width * 2;
+        t += pitch * 4;
+    }
+}
+
+
+void nnedi3_word2word48_SSE2(const uint8_t *t, const intptr_t pitch, float *pf) {
+    nnedi3_word2word(t, pitch, pf, 12, 0);
+}
+
+
+void nnedi3_word2word48_shift_SSE2(const uint8_t *t, const intptr_t pitch, float *pf) {
+    nnedi3_word2word(t, pitch, pf, 12, 1);
+}
+
+
+void nnedi3_word2word64_SSE2(const uint8_t *t, const intptr_t pitch, float *pf) {
+    nnedi3_word2word(t, pitch, pf, 16, 0);
+}
+
+
+void nnedi3_word2word64_shift_SSE2(const uint8_t *t, const intptr_t pitch, float *pf) {
+    nnedi3_word2word(t, pitch, pf, 16, 1);
+}
+
+
+// Float input is scaled so that 0..1 maps to 0..32767.
+void nnedi3_float2word64_SSE2(const uint8_t *t, const intptr_t pitch, float *pf) {
+    uint8_t *p = (uint8_t *)pf;
+
+    __m128 scale = _mm_set1_ps(32767.0f);
+    __m128 minimum = _mm_set1_ps(-32768.0f);
+    __m128 maximum = _mm_set1_ps(32767.0f);
+
+    for (int i = 0; i < 4; i++) {
+        __m128i m0, m1, m2, m3;
+
+        m0 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float *)t), scale), minimum), maximum));
+        m1 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float *)t + 4), scale), minimum), maximum));
+        m2 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float *)t + 8), scale), minimum), maximum));
+        m3 = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float *)t + 12), scale), minimum), maximum));
+
+        _mm_store_si128((__m128i *)p, _mm_packs_epi32(m0, m1));
+        _mm_store_si128((__m128i *)(p + 16), _mm_packs_epi32(m2, m3));
+
+        p += 32;
+        t += pitch * 8;
+    }
+}
+
+
 int32_t nnedi3_processLine0_SSE2(const uint8_t *tempu, intptr_t width, uint8_t *dstp, const uint8_t *src3p, const intptr_t src_pitch) {
     __m128i zero = _mm_setzero_si128();
 
@@ -339,7 +421,8 @@ void nnedi3_extract_m8_SSE2(const uint8_t *srcp, const intptr_t stride, const in
 }
 
 
-void nnedi3_extract_m8_i16_SSE2(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+// The pixels are stored as int16_t when bytes is 2, and as they are when bytes is 1.
+static inline void nnedi3_extract_m8_8bit(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf, const int bytes) {
     uint8_t *input = (uint8_t *)inputf;
 
     __m128i zero = _mm_setzero_si128();
@@ -355,14 +438,21 @@ void nnedi3_extract_m8_i16_SSE2(const uint8_t *srcp, const intptr_t stride, cons
             __m128i m2 = m0;
             __m128i m3 = m1;
 
+            if (bytes == 1) {
+                _mm_storel_epi64((__m128i *)(input + x), m0);
+                _mm_storel_epi64((__m128i *)(input + xdia + x), m1);
+            }
+
             m0 = _mm_unpacklo_epi8(m0, zero);
             m1 = _mm_unpacklo_epi8(m1, zero);
 
             m2 = _mm_sad_epu8(m2, zero);
             m3 = _mm_sad_epu8(m3, zero);
 
-            _mm_store_si128((__m128i *)(input + x * 2), m0);
-            _mm_store_si128((__m128i *)(input + xdia * 2 + x * 2), m1);
+            if (bytes == 2) {
+                _mm_store_si128((__m128i *)(input + x * 2), m0);
+                _mm_store_si128((__m128i *)(input + xdia * 2 + x * 2), m1);
+            }
 
             m0 = _mm_madd_epi16(m0, m0);
             m1 = _mm_madd_epi16(m1, m1);
@@ -375,7 +465,7 @@ void nnedi3_extract_m8_i16_SSE2(const uint8_t *srcp, const intptr_t stride, cons
         }
 
         srcp += stride * 4;
-        input += xdia * 4;
+        input += xdia * 2 * bytes;
     }
 
     __m128i m4 = _mm_setzero_si128();
@@ -411,6 +501,322 @@ void nnedi3_extract_m8_i16_SSE2(const uint8_t *srcp, const intptr_t stride, cons
 }
 
 
+void nnedi3_extract_m8_i16_SSE2(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    nnedi3_extract_m8_8bit(srcp, stride, xdia, ydia, mstd, inputf, 2);
+}
+
+
+void nnedi3_extract_m8_i8_SSE2(const uint8_t *srcp, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    nnedi3_extract_m8_8bit(srcp, stride, xdia, ydia, mstd, inputf, 1);
+}
+
+
+// width must be a multiple of 8.
+int32_t nnedi3_processLine0_word_SSE2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value) {
+    const uint16_t *src3p = (const uint16_t *)src3p8;
+    uint16_t *dstp = (uint16_t *)dstp8;
+
+    __m128i zero = _mm_setzero_si128();
+
+    __m128i dword_16 = _mm_set1_epi32(16);
+    __m128i dword_32768 = _mm_set1_epi32(32768);
+    __m128i word_32768 = _mm_set1_epi16(-32768);
+    __m128i maximum = _mm_set1_epi32(max_value - 1);
+
+    int32_t count = 0;
+
+    for (int x = 0; x < width; x += 8) {
+        __m128i m0 = _mm_loadu_si128((const __m128i *)(src3p + x));
+        __m128i m1 = _mm_loadu_si128((const __m128i *)(src3p + x + src_pitch * 2));
+        __m128i m2 = _mm_loadu_si128((const __m128i *)(src3p + x + src_pitch * 4));
+        __m128i m3 = _mm_loadu_si128((const __m128i *)(src3p + x + src_pitch * 6));
+
+        __m128i m4 = _mm_add_epi32(_mm_unpacklo_epi16(m1, zero), _mm_unpacklo_epi16(m2, zero));
+        __m128i m5 = _mm_add_epi32(_mm_unpackhi_epi16(m1, zero), _mm_unpackhi_epi16(m2, zero));
+        __m128i m6 = _mm_add_epi32(_mm_unpacklo_epi16(m0, zero), _mm_unpacklo_epi16(m3, zero));
+        __m128i m7 = _mm_add_epi32(_mm_unpackhi_epi16(m0, zero), _mm_unpackhi_epi16(m3, zero));
+
+        // There is no pmulld in SSE2. 19 * x = 16 * x + 2 * x + x, 3 * x = 2 * x + x
+        m4 = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(m4, 4), _mm_slli_epi32(m4, 1)), m4);
+        m5 = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(m5, 4), _mm_slli_epi32(m5, 1)), m5);
+        m6 = _mm_add_epi32(_mm_slli_epi32(m6, 1), m6);
+        m7 = _mm_add_epi32(_mm_slli_epi32(m7, 1), m7);
+
+        m4 = _mm_srai_epi32(_mm_add_epi32(_mm_sub_epi32(m4, m6), dword_16), 5);
+        m5 = _mm_srai_epi32(_mm_add_epi32(_mm_sub_epi32(m5, m7), dword_16), 5);
+
+        // Clamp to [0, max_value - 1].
+        m4 = _mm_and_si128(m4, _mm_cmpgt_epi32(m4, zero));
+        m5 = _mm_and_si128(m5, _mm_cmpgt_epi32(m5, zero));
+
+        m6 = _mm_cmpgt_epi32(m4, maximum);
+        m7 = _mm_cmpgt_epi32(m5, maximum);
+        m4 = _mm_or_si128(_mm_and_si128(m6, maximum), _mm_andnot_si128(m6, m4));
+        m5 = _mm_or_si128(_mm_and_si128(m7, maximum), _mm_andnot_si128(m7, m5));
+
+        // There is no packusdw in SSE2 either.
+        m4 = _mm_sub_epi32(m4, dword_32768);
+        m5 = _mm_sub_epi32(m5, dword_32768);
+        m4 = _mm_xor_si128(_mm_packs_epi32(m4, m5), word_32768);
+
+        __m128i m8 = _mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i *)(tempu + x)), zero);
+
+        m4 = _mm_or_si128(m4, _mm_unpacklo_epi8(m8, m8));
+        _mm_storeu_si128((__m128i *)(dstp + x), m4);
+
+        count += __builtin_popcount(_mm_movemask_epi8(m8) & 0xff);
+    }
+
+    return count;
+}
+
+
+// width must be a multiple of 4.
+int32_t nnedi3_processLine0_float_SSE2(const uint8_t *tempu, intptr_t width, uint8_t *dstp8, const uint8_t *src3p8, const intptr_t src_pitch, const int max_value) {
+    const float *src3p = (const float *)src3p8;
+    float *dstp = (float *)dstp8;
+
+    __m128i zero = _mm_setzero_si128();
+
+    __m128 float_19 = _mm_set1_ps(19.0f);
+    __m128 float_3 = _mm_set1_ps(3.0f);
+    __m128 float_1_32 = _mm_set1_ps(1.0f / 32.0f);
+
+    int32_t count = 0;
+
+    for (int x = 0; x < width; x += 4) {
+        __m128 m0 = _mm_add_ps(_mm_loadu_ps(src3p + x + src_pitch * 2), _mm_loadu_ps(src3p + x + src_pitch * 4));
+        __m128 m1 = _mm_add_ps(_mm_loadu_ps(src3p + x), _mm_loadu_ps(src3p + x + src_pitch * 6));
+
+        m0 = _mm_sub_ps(_mm_mul_ps(m0, float_19), _mm_mul_ps(m1, float_3));
+        m0 = _mm_mul_ps(m0, float_1_32);
+
+        __m128i m2 = _mm_cmpeq_epi8(_mm_cvtsi32_si128(*(const int *)(tempu + x)), zero);
+        m2 = _mm_unpacklo_epi8(m2, m2);
+        m2 = _mm_unpacklo_epi16(m2, m2);
+
+        m0 = _mm_or_ps(m0, _mm_castsi128_ps(m2));
+        _mm_storeu_ps(dstp + x, m0);
+
+        count += __builtin_popcount(_mm_movemask_epi8(m2)) / 4;
+    }
+
+    return count;
+}
+
+
+// The C version sums in double precision. Here every lane keeps
+// compensated (Kahan) sums instead, which are only combined in double
+// precision at the end.
+void nnedi3_extract_m8_float_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input) {
+    const float *srcp = (const float *)srcp8;
+
+    __m128 sum = _mm_setzero_ps();
+    __m128 sum_c = _mm_setzero_ps();
+    __m128 sumsq = _mm_setzero_ps();
+    __m128 sumsq_c = _mm_setzero_ps();
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 4) {
+            __m128 m0 = _mm_loadu_ps(srcp + x);
+
+            _mm_store_ps(input + x, m0);
+
+            __m128 m1 = _mm_sub_ps(m0, sum_c);
+            __m128 m2 = _mm_add_ps(sum, m1);
+            sum_c = _mm_sub_ps(_mm_sub_ps(m2, sum), m1);
+            sum = m2;
+
+            m1 = _mm_sub_ps(_mm_mul_ps(m0, m0), sumsq_c);
+            m2 = _mm_add_ps(sumsq, m1);
+            sumsq_c = _mm_sub_ps(_mm_sub_ps(m2, sumsq), m1);
+            sumsq = m2;
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    nnedi3_mstd_float(sum, sum_c, sumsq, sumsq_c, xdia, ydia, mstd);
+}
+
+
+// The 16 bit extract functions calculate the mean and the standard
+// deviation exactly like the C versions.
+
+
+// With store_input = 0, only mstd is calculated.
+static inline void nnedi3_extract_m8_word(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input, const int store_input) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+
+    __m128i zero = _mm_setzero_si128();
+
+    __m128i sum = _mm_setzero_si128();
+    __m128i sumsq = _mm_setzero_si128();
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            __m128i m0 = _mm_loadu_si128((const __m128i *)(srcp + x));
+
+            __m128i m1 = _mm_unpacklo_epi16(m0, zero);
+            __m128i m2 = _mm_unpackhi_epi16(m0, zero);
+
+            if (store_input) {
+                _mm_store_ps(input + x, _mm_cvtepi32_ps(m1));
+                _mm_store_ps(input + x + 4, _mm_cvtepi32_ps(m2));
+            }
+
+            sum = _mm_add_epi32(sum, _mm_add_epi32(m1, m2));
+
+            // The squares need all 32 bits, so they are summed in 64 bit lanes.
+            __m128i m3 = _mm_mullo_epi16(m0, m0);
+            __m128i m4 = _mm_mulhi_epu16(m0, m0);
+
+            m1 = _mm_unpacklo_epi16(m3, m4);
+            m2 = _mm_unpackhi_epi16(m3, m4);
+
+            sumsq = _mm_add_epi64(sumsq, _mm_unpacklo_epi32(m1, zero));
+            sumsq = _mm_add_epi64(sumsq, _mm_unpackhi_epi32(m1, zero));
+            sumsq = _mm_add_epi64(sumsq, _mm_unpacklo_epi32(m2, zero));
+            sumsq = _mm_add_epi64(sumsq, _mm_unpackhi_epi32(m2, zero));
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    sumsq = _mm_add_epi64(sumsq, _mm_shuffle_epi32(sumsq, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    int64_t sumsq_i;
+    _mm_storel_epi64((__m128i *)&sumsq_i, sumsq);
+
+    const float scale = 1.0f / (xdia * ydia);
+    mstd[0] = (int64_t)_mm_cvtsi128_si32(sum) * scale;
+    const double tmp = (double)sumsq_i * scale - (double)mstd[0] * mstd[0];
+    mstd[3] = 0.0f;
+    if (tmp <= FLT_EPSILON) {
+        mstd[1] = mstd[2] = 0.0f;
+    } else {
+        mstd[1] = (float)sqrt(tmp);
+        mstd[2] = 1.0f / mstd[1];
+    }
+}
+
+
+void nnedi3_extract_m8_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *input) {
+    nnedi3_extract_m8_word(srcp8, stride, xdia, ydia, mstd, input, 1);
+}
+
+
+// For more than 12 bits per sample, with the int16 dotProd functions.
+// The pixels minus the mean are shifted right like in
+// extract_m8_i16_shift_C.
+void nnedi3_extract_m8_i16_shift_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+    int16_t *input = (int16_t *)inputf;
+
+    nnedi3_extract_m8_word(srcp8, stride, xdia, ydia, mstd, inputf, 0);
+
+    int shift = 0;
+    while (mstd[1] * (float)(xdia * ydia) >= (float)(32768 << shift))
+        shift++;
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i offset = _mm_set1_epi32(((1 << shift) >> 1) - (int)(mstd[0] + 0.5f));
+    __m128i count = _mm_cvtsi32_si128(shift);
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            __m128i m0 = _mm_loadu_si128((const __m128i *)(srcp + x));
+
+            __m128i m1 = _mm_add_epi32(_mm_unpacklo_epi16(m0, zero), offset);
+            __m128i m2 = _mm_add_epi32(_mm_unpackhi_epi16(m0, zero), offset);
+
+            m1 = _mm_sra_epi32(m1, count);
+            m2 = _mm_sra_epi32(m2, count);
+
+            _mm_store_si128((__m128i *)(input + x), _mm_packs_epi32(m1, m2));
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    mstd[2] *= (float)(1 << shift);
+}
+
+
+// Only used with up to 12 bits per sample, so pmaddwd can be used.
+void nnedi3_extract_m8_i16_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *mstd, float *inputf) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+    uint16_t *input = (uint16_t *)inputf;
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i word_1 = _mm_set1_epi16(1);
+
+    __m128i sum = _mm_setzero_si128();
+    __m128i sumsq = _mm_setzero_si128();
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            __m128i m0 = _mm_loadu_si128((const __m128i *)(srcp + x));
+
+            _mm_store_si128((__m128i *)(input + x), m0);
+
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(m0, word_1));
+
+            __m128i m1 = _mm_madd_epi16(m0, m0);
+
+            sumsq = _mm_add_epi64(sumsq, _mm_unpacklo_epi32(m1, zero));
+            sumsq = _mm_add_epi64(sumsq, _mm_unpackhi_epi32(m1, zero));
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    sumsq = _mm_add_epi64(sumsq, _mm_shuffle_epi32(sumsq, _MM_SHUFFLE(1, 0, 3, 2)));
+
+    int64_t sumsq_i;
+    _mm_storel_epi64((__m128i *)&sumsq_i, sumsq);
+
+    const float scale = 1.0f / (float)(xdia * ydia);
+    mstd[0] = (int64_t)_mm_cvtsi128_si32(sum) * scale;
+    mstd[1] = (float)((double)sumsq_i * scale - mstd[0] * mstd[0]);
+    mstd[3] = 0.0f;
+    if (mstd[1] <= FLT_EPSILON) {
+        mstd[1] = mstd[2] = 0.0f;
+    } else {
+        mstd[1] = sqrtf(mstd[1]);
+        mstd[2] = 1.0f / mstd[1];
+    }
+}
+
+
+// Like nnedi3_extract_m8_word_SSE2, without the sums.
+void nnedi3_copyInput_m8_word_SSE2(const uint8_t *srcp8, const intptr_t stride, const intptr_t xdia, const intptr_t ydia, float *input) {
+    const uint16_t *srcp = (const uint16_t *)srcp8;
+
+    __m128i zero = _mm_setzero_si128();
+
+    for (int y = 0; y < ydia; y++) {
+        for (int x = 0; x < xdia; x += 8) {
+            __m128i m0 = _mm_loadu_si128((const __m128i *)(srcp + x));
+
+            _mm_store_ps(input + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(m0, zero)));
+            _mm_store_ps(input + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(m0, zero)));
+        }
+
+        srcp += stride * 2;
+        input += xdia;
+    }
+}
+
+
 void nnedi3_computeNetwork0_SSE2(const float *input, const float *weights, uint8_t *d) {
     nnedi3_computeNetwork0(input, weights, d);
 }
@@ -615,260 +1021,10 @@ void nnedi3_computeNetwork0new_SSE2(const float *dataf, const float *weightsf, u
 }
 
 
-void nnedi3_weightedAvgElliottMul5_m16_SSE2(const float *w, const intptr_t n, float *mstd) {
-    __m128 wsum = _mm_setzero_ps();
-    __m128 vsum = _mm_setzero_ps();
-
-    for (int i = 0; i < n; i += 16) {
-        __m128 m0 = _mm_load_ps(w + i);
-        __m128 m1 = _mm_load_ps(w + i + 4);
-        __m128 m2 = _mm_load_ps(w + n + i);
-        __m128 m3 = _mm_load_ps(w + n + i + 4);
-
-        wsum = _mm_add_ps(wsum, m0);
-        wsum = _mm_add_ps(wsum, m1);
-
-        __m128 m4 = m2;
-        __m128 m5 = m3;
-
-        m2 = _mm_and_ps(m2, sign_bits_f);
-        m3 = _mm_and_ps(m3, sign_bits_f);
-
-        m2 = _mm_add_ps(m2, ones_f);
-        m3 = _mm_add_ps(m3, ones_f);
-
-        m2 = _mm_rcp_ps(m2);
-        m3 = _mm_rcp_ps(m3);
-
-        m4 = _mm_mul_ps(m4, m2);
-        m5 = _mm_mul_ps(m5, m3);
-
-        m4 = _mm_mul_ps(m4, m0);
-        m5 = _mm_mul_ps(m5, m1);
-
-        vsum = _mm_add_ps(vsum, m4);
-        vsum = _mm_add_ps(vsum, m5);
-
-
-        m0 = _mm_load_ps(w + i + 8);
-        m1 = _mm_load_ps(w + i + 12);
-        m2 = _mm_load_ps(w + n + i + 8);
-        m3 = _mm_load_ps(w + n + i + 12);
-
-        wsum = _mm_add_ps(wsum, m0);
-        wsum = _mm_add_ps(wsum, m1);
-
-        m4 = m2;
-        m5 = m3;
-
-        m2 = _mm_and_ps(m2, sign_bits_f);
-        m3 = _mm_and_ps(m3, sign_bits_f);
-
-        m2 = _mm_add_ps(m2, ones_f);
-        m3 = _mm_add_ps(m3, ones_f);
-
-        m2 = _mm_rcp_ps(m2);
-        m3 = _mm_rcp_ps(m3);
-
-        m4 = _mm_mul_ps(m4, m2);
-        m5 = _mm_mul_ps(m5, m3);
-
-        m4 = _mm_mul_ps(m4, m0);
-        m5 = _mm_mul_ps(m5, m1);
-
-        vsum = _mm_add_ps(vsum, m4);
-        vsum = _mm_add_ps(vsum, m5);
-    }
-
-    __m128 wsum_high = _mm_setzero_ps();
-    __m128 vsum_high = _mm_setzero_ps();
-    wsum_high = _mm_movehl_ps(wsum_high, wsum);
-    vsum_high = _mm_movehl_ps(vsum_high, vsum);
-
-    wsum = _mm_add_ps(wsum, wsum_high);
-    vsum = _mm_add_ps(vsum, vsum_high);
-
-    __m128 wsum_shuffled = _mm_castsi128_ps(_mm_shufflelo_epi16(_mm_castps_si128(wsum), 14));
-    __m128 vsum_shuffled = _mm_castsi128_ps(_mm_shufflelo_epi16(_mm_castps_si128(vsum), 14));
-
-    wsum = _mm_add_ss(wsum, wsum_shuffled);
-    vsum = _mm_add_ss(vsum, vsum_shuffled);
-
-    __m128 min_weight_sum = _mm_set_ss(1.0e-10f);
-
-    if (_mm_comile_ss(wsum, min_weight_sum)) {
-        mstd[3] += mstd[0];
-    } else {
-        vsum = _mm_mul_ss(vsum, _mm_set_ss(5.0f));
-        wsum = _mm_rcp_ss(wsum);
-        vsum = _mm_mul_ss(vsum, wsum);
-        vsum = _mm_mul_ss(vsum, _mm_load_ss(&mstd[1]));
-        vsum = _mm_add_ss(vsum, _mm_load_ss(&mstd[0]));
-        vsum = _mm_add_ss(vsum, _mm_load_ss(&mstd[3]));
-        _mm_store_ss(&mstd[3], vsum);
-    }
-}
-
-
-void nnedi3_e0_m16_SSE2(float *s, const intptr_t n) {
-    nnedi3_e0_m16(s, n);
-}
-
-
-void nnedi3_e1_m16_SSE2(float *s, const intptr_t n) {
-    __m128 e1_scale = _mm_set1_ps(1.4426950409f); // 1/ln(s)
-    __m128 e1_bias = _mm_set1_ps(12582912.0f); // 3 << 22
-    __m128 e1_c0 = _mm_set1_ps(1.00035f);
-    __m128 e1_c1 = _mm_set1_ps(0.701277797f);
-    __m128 e1_c2 = _mm_set1_ps(0.237348593f);
-
-    for (int i = 0; i < n; i += 8) {
-        __m128 m0 = _mm_load_ps(s + i);
-        __m128 m3 = _mm_load_ps(s + i + 4);
-
-        m0 = _mm_min_ps(m0, exp_hi);
-        m3 = _mm_min_ps(m3, exp_hi);
-        m0 = _mm_max_ps(m0, exp_lo);
-        m3 = _mm_max_ps(m3, exp_lo);
-        m0 = _mm_mul_ps(m0, e1_scale);
-        m3 = _mm_mul_ps(m3, e1_scale);
-
-        __m128 m1 = m0;
-        __m128 m4 = m3;
-
-        m0 = _mm_add_ps(m0, e1_bias);
-        m3 = _mm_add_ps(m3, e1_bias);
-
-        __m128 m2 = m0;
-        __m128 m5 = m3;
-
-        m0 = _mm_sub_ps(m0, e1_bias);
-        m3 = _mm_sub_ps(m3, e1_bias);
-
-        m2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(m2), 23));
-        m5 = _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(m5), 23));
-
-        m1 = _mm_sub_ps(m1, m0);
-        m4 = _mm_sub_ps(m4, m3);
-
-        m0 = m1;
-        m3 = m4;
-
-        m1 = _mm_mul_ps(m1, m1);
-        m4 = _mm_mul_ps(m4, m4);
-
-        m0 = _mm_mul_ps(m0, e1_c1);
-        m3 = _mm_mul_ps(m3, e1_c1);
-
-        m1 = _mm_mul_ps(m1, e1_c2);
-        m4 = _mm_mul_ps(m4, e1_c2);
-
-        m0 = _mm_add_ps(m0, e1_c0);
-        m3 = _mm_add_ps(m3, e1_c0);
-
-        m0 = _mm_add_ps(m0, m1);
-        m3 = _mm_add_ps(m3, m4);
-
-        m0 = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(m0), _mm_castps_si128(m2)));
-        m3 = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(m3), _mm_castps_si128(m5)));
-
-        _mm_store_ps(s + i, m0);
-        _mm_store_ps(s + i + 4, m3);
-    }
-}
-
-
-void nnedi3_e2_m16_SSE2(float *s, const intptr_t n) {
-    __m128 am_0p5 = _mm_set1_ps(0.5f);
-    __m128 am_1 = _mm_set1_ps(1.0f);
-    __m128 exp_rln2 = _mm_set1_ps(1.442695041f);
-    __m128 exp_p0 = _mm_set1_ps(1.261771931e-4f);
-    __m128 exp_p1 = _mm_set1_ps(3.029944077e-2f);
-    __m128 exp_q0 = _mm_set1_ps(3.001985051e-6f);
-    __m128 exp_q1 = _mm_set1_ps(2.524483403e-3f);
-    __m128 exp_q2 = _mm_set1_ps(2.272655482e-1f);
-    __m128 exp_q3 = _mm_set1_ps(2.0f);
-    __m128 exp_c1 = _mm_set1_ps(6.931457520e-1f);
-    __m128 exp_c2 = _mm_set1_ps(1.428606820e-6f);
-    __m128i epi32_1 = _mm_set1_epi32(1);
-    __m128i epi32_0x7f = _mm_set1_epi32(0x7f);
-
-    for (int i = 0; i < n; i += 4) {
-        __m128 m0 = _mm_load_ps(s + i);
-        m0 = _mm_min_ps(m0, exp_hi);
-        m0 = _mm_max_ps(m0, exp_lo);
-
-        __m128 m1 = exp_rln2;
-        m1 = _mm_mul_ps(m1, m0);
-        m1 = _mm_add_ps(m1, am_0p5);
-
-        __m128 m2 = _mm_setzero_ps();
-        m2 = _mm_cmpnlt_ps(m2, m1);
-        m2 = _mm_castsi128_ps(_mm_and_si128(_mm_castps_si128(m2), epi32_1));
-
-        m1 = _mm_castsi128_ps(_mm_cvttps_epi32(m1));
-        m1 = _mm_castsi128_ps(_mm_sub_epi32(_mm_castps_si128(m1), _mm_castps_si128(m2)));
-
-        __m128 m3 = _mm_cvtepi32_ps(_mm_castps_si128(m1));
-
-        __m128 m4 = exp_c2;
-        __m128 m5 = exp_c1;
-
-        m4 = _mm_mul_ps(m4, m3);
-        m5 = _mm_mul_ps(m5, m3);
-
-        m0 = _mm_sub_ps(m0, m4);
-        m0 = _mm_sub_ps(m0, m5);
-
-        __m128 m6 = exp_q0;
-        m4 = exp_p0;
-
-        m1 = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(m1), epi32_0x7f));
-
-        m2 = m0;
-
-        m0 = _mm_mul_ps(m0, m0);
-        m6 = _mm_mul_ps(m6, m0);
-        m4 = _mm_mul_ps(m4, m0);
-
-        m6 = _mm_add_ps(m6, exp_q1);
-        m4 = _mm_add_ps(m4, exp_p1);
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_SSE2_nsize, nnedi3_dotProd, );
 
-        m6 = _mm_mul_ps(m6, m0);
-        m4 = _mm_mul_ps(m4, m0);
 
-        m6 = _mm_add_ps(m6, exp_q2);
-
-        m4 = _mm_mul_ps(m4, m2);
-        m6 = _mm_mul_ps(m6, m0);
-
-        m0 = am_1;
-
-        m2 = _mm_add_ps(m2, m4);
-        m6 = _mm_add_ps(m6, exp_q3);
-
-        m1 = _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(m1), 23));
-
-        m6 = _mm_sub_ps(m6, m2);
-        m6 = _mm_rcp_ps(m6);
-
-        m2 = _mm_mul_ps(m2, m6);
-        m2 = _mm_add_ps(m2, m2);
-
-        m0 = _mm_add_ps(m0, m2);
-        m0 = _mm_mul_ps(m0, m1);
-
-        _mm_store_ps(s + i, m0);
-    }
-}
-
-
-void nnedi3_dotProd_SSE2(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
-    nnedi3_dotProd(data, weights, vals, n, len, istd);
-}
-
-
-void nnedi3_dotProd_i16_SSE2(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+static inline __attribute__((always_inline)) void dotProd_i16_SSE2(const float *dataf, const float *weightsf, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
     const uint8_t *data = (const uint8_t *)dataf;
     const uint8_t *weights = (const uint8_t *)weightsf;
 
@@ -922,3 +1078,5 @@ void nnedi3_dotProd_i16_SSE2(const float *dataf, const float *weightsf, float *v
         _mm_store_ps(vals + i, m9);
     }
 }
+
+NNEDI3_DOTPROD_NSIZES(nnedi3_dotProd_i16_SSE2_nsize, dotProd_i16_SSE2, );
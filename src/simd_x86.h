@@ -1,26 +1,30 @@
 #ifndef SIMD_X86_H
 #define SIMD_X86_H
 
+#include <float.h>
+#include <math.h>
 #include <stdint.h>
 #include <emmintrin.h>
 
+#include "simd_dotprod.h"
 
-#define exp_hi _mm_set1_ps(80.0f)
-#define exp_lo _mm_set1_ps(-80.0f)
+
+#define exp_hi_f _mm_set1_ps(80.0f)
+#define exp_lo_f _mm_set1_ps(-80.0f)
 
 #define sign_bits_f_zero_l _mm_castsi128_ps(_mm_set_epi64x(0x7fffffff7fffffff, 0x7fffffff00000000))
 #define ones_f _mm_set1_ps(1.0f)
 #define sign_bits_f _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))
 
 
-static void nnedi3_e0_m16(float *s, const intptr_t n) {
+static inline void nnedi3_e0_m16(float *s, const intptr_t n) {
     __m128 e0_mult = _mm_set1_ps(12102203.161561486f); // (1.0/ln(s))*(2^23)
     __m128 e0_bias = _mm_set1_ps(1064866805.0f); // (2^23)*127.0-486411.0
 
     for (int i = 0; i < n; i += 4) {
         __m128 m0 = _mm_load_ps(s + i);
-        m0 = _mm_min_ps(m0, exp_hi);
-        m0 = _mm_max_ps(m0, exp_lo);
+        m0 = _mm_min_ps(m0, exp_hi_f);
+        m0 = _mm_max_ps(m0, exp_lo_f);
         m0 = _mm_mul_ps(m0, e0_mult);
         m0 = _mm_add_ps(m0, e0_bias);
 
@@ -30,7 +34,250 @@ static void nnedi3_e0_m16(float *s, const intptr_t n) {
 }
 
 
-static void nnedi3_computeNetwork0(const float *input, const float *weights, uint8_t *d) {
+static inline void nnedi3_e1_m16(float *s, const intptr_t n) {
+    __m128 e1_scale = _mm_set1_ps(1.4426950409f); // 1/ln(s)
+    __m128 e1_bias = _mm_set1_ps(12582912.0f); // 3 << 22
+    __m128 e1_c0 = _mm_set1_ps(1.00035f);
+    __m128 e1_c1 = _mm_set1_ps(0.701277797f);
+    __m128 e1_c2 = _mm_set1_ps(0.237348593f);
+
+    for (int i = 0; i < n; i += 8) {
+        __m128 m0 = _mm_load_ps(s + i);
+        __m128 m3 = _mm_load_ps(s + i + 4);
+
+        m0 = _mm_min_ps(m0, exp_hi_f);
+        m3 = _mm_min_ps(m3, exp_hi_f);
+        m0 = _mm_max_ps(m0, exp_lo_f);
+        m3 = _mm_max_ps(m3, exp_lo_f);
+        m0 = _mm_mul_ps(m0, e1_scale);
+        m3 = _mm_mul_ps(m3, e1_scale);
+
+        __m128 m1 = m0;
+        __m128 m4 = m3;
+
+        m0 = _mm_add_ps(m0, e1_bias);
+        m3 = _mm_add_ps(m3, e1_bias);
+
+        __m128 m2 = m0;
+        __m128 m5 = m3;
+
+        m0 = _mm_sub_ps(m0, e1_bias);
+        m3 = _mm_sub_ps(m3, e1_bias);
+
+        m2 = _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(m2), 23));
+        m5 = _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(m5), 23));
+
+        m1 = _mm_sub_ps(m1, m0);
+        m4 = _mm_sub_ps(m4, m3);
+
+        m0 = m1;
+        m3 = m4;
+
+        m1 = _mm_mul_ps(m1, m1);
+        m4 = _mm_mul_ps(m4, m4);
+
+        m0 = _mm_mul_ps(m0, e1_c1);
+        m3 = _mm_mul_ps(m3, e1_c1);
+
+        m1 = _mm_mul_ps(m1, e1_c2);
+        m4 = _mm_mul_ps(m4, e1_c2);
+
+        m0 = _mm_add_ps(m0, e1_c0);
+        m3 = _mm_add_ps(m3, e1_c0);
+
+        m0 = _mm_add_ps(m0, m1);
+        m3 = _mm_add_ps(m3, m4);
+
+        m0 = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(m0), _mm_castps_si128(m2)));
+        m3 = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(m3), _mm_castps_si128(m5)));
+
+        _mm_store_ps(s + i, m0);
+        _mm_store_ps(s + i + 4, m3);
+    }
+}
+
+
+static inline void nnedi3_e2_m16(float *s, const intptr_t n) {
+    __m128 am_0p5 = _mm_set1_ps(0.5f);
+    __m128 am_1 = _mm_set1_ps(1.0f);
+    __m128 exp_rln2 = _mm_set1_ps(1.442695041f);
+    __m128 exp_p0 = _mm_set1_ps(1.261771931e-4f);
+    __m128 exp_p1 = _mm_set1_ps(3.029944077e-2f);
+    __m128 exp_q0 = _mm_set1_ps(3.001985051e-6f);
+    __m128 exp_q1 = _mm_set1_ps(2.524483403e-3f);
+    __m128 exp_q2 = _mm_set1_ps(2.272655482e-1f);
+    __m128 exp_q3 = _mm_set1_ps(2.0f);
+    __m128 exp_c1 = _mm_set1_ps(6.931457520e-1f);
+    __m128 exp_c2 = _mm_set1_ps(1.428606820e-6f);
+    __m128i epi32_1 = _mm_set1_epi32(1);
+    __m128i epi32_0x7f = _mm_set1_epi32(0x7f);
+
+    for (int i = 0; i < n; i += 4) {
+        __m128 m0 = _mm_load_ps(s + i);
+        m0 = _mm_min_ps(m0, exp_hi_f);
+        m0 = _mm_max_ps(m0, exp_lo_f);
+
+        __m128 m1 = exp_rln2;
+        m1 = _mm_mul_ps(m1, m0);
+        m1 = _mm_add_ps(m1, am_0p5);
+
+        __m128 m2 = _mm_setzero_ps();
+        m2 = _mm_cmpnlt_ps(m2, m1);
+        m2 = _mm_castsi128_ps(_mm_and_si128(_mm_castps_si128(m2), epi32_1));
+
+        m1 = _mm_castsi128_ps(_mm_cvttps_epi32(m1));
+        m1 = _mm_castsi128_ps(_mm_sub_epi32(_mm_castps_si128(m1), _mm_castps_si128(m2)));
+
+        __m128 m3 = _mm_cvtepi32_ps(_mm_castps_si128(m1));
+
+        __m128 m4 = exp_c2;
+        __m128 m5 = exp_c1;
+
+        m4 = _mm_mul_ps(m4, m3);
+        m5 = _mm_mul_ps(m5, m3);
+
+        m0 = _mm_sub_ps(m0, m4);
+        m0 = _mm_sub_ps(m0, m5);
+
+        __m128 m6 = exp_q0;
+        m4 = exp_p0;
+
+        m1 = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(m1), epi32_0x7f));
+
+        m2 = m0;
+
+        m0 = _mm_mul_ps(m0, m0);
+        m6 = _mm_mul_ps(m6, m0);
+        m4 = _mm_mul_ps(m4, m0);
+
+        m6 = _mm_add_ps(m6, exp_q1);
+        m4 = _mm_add_ps(m4, exp_p1);
+
+        m6 = _mm_mul_ps(m6, m0);
+        m4 = _mm_mul_ps(m4, m0);
+
+        m6 = _mm_add_ps(m6, exp_q2);
+
+        m4 = _mm_mul_ps(m4, m2);
+        m6 = _mm_mul_ps(m6, m0);
+
+        m0 = am_1;
+
+        m2 = _mm_add_ps(m2, m4);
+        m6 = _mm_add_ps(m6, exp_q3);
+
+        m1 = _mm_castsi128_ps(_mm_slli_epi32(_mm_castps_si128(m1), 23));
+
+        m6 = _mm_sub_ps(m6, m2);
+        m6 = _mm_rcp_ps(m6);
+
+        m2 = _mm_mul_ps(m2, m6);
+        m2 = _mm_add_ps(m2, m2);
+
+        m0 = _mm_add_ps(m0, m2);
+        m0 = _mm_mul_ps(m0, m1);
+
+        _mm_store_ps(s + i, m0);
+    }
+}
+
+
+static inline void nnedi3_weightedAvgElliottMul5_m16(const float *w, const intptr_t n, float *mstd) {
+    __m128 wsum = _mm_setzero_ps();
+    __m128 vsum = _mm_setzero_ps();
+
+    for (int i = 0; i < n; i += 16) {
+        __m128 m0 = _mm_load_ps(w + i);
+        __m128 m1 = _mm_load_ps(w + i + 4);
+        __m128 m2 = _mm_load_ps(w + n + i);
+        __m128 m3 = _mm_load_ps(w + n + i + 4);
+
+        wsum = _mm_add_ps(wsum, m0);
+        wsum = _mm_add_ps(wsum, m1);
+
+        __m128 m4 = m2;
+        __m128 m5 = m3;
+
+        m2 = _mm_and_ps(m2, sign_bits_f);
+        m3 = _mm_and_ps(m3, sign_bits_f);
+
+        m2 = _mm_add_ps(m2, ones_f);
+        m3 = _mm_add_ps(m3, ones_f);
+
+        m2 = _mm_rcp_ps(m2);
+        m3 = _mm_rcp_ps(m3);
+
+        m4 = _mm_mul_ps(m4, m2);
+        m5 = _mm_mul_ps(m5, m3);
+
+        m4 = _mm_mul_ps(m4, m0);
+        m5 = _mm_mul_ps(m5, m1);
+
+        vsum = _mm_add_ps(vsum, m4);
+        vsum = _mm_add_ps(vsum, m5);
+
+
+        m0 = _mm_load_ps(w + i + 8);
+        m1 = _mm_load_ps(w + i + 12);
+        m2 = _mm_load_ps(w + n + i + 8);
+        m3 = _mm_load_ps(w + n + i + 12);
+
+        wsum = _mm_add_ps(wsum, m0);
+        wsum = _mm_add_ps(wsum, m1);
+
+        m4 = m2;
+        m5 = m3;
+
+        m2 = _mm_and_ps(m2, sign_bits_f);
+        m3 = _mm_and_ps(m3, sign_bits_f);
+
+        m2 = _mm_add_ps(m2, ones_f);
+        m3 = _mm_add_ps(m3, ones_f);
+
+        m2 = _mm_rcp_ps(m2);
+        m3 = _mm_rcp_ps(m3);
+
+        m4 = _mm_mul_ps(m4, m2);
+        m5 = _mm_mul_ps(m5, m3);
+
+        m4 = _mm_mul_ps(m4, m0);
+        m5 = _mm_mul_ps(m5, m1);
+
+        vsum = _mm_add_ps(vsum, m4);
+        vsum = _mm_add_ps(vsum, m5);
+    }
+
+    __m128 wsum_high = _mm_setzero_ps();
+    __m128 vsum_high = _mm_setzero_ps();
+    wsum_high = _mm_movehl_ps(wsum_high, wsum);
+    vsum_high = _mm_movehl_ps(vsum_high, vsum);
+
+    wsum = _mm_add_ps(wsum, wsum_high);
+    vsum = _mm_add_ps(vsum, vsum_high);
+
+    __m128 wsum_shuffled = _mm_castsi128_ps(_mm_shufflelo_epi16(_mm_castps_si128(wsum), 14));
+    __m128 vsum_shuffled = _mm_castsi128_ps(_mm_shufflelo_epi16(_mm_castps_si128(vsum), 14));
+
+    wsum = _mm_add_ss(wsum, wsum_shuffled);
+    vsum = _mm_add_ss(vsum, vsum_shuffled);
+
+    __m128 min_weight_sum = _mm_set_ss(1.0e-10f);
+
+    if (_mm_comile_ss(wsum, min_weight_sum)) {
+        mstd[3] += mstd[0];
+    } else {
+        vsum = _mm_mul_ss(vsum, _mm_set_ss(5.0f));
+        wsum = _mm_rcp_ss(wsum);
+        vsum = _mm_mul_ss(vsum, wsum);
+        vsum = _mm_mul_ss(vsum, _mm_load_ss(&mstd[1]));
+        vsum = _mm_add_ss(vsum, _mm_load_ss(&mstd[0]));
+        vsum = _mm_add_ss(vsum, _mm_load_ss(&mstd[3]));
+        _mm_store_ss(&mstd[3], vsum);
+    }
+}
+
+
+static inline void nnedi3_computeNetwork0(const float *input, const float *weights, uint8_t *d) {
     __m128 m0, m1, m2, m3;
     m0 = m1 = m2 = m3 = _mm_setzero_ps();
 
@@ -134,7 +381,7 @@ static void nnedi3_computeNetwork0(const float *input, const float *weights, uin
 }
 
 
-static void nnedi3_dotProd(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
+static inline __attribute__((always_inline)) void nnedi3_dotProd(const float *data, const float *weights, float *vals, const intptr_t n, const intptr_t len, const float *istd) {
     const float *orig_weights = weights;
 
     __m128 m8 = _mm_set1_ps(istd[0]);
@@ -181,4 +428,32 @@ static void nnedi3_dotProd(const float *data, const float *weights, float *vals,
     }
 }
 
+// Finishes the float extract functions, which keep compensated sums in
+// each lane.
+static inline void nnedi3_mstd_float(__m128 sum, __m128 sum_c, __m128 sumsq, __m128 sumsq_c, const intptr_t xdia, const intptr_t ydia, float *mstd) {
+    float lanes[4], lanes_c[4], lanes_sq[4], lanes_sq_c[4];
+    _mm_storeu_ps(lanes, sum);
+    _mm_storeu_ps(lanes_c, sum_c);
+    _mm_storeu_ps(lanes_sq, sumsq);
+    _mm_storeu_ps(lanes_sq_c, sumsq_c);
+
+    double dsum = 0.0, dsumsq = 0.0;
+    for (int i = 0; i < 4; i++) {
+        dsum += (double)lanes[i] - lanes_c[i];
+        dsumsq += (double)lanes_sq[i] - lanes_sq_c[i];
+    }
+
+    const float scale = 1.0f / (xdia * ydia);
+    mstd[0] = dsum * scale;
+    const double tmp = dsumsq * scale - (double)mstd[0] * mstd[0];
+    mstd[3] = 0.0f;
+    if (tmp <= FLT_EPSILON) {
+        mstd[1] = mstd[2] = 0.0f;
+    } else {
+        mstd[1] = (float)sqrt(tmp);
+        mstd[2] = 1.0f / mstd[1];
+    }
+}
+
+
 #endif // SIMD_X86_H
@@ -0,0 +1,165 @@
+/*
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "threadpool.h"
+
+
+typedef struct ThreadPoolJob {
+    ThreadPoolFunc func;
+    void *userdata;
+    int num_bands;
+    int next_band;
+    int bands_done;
+    struct ThreadPoolJob *next;
+} ThreadPoolJob;
+
+
+struct ThreadPool {
+    std::mutex lock;
+    std::condition_variable work_available;
+    std::condition_variable job_done;
+
+    // Jobs that still have bands nobody has started.
+    ThreadPoolJob *first_job;
+    ThreadPoolJob *last_job;
+
+    bool quit;
+
+    std::vector<std::thread> workers;
+};
+
+
+// Must be called with the lock held. Returns -1 when all the bands of the job were started.
+static int takeBand(ThreadPool *pool, ThreadPoolJob *job) {
+    if (job->next_band == job->num_bands)
+        return -1;
+
+    int band = job->next_band++;
+
+    if (job->next_band == job->num_bands) {
+        // Remove the job from the queue.
+        ThreadPoolJob *prev = NULL;
+        for (ThreadPoolJob *j = pool->first_job; j != job; j = j->next)
+            prev = j;
+
+        if (prev)
+            prev->next = job->next;
+        else
+            pool->first_job = job->next;
+
+        if (pool->last_job == job)
+            pool->last_job = prev;
+    }
+
+    return band;
+}
+
+
+static void workerThread(ThreadPool *pool, int worker) {
+    std::unique_lock<std::mutex> guard(pool->lock);
+
+    while (true) {
+        pool->work_available.wait(guard, [pool] { return pool->first_job || pool->quit; });
+
+        if (pool->quit)
+            return;
+
+        ThreadPoolJob *job = pool->first_job;
+        int band = takeBand(pool, job);
+
+        guard.unlock();
+        job->func(job->userdata, band, worker);
+        guard.lock();
+
+        if (++job->bands_done == job->num_bands)
+            pool->job_done.notify_all();
+    }
+}
+
+
+ThreadPool *threadPoolCreate(int num_workers) {
+    ThreadPool *pool = new (std::nothrow) ThreadPool;
+    if (!pool)
+        return NULL;
+
+    pool->first_job = NULL;
+    pool->last_job = NULL;
+    pool->quit = false;
+
+    try {
+        for (int i = 0; i < num_workers; i++)
+            pool->workers.emplace_back(workerThread, pool, i);
+    } catch (const std::system_error &) {
+        threadPoolFree(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+
+void threadPoolFree(ThreadPool *pool) {
+    if (!pool)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->quit = true;
+    }
+    pool->work_available.notify_all();
+
+    for (size_t i = 0; i < pool->workers.size(); i++)
+        pool->workers[i].join();
+
+    delete pool;
+}
+
+
+void threadPoolRun(ThreadPool *pool, ThreadPoolFunc func, void *userdata, int num_bands) {
+    if (num_bands < 1)
+        return;
+
+    ThreadPoolJob job = { func, userdata, num_bands, 0, 0, NULL };
+
+    std::unique_lock<std::mutex> guard(pool->lock);
+
+    if (pool->last_job)
+        pool->last_job->next = &job;
+    else
+        pool->first_job = &job;
+    pool->last_job = &job;
+
+    if (num_bands > 1)
+        pool->work_available.notify_all();
+
+    int band;
+    while ((band = takeBand(pool, &job)) >= 0) {
+        guard.unlock();
+        func(userdata, band, -1);
+        guard.lock();
+
+        job.bands_done++;
+    }
+
+    pool->job_done.wait(guard, [&job] { return job.bands_done == job.num_bands; });
+}
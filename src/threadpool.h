@@ -0,0 +1,39 @@
+/*
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+
+typedef struct ThreadPool ThreadPool;
+
+
+// Called once for every band of a job. worker is the index of the pool
+// thread running the band, or -1 for the thread that called threadPoolRun.
+typedef void (*ThreadPoolFunc)(void *userdata, int band, int worker);
+
+
+// Returns NULL if the threads could not be started.
+ThreadPool *threadPoolCreate(int num_workers);
+
+void threadPoolFree(ThreadPool *pool);
+
+// Runs func for bands 0..num_bands-1 and returns when all of them are done.
+// The calling thread processes bands too. Any number of threads may call
+// this at the same time.
+void threadPoolRun(ThreadPool *pool, ThreadPoolFunc func, void *userdata, int num_bands);
+
+#endif // THREADPOOL_H
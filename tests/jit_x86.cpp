@@ -0,0 +1,302 @@
+/*
+**   This program is free software; you can redistribute it and/or modify
+**   it under the terms of the GNU General Public License as published by
+**   the Free Software Foundation; either version 2 of the License, or
+**   (at your option) any later version.
+**
+**   This program is distributed in the hope that it will be useful,
+**   but WITHOUT ANY WARRANTY; without even the implied warranty of
+**   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**   GNU General Public License for more details.
+**
+**   You should have received a copy of the GNU General Public License
+**   along with this program; if not, write to the Free Software
+**   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Compares the code generated by jit_x86.cpp with the C functions, for
+// every nsize, nns, and qual, with float and int16 weights.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../src/jit_x86.h"
+#include "../src/kernels_c.h"
+#include "../src/simd_dotprod.h"
+
+
+// Same as in nnedi3.cpp.
+static const int xdiaTable[7] = { 8, 16, 32, 48, 8, 16, 32 };
+static const int ydiaTable[7] = { 6, 6, 6, 6, 4, 4, 4 };
+static const int nnsTable[5] = { 16, 32, 64, 128, 256 };
+
+
+// The same pseudorandom inputs every time.
+static uint32_t state = 1;
+
+static uint32_t random32() {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// In [-1, 1).
+static float randomFloat() {
+    return (random32() & 65535) / 32768.0f - 1.0f;
+}
+
+
+static float *alignedMalloc(size_t size) {
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, 64, size))
+        abort();
+    return (float *)ptr;
+}
+
+
+// The AVX2 version uses an approximate reciprocal where the C version
+// divides, so they can disagree about pixels whose final value is very
+// close to 0.
+//
+// The weights are random, and small enough that no sum of 15 bit pixels
+// overflows. Returns the number of pixels that differ.
+static int testPrescreener() {
+    const int weight_sets = 64;
+    const int calls = 256;
+
+    float *weights = alignedMalloc(4 * 64 * sizeof(int16_t) + 28 * sizeof(float));
+    int16_t *ws = (int16_t *)weights;
+    float *wf = (float *)(ws + 4 * 64);
+
+    float *input = alignedMalloc(64 * sizeof(float));
+    int16_t *pixels = (int16_t *)input;
+
+    int errors = 0;
+    int pixels_kept = 0;
+
+    for (int w = 0; w < weight_sets; w++) {
+        for (int i = 0; i < 4 * 64; i++)
+            ws[i] = (int16_t)(random32() % 2047) - 1023;
+        for (int i = 0; i < 4; i++) {
+            wf[i] = randomFloat() * 2e-8f;
+            wf[4 + i] = randomFloat();
+        }
+        for (int i = 8; i < 28; i++)
+            wf[i] = randomFloat();
+
+        JitCode *code = jitComputeNetwork0new_AVX2(weights);
+        if (!code) {
+            fprintf(stderr, "jitComputeNetwork0new_AVX2 failed\n");
+            return 1;
+        }
+        auto computeNetwork0 = (void (*)(const float *, const float *, uint8_t *))jitFunction(code);
+
+        for (int c = 0; c < calls; c++) {
+            for (int i = 0; i < 128; i++)
+                pixels[i] = random32() & 32767;
+
+            uint8_t d[8];
+            // The generated function ignores its weights.
+            computeNetwork0(input, NULL, d);
+
+            for (int g = 0; g < 2; g++) {
+                float vals[8];
+                computeNetwork0new_vals_C(input + g * 32, weights, vals);
+
+                for (int i = 0; i < 4; i++) {
+                    const float tolerance = 1e-3f * (std::fabs(wf[8 + i]) + std::fabs(wf[12 + i]) + std::fabs(wf[16 + i]) + std::fabs(wf[20 + i]));
+                    const int expected = vals[4 + i] > 0.0f;
+
+                    pixels_kept += expected;
+
+                    if (d[g * 4 + i] > 1 || (d[g * 4 + i] != expected && std::fabs(vals[4 + i]) > tolerance)) {
+                        if (errors < 10)
+                            fprintf(stderr, "prescreener: weights %d, call %d, pixel %d: got %d, expected %d (%g)\n", w, c, g * 4 + i, d[g * 4 + i], expected, vals[4 + i]);
+                        errors++;
+                    }
+                }
+            }
+        }
+
+        jitFree(code);
+    }
+
+    // Make sure the inputs exercise both decisions.
+    const int pixels_total = weight_sets * calls * 8;
+    if (pixels_kept < pixels_total / 10 || pixels_kept > pixels_total * 9 / 10) {
+        fprintf(stderr, "prescreener: %d of %d pixels kept, the test inputs are too uniform\n", pixels_kept, pixels_total);
+        errors++;
+    }
+
+    free(input);
+    free(weights);
+
+    return errors;
+}
+
+
+// The generated dotProd may differ from dotProd_C or dotProdS_C by rounding
+// errors only, for n neurons of len inputs, with a batch of a few pixels
+// whose outputs are further apart than n. Returns the number of neurons
+// that differ more.
+static int testDotProd(const int int16, const int n, const int len) {
+    const int weight_size = int16 ? sizeof(int16_t) : sizeof(float);
+    const int stride = predictorBlockStride(n, len, weight_size);
+    const int count = 3;
+    const int vals_stride = n * 2;
+
+    float *input = alignedMalloc(count * PREDICTOR_STRIDE * sizeof(float));
+    float *plain = alignedMalloc(stride * sizeof(float));
+    float *shuffled = alignedMalloc(stride * sizeof(float));
+    float *vals = (float *)malloc(count * vals_stride * sizeof(float));
+    float *vals_c = (float *)malloc(count * n * sizeof(float));
+    float mstd[count][4];
+    int errors = 0;
+
+    JitCode *code = jitDotProd_AVX2(int16, n, len, vals_stride);
+    if (!code) {
+        fprintf(stderr, "jitDotProd_AVX2(%d, %d, %d, %d) failed\n", int16, n, len, vals_stride);
+        return 1;
+    }
+    auto dotProd = (nnedi3DotProdFunc)jitFunction(code);
+
+    for (int t = 0; t < 4; t++) {
+        for (int p = 0; p < count; p++) {
+            mstd[p][0] = mstd[p][1] = mstd[p][3] = 0.0f;
+            mstd[p][2] = 0.5f + (random32() & 1023) / 1024.0f;
+        }
+
+        if (int16) {
+            int16_t *ws = (int16_t *)plain;
+            int16_t *ss = (int16_t *)shuffled;
+            float *wf = (float *)(ws + n * len);
+
+            for (int p = 0; p < count; p++) {
+                int16_t *data = (int16_t *)(input + p * PREDICTOR_STRIDE);
+                for (int k = 0; k < len; k++)
+                    data[k] = (int16_t)(random32() & 2047) - 1024;
+            }
+            for (int j = 0; j < n; j++) {
+                for (int k = 0; k < len; k++) {
+                    ws[j * len + k] = (int16_t)(random32() & 2047) - 1024;
+                    ss[avx2IntWeightPos(j, k, len)] = ws[j * len + k];
+                }
+                wf[(j >> 2) * 8 + (j & 3)] = (random32() & 1023) / (1024.0f * 1024.0f);
+                wf[(j >> 2) * 8 + (j & 3) + 4] = randomFloat();
+            }
+            memcpy(ss + n * len, wf, n * 2 * sizeof(float));
+
+            for (int p = 0; p < count; p++)
+                dotProdS_C(input + p * PREDICTOR_STRIDE, plain, vals_c + p * n, n, len, &mstd[p][2]);
+        } else {
+            for (int p = 0; p < count; p++)
+                for (int k = 0; k < len; k++)
+                    input[p * PREDICTOR_STRIDE + k] = randomFloat();
+            for (int j = 0; j < n; j++) {
+                for (int k = 0; k < len; k++) {
+                    plain[j * len + k] = randomFloat();
+                    shuffled[avx2WeightPos(j, k, len)] = plain[j * len + k];
+                }
+                plain[n * len + j] = shuffled[n * len + j] = randomFloat();
+            }
+
+            for (int p = 0; p < count; p++)
+                dotProd_C(input + p * PREDICTOR_STRIDE, plain, vals_c + p * n, n, len, &mstd[p][2]);
+        }
+
+        for (int i = 0; i < count * vals_stride; i++)
+            vals[i] = 12345.0f;
+
+        // The generated function ignores vals_stride and n.
+        dotProd(input, shuffled, vals, mstd[0], count, 0, 0);
+
+        for (int p = 0; p < count; p++) {
+            const float scale = mstd[p][2];
+
+            for (int j = n; j < vals_stride; j++) {
+                if (vals[p * vals_stride + j] != 12345.0f) {
+                    if (errors < 10)
+                        fprintf(stderr, "dotProd: int16 %d, n %d, len %d, pixel %d: wrote past the outputs\n", int16, n, len, p);
+                    errors++;
+                    break;
+                }
+            }
+
+            for (int j = 0; j < n; j++) {
+                // The sum of the absolute values of the terms bounds the rounding errors.
+                double bound;
+                if (int16) {
+                    const int16_t *data = (const int16_t *)(input + p * PREDICTOR_STRIDE);
+                    const int16_t *ws = (const int16_t *)plain;
+                    const float *wf = (const float *)(ws + n * len);
+                    double sum = 0.0;
+                    for (int k = 0; k < len; k++)
+                        sum += std::abs(data[k] * ws[j * len + k]);
+                    bound = sum * wf[(j >> 2) * 8 + (j & 3)] * scale + std::fabs(wf[(j >> 2) * 8 + (j & 3) + 4]);
+                } else {
+                    const float *data = input + p * PREDICTOR_STRIDE;
+                    double sum = 0.0;
+                    for (int k = 0; k < len; k++)
+                        sum += std::fabs(data[k] * plain[j * len + k]);
+                    bound = sum * scale + std::fabs(plain[n * len + j]);
+                }
+
+                const float got = vals[p * vals_stride + j];
+                const float expected = vals_c[p * n + j];
+
+                if (!(std::fabs(got - expected) <= 1e-4 * bound)) {
+                    if (errors < 10)
+                        fprintf(stderr, "dotProd: int16 %d, n %d, len %d, pixel %d, neuron %d: got %g, expected %g\n", int16, n, len, p, j, got, expected);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    jitFree(code);
+
+    free(input);
+    free(plain);
+    free(shuffled);
+    free(vals);
+    free(vals_c);
+
+    return errors;
+}
+
+
+int main() {
+    // Like the filter, which only uses the generated code in place of the
+    // AVX2 functions.
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma")) {
+        printf("SKIP: the CPU doesn't have AVX2 and FMA3\n");
+        return 77; // skipped, for automake
+    }
+
+    int errors = testPrescreener();
+
+    for (int nsize = 0; nsize < 7; nsize++) {
+        const int asize = xdiaTable[nsize] * ydiaTable[nsize];
+
+        for (int nns = 0; nns < 5; nns++) {
+            for (int qual = 1; qual <= 2; qual++) {
+                for (int int16 = 0; int16 <= 1; int16++) {
+                    const int weight_size = int16 ? sizeof(int16_t) : sizeof(float);
+                    const int block_neurons = predictorBlockNeurons(nnsTable[nns] * qual, asize, weight_size);
+
+                    errors += testDotProd(int16, block_neurons, asize);
+                }
+            }
+        }
+    }
+
+    if (errors) {
+        printf("FAIL: %d errors\n", errors);
+        return 1;
+    }
+
+    printf("PASS\n");
+    return 0;
+}